@@ -319,6 +319,8 @@ extern int errno;                 /* place where the error numbers go */
 #define SI_PROC_ADDR       1    /* address of process table */
 #define SI_PROC_TAB        2    /* copy of entire process table */
 #define SI_DMAP_TAB        3    /* get device <-> driver mappings */
+#define SI_TEXT_STATS      4    /* PM text cache and EXEC statistics */
+#define SI_MEM_STATS       5    /* PM free memory and fragmentation */
 
 /* NULL must be defined in <unistd.h> according to POSIX Sec. 2.7.1. */
 #define NULL    ((void *)0)
@@ -444,6 +446,8 @@ _PROTOTYPE( int getprocnr, (void)                                       );
 _PROTOTYPE( int findproc, (char *proc_name, int *proc_nr)               );
 _PROTOTYPE( int allocmem, (phys_bytes size, phys_bytes *base)           );
 _PROTOTYPE( int freemem, (phys_bytes size, phys_bytes base)             );
+_PROTOTYPE( pid_t spawn, (const char *_path, char *const _argv[],
+        char *const _envp[], const struct spawn_fdact *_acts, int _nacts) );
 #define DEV_MAP 1
 #define DEV_UNMAP 2
 #define mapdriver(driver, device, style) devctl(DEV_MAP, driver, device, style)
@@ -947,7 +951,9 @@ struct winsize
 
 /* This library provides generic watchdog timer management functionality.
  * The functions operate on a timer queue provided by the caller. Note that
- * the timers must use absolute time to allow sorting. The library provides: 
+ * the timers must use absolute time to allow sorting. A queue is a pointer
+ * to the timer that expires first; the other timers hang below it in a heap.
+ * The library provides: 
  *
  *    tmrs_settimer:      (re)set a new watchdog timer in the timers queue 
  *    tmrs_clrtimer:      remove a timer from both the timers queue 
@@ -976,6 +982,8 @@ typedef union { int ta_int; long ta_long; void *ta_ptr; } tmr_arg_t;
 typedef struct timer
 {
   struct timer  *tmr_next;      /* next in a timer chain */
+  struct timer  *tmr_prev;      /* previous in chain, or parent in heap */
+  struct timer  *tmr_child;     /* first of the timers that expire later */
   clock_t       tmr_exp_time;   /* expiration time */
   tmr_func_t    tmr_func;       /* function to call when expired */
   tmr_arg_t     tmr_arg;        /* random argument */
@@ -995,7 +1003,7 @@ typedef struct timer
  * will be broken.
  */
 #define tmr_inittimer(tp) (void)((tp)->tmr_exp_time = TMR_NEVER, \
-        (tp)->tmr_next = NULL)
+        (tp)->tmr_next = (tp)->tmr_prev = (tp)->tmr_child = NULL)
 
 /* The following generic timer management functions are available. They
  * can be used to operate on the lists of timers. Adding a timer to a list 
@@ -1544,15 +1552,26 @@ int ioctl(int _fd, int _request, void *_data);
 /* Number of slots in the process table for non-kernel processes. The number
  * of system processes defines how many processes with special privileges 
  * there can be. User processes share the same properties and count for one. 
+ * The tables are sized for NR_PROCS processes, but only as many slots are
+ * used as the 'nr_procs' boot parameter says, NR_PROCS_DEF if it is unset.
+ * The kernel, PM, FS and TTY tables are static and cost all their slots,
+ * used or not, so NR_PROCS should not be much larger than needed.
  *
  * These can be changed in sys_config.h.
  */
 #define NR_PROCS          _NR_PROCS 
+#define NR_PROCS_DEF      _NR_PROCS_DEF
 #define NR_SYS_PROCS      _NR_SYS_PROCS
 
 #define NR_BUFS 128
 #define NR_BUF_HASH 128
 
+/* Number of blocks FS keeps for all tmpfs file systems together.  The pool
+ * is a static array in FS, so it costs NR_TMP_BUFS * MAX_BLOCK_SIZE bytes of
+ * memory whether or not a tmpfs is mounted.
+ */
+#define NR_TMP_BUFS      128
+
 /* Number of controller tasks (/dev/cN device classes). */
 #define NR_CTRLRS          2
 
@@ -1642,7 +1661,8 @@ int ioctl(int _fd, int _request, void *_data);
 #define _PTR_SIZE       _EM_WSIZE
 #endif
 
-#define _NR_PROCS       64
+#define _NR_PROCS       256
+#define _NR_PROCS_DEF   64
 #define _NR_SYS_PROCS   32
 
 /* Set the CHIP type based on the machine selected. The symbol CHIP is actually
@@ -1866,11 +1886,68 @@ struct vir_cp_req {
   phys_bytes count;
 };
 
+/* Pending kernel signals of one process, as passed in bulk by SYS_KSIGS. */
+struct ksig {
+  int ks_proc;                  /* process that was signaled */
+  sigset_t ks_map;              /* the signals, a bit map */
+};
+
 typedef struct {
   vir_bytes iov_addr;           /* address of an I/O buffer */
   vir_bytes iov_size;           /* sizeof an I/O buffer */
 } iovec_t;
 
+/* Memory grants. A system process publishes a range of memory, its own or,
+ * if it is trusted with virtual copies, that of a process it serves, and the
+ * grantee copies from or to that range by grant id with SYS_SAFECOPY. The
+ * grantee cannot touch any memory outside the granted range.
+ */
+typedef int cp_grant_id_t;
+#define GRANT_INVALID   ((cp_grant_id_t) -1)
+
+typedef struct {
+  int cp_flags;                 /* CPF_READ, CPF_WRITE, CPF_USED */
+  int cp_who;                   /* process that may use the grant, or ANY */
+  int cp_owner;                 /* process whose memory is granted */
+  vir_bytes cp_addr;            /* start of granted range */
+  vir_bytes cp_len;             /* length of granted range */
+  phys_bytes cp_phys;           /* physical start, computed at grant time */
+  unsigned long cp_mapgen;      /* owner's map generation at grant time */
+} cp_grant_t;
+
+/* File action done by SPAWN on the child's descriptors before the new
+ * program runs: close sfa_fd, or make it a copy of sfa_oldfd as dup2() would.
+ */
+struct spawn_fdact {
+  int sfa_fd;                   /* descriptor in the child to act on */
+  int sfa_oldfd;                /* descriptor to copy, or -1 to close sfa_fd */
+};
+#define SPAWN_FDACTS_MAX  16    /* max number of file actions per SPAWN */
+
+/* Free physical memory as seen by PM, obtained with SI_MEM_STATS.  Free
+ * memory is fragmented to the degree that ms_largest falls short of ms_free.
+ */
+struct mem_stats {
+  phys_clicks ms_free;          /* total size of all holes */
+  phys_clicks ms_largest;       /* size of the largest hole */
+  int ms_holes;                 /* number of holes */
+  unsigned long ms_allocs;      /* successful allocations */
+  unsigned long ms_fails;       /* allocations that found no hole */
+  unsigned long ms_frees;       /* blocks returned */
+};
+
+/* Statistics of PM's cache of text segments, obtained with SI_TEXT_STATS.
+ * The average EXEC latency is ts_exec_ticks / ts_execs.
+ */
+struct text_stats {
+  unsigned long ts_hits;        /* EXECs that found their text in the cache */
+  unsigned long ts_misses;      /* EXECs that had to read their text */
+  unsigned long ts_evicts;      /* entries freed for room or memory */
+  unsigned long ts_stale;       /* entries freed because the file changed */
+  unsigned long ts_execs;       /* EXECs and SPAWNs that were completed */
+  clock_t ts_exec_ticks;        /* total ticks spent in them */
+};
+
 /* PM passes the address of a structure of this type to KERNEL when
  * sys_sendsig() is invoked as part of the signal catching mechanism.
  * The structure contain all the information that KERNEL needs to build
@@ -2002,6 +2079,22 @@ typedef struct {
 #define m8_p3  m_u.m_m8.m8p3
 #define m8_p4  m_u.m_m8.m8p4
 
+/* Entry in a table of asynchronous messages. A system process fills in the
+ * destination and message, sets AMF_VALID, and passes the table to senda().
+ * The kernel sets AMF_DONE and the result once the message is delivered or
+ * cannot be delivered. The sender may then reuse the entry.
+ */
+typedef struct asynmsg {
+  int flags;                    /* AMF_VALID, AMF_DONE */
+  int dst;                      /* destination process */
+  int result;                   /* delivery status, valid if AMF_DONE */
+  message msg;                  /* the message to deliver */
+} asynmsg_t;
+
+#define AMF_EMPTY       0x00    /* entry not in use */
+#define AMF_VALID       0x01    /* entry contains a message to be sent */
+#define AMF_DONE        0x02    /* message delivered, or failed */
+
 /*==========================================================================* 
  * Minix run-time system (IPC).                                             *
  *==========================================================================*/ 
@@ -2014,6 +2107,7 @@ typedef struct {
 #define send            _send
 #define nb_receive      _nb_receive
 #define nb_send         _nb_send
+#define senda           _senda
 //以下是消息传递的原语的原型
 _PROTOTYPE( int echo, (message *m_ptr)                                  );
 _PROTOTYPE( int notify, (int dest)                                      );
@@ -2022,6 +2116,7 @@ _PROTOTYPE( int receive, (int src, message *m_ptr)                      );
 _PROTOTYPE( int send, (int dest, message *m_ptr)                        );
 _PROTOTYPE( int nb_receive, (int src, message *m_ptr)                   );
 _PROTOTYPE( int nb_send, (int dest, message *m_ptr)                     );
+_PROTOTYPE( int senda, (asynmsg_t *table, size_t count)                 );
 
 #endif /* _IPC_H */
 
@@ -2120,10 +2215,21 @@ _PROTOTYPE(int sys_memset, (unsigned long pattern,
                 phys_bytes base, phys_bytes bytes));
 
 /* Vectored virtual / physical copy calls. */
-#if DEAD_CODE           /* library part not yet implemented */
-_PROTOTYPE(int sys_virvcopy, (phys_cp_req *vec_ptr,int vec_size,int *nr_ok));
-_PROTOTYPE(int sys_physvcopy, (phys_cp_req *vec_ptr,int vec_size,int *nr_ok));
-#endif
+_PROTOTYPE(int sys_virvcopy, (struct vir_cp_req *vec_ptr, int vec_size,
+        int *nr_ok));
+_PROTOTYPE(int sys_physvcopy, (struct vir_cp_req *vec_ptr, int vec_size,
+        int *nr_ok));
+
+/* Memory grants and copies through them. */
+#define sys_safecopyfrom(src_proc, gid, offset, dst_vir, bytes) \
+        sys_safecopy(CPF_READ, src_proc, gid, offset, dst_vir, bytes)
+#define sys_safecopyto(dst_proc, gid, offset, src_vir, bytes) \
+        sys_safecopy(CPF_WRITE, dst_proc, gid, offset, src_vir, bytes)
+_PROTOTYPE(int sys_safecopy, (int req, int granter, cp_grant_id_t gid,
+        vir_bytes offset, vir_bytes addr, vir_bytes bytes));
+_PROTOTYPE(int sys_setgrant, (cp_grant_id_t *gid, int who, int owner,
+        vir_bytes addr, vir_bytes bytes, int access));
+#define sys_rmgrant(gid) sys_setgrant(&(gid), NONE, SELF, 0, 0, 0)
 
 _PROTOTYPE(int sys_umap, (int proc_nr, int seg, vir_bytes vir_addr,
          vir_bytes bytes, phys_bytes *phys_addr));
@@ -2154,6 +2260,8 @@ _PROTOTYPE(int sys_sigsend, (int proc_nr, struct sigmsg *sig_ctxt) );
 _PROTOTYPE(int sys_sigreturn, (int proc_nr, struct sigmsg *sig_ctxt) );
 _PROTOTYPE(int sys_getksig, (int *k_proc_nr, sigset_t *k_sig_map) ); 
 _PROTOTYPE(int sys_endksig, (int proc_nr) );
+_PROTOTYPE(int sys_getksigs, (struct ksig *ks, int max, int *count) );
+_PROTOTYPE(int sys_endksigs, (struct ksig *ks, int count) );
 
 /* NOTE:  two different approaches were used to distinguish the device I/O
  * types 'byte', 'word', 'long':  the latter uses #define and results in a
@@ -2245,7 +2353,7 @@ _PROTOTYPE( int tickdelay, (clock_t ticks));
                                       include/minix/callnr.h
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
-#define NCALLS            91    /* number of system calls allowed */
+#define NCALLS            92    /* number of system calls allowed */
 
 #define EXIT               1 
 #define FORK               2 
@@ -2299,9 +2407,15 @@ _PROTOTYPE( int tickdelay, (clock_t ticks));
 
 /* The following are not system calls, but are processed like them. */
 #define UNPAUSE           65    /* to MM or FS:  check for EINTR */
+#define EXEC_LOAD         66    /* to FS:  load an EXEC image for PM */
 #define REVIVE            67    /* to FS:  revive a sleeping process */
 #define TASK_REPLY        68    /* to FS:  reply code from tty task */
 
+/* Flags in an EXEC_LOAD request from PM to FS. */
+#define LD_SHARED       0x01    /* text is in memory already; skip it */
+#define LD_SETUID       0x02    /* effective uid becomes load_uid */
+#define LD_SETGID       0x04    /* effective gid becomes load_gid */
+
 /* Posix signal handling. */
 #define SIGACTION         71
 #define SIGSUSPEND        72
@@ -2326,6 +2440,7 @@ _PROTOTYPE( int tickdelay, (clock_t ticks));
 #define GETPRIORITY       88    /* to PM */
 #define SETPRIORITY       89    /* to PM */
 #define GETTIMEOFDAY      90    /* to PM */
+#define SPAWN             91    /* to PM or FS */
 
 
 
@@ -2554,7 +2669,11 @@ _PROTOTYPE( int tickdelay, (clock_t ticks));
 #  define SYS_GETINFO    (KERNEL_CALL + 26)     /* sys_getinfo() */
 #  define SYS_ABORT      (KERNEL_CALL + 27)     /* sys_abort() */
 
-#define NR_SYS_CALLS    28      /* number of system calls */ 
+#  define SYS_SETGRANT   (KERNEL_CALL + 28)     /* sys_setgrant() */
+#  define SYS_SAFECOPY   (KERNEL_CALL + 29)     /* sys_safecopyfrom/to() */
+#  define SYS_KSIGS      (KERNEL_CALL + 30)     /* sys_getksigs/endksigs() */
+
+#define NR_SYS_CALLS    31      /* number of system calls */ 
 
 /* Field names for SYS_MEMSET, SYS_SEGCTL. */
 #define MEM_PTR         m2_p1   /* base */
@@ -2632,6 +2751,25 @@ _PROTOTYPE( int tickdelay, (clock_t ticks));
 #define CP_DST_ADDR     m5_l2   /* address where data go to */
 #define CP_NR_BYTES     m5_l3   /* number of bytes to copy */
 
+/* Field names for SYS_SETGRANT. */
+#define SG_GRANT_ID    m2_i1    /* grant slot, or GRANT_INVALID for new one */
+#define SG_WHO         m2_i2    /* process that may use the grant, or ANY */
+#define SG_OWNER       m2_i3    /* process whose memory is granted, or SELF */
+#define SG_ADDR        m2_p1    /* start of granted range (D space) */
+#define SG_LEN         m2_l1    /* length of granted range */
+#define SG_FLAGS       m2_l2    /* access allowed, 0 revokes the grant */
+#  define CPF_READ       0x01   /* grantee may read from the range */
+#  define CPF_WRITE      0x02   /* grantee may write to the range */
+#  define CPF_USED       0x80   /* grant slot in use (kernel internal) */
+
+/* Field names for SYS_SAFECOPY. */
+#define SCP_REQUEST    m5_c1    /* CPF_READ (copy from) or CPF_WRITE (to) */
+#define SCP_FROM_TO    m5_i1    /* process that made the grant */
+#define SCP_GID        m5_i2    /* grant id at that process */
+#define SCP_OFFSET     m5_l1    /* offset within the granted range */
+#define SCP_ADDRESS    m5_l2    /* address in the caller's D space */
+#define SCP_BYTES      m5_l3    /* number of bytes to copy */
+
 /* Field names for SYS_VCOPY and SYS_VVIRCOPY. */
 #define VCP_NR_OK       m1_i2   /* number of successfull copies */
 #define VCP_VEC_SIZE    m1_i3   /* size of copy vector */
@@ -2688,6 +2826,8 @@ _PROTOTYPE( int tickdelay, (clock_t ticks));
 #define SIG_FLAGS      m2_i3    /* signal flags field */
 #define SIG_MAP        m2_l1    /* used by kernel to pass signal bit map */
 #define SIG_CTXT_PTR   m2_p1    /* pointer to info to restore signal context */
+#define SIG_VEC        m2_p1    /* vector of struct ksig for SYS_KSIGS */
+#define SIG_COUNT      m2_i3    /* number of entries in SIG_VEC */
 
 /* Field names for SYS_FORK, _EXEC, _EXIT, _NEWMAP. */
 #define PR_PROC_NR     m1_i1    /* indicates a (child) process */
@@ -2848,6 +2988,8 @@ extern struct dmap {
 #define LOG_MAJOR                 15    /* major device for log driver */
 #  define IS_KLOG_DEV              0    /* minor device for /dev/klog */
 
+#define TMPFS_MAJOR               18    /* major device for tmpfs (no driver) */
+
 #endif /* _DMAP_H */
 
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -3063,6 +3205,9 @@ void intr_enable(void);
 #define USE_PHYSCOPY       1    /* copy using physical addressing */
 #define USE_PHYSVCOPY      1    /* vector with physical copy requests */
 #define USE_MEMSET         1    /* write char to a given memory area */
+#define USE_SETGRANT       1    /* publish or revoke a memory grant */
+#define USE_SAFECOPY       1    /* copy through a memory grant */
+#define USE_KSIGS          1    /* get and finish kernel signals in bulk */
 
 /* Length of program names stored in the process table. This is only used
  * for the debugging dumps that can be generated with the IS server. The PM
@@ -3089,6 +3234,8 @@ void intr_enable(void);
 #define NR_IRQ_HOOKS      16            /* number of interrupt hooks */
 #define VDEVIO_BUF_SIZE   64            /* max elements per VDEVIO request */
 #define VCOPY_VEC_SIZE    16            /* max elements per VCOPY request */
+#define NR_GRANTS         16            /* memory grants per system process */
+#define ASYN_TAB_SIZE     64            /* max entries per senda() table */
 
 /* How many bytes for the kernel stack. Space allocated in mpx.s. */
 #define K_STACK_BYTES   1024    
@@ -3325,6 +3472,7 @@ _PROTOTYPE( clock_t get_uptime, (void)                                  );
 _PROTOTYPE( unsigned long read_clock, (void)                            );
 _PROTOTYPE( void set_timer, (struct timer *tp, clock_t t, tmr_func_t f) );
 _PROTOTYPE( void reset_timer, (struct timer *tp)                        );
+_PROTOTYPE( void clock_switch, (struct proc *rp)                        );
 
 /* main.c */
 _PROTOTYPE( void main, (void)                                           );
@@ -3392,6 +3540,7 @@ _PROTOTYPE( void level0, (void (*func)(void))                           );
 _PROTOTYPE( void monitor, (void)                                        );
 _PROTOTYPE( void read_tsc, (unsigned long *high, unsigned long *low)    );
 _PROTOTYPE( unsigned long read_cpu_flags, (void)                        );
+_PROTOTYPE( int bit_scan, (unsigned bits)                               );
 
 /* mpx*.s */
 _PROTOTYPE( void idle_task, (void)                                      );
@@ -3482,6 +3631,7 @@ EXTERN char shutdown_started;           /* TRUE after shutdowns / reboots */
 /* Kernel information structures. This groups vital kernel information. */
 EXTERN phys_bytes aout;                 /* address of a.out headers */
 EXTERN struct kinfo kinfo;              /* kernel information for users */
+EXTERN int nr_procs;                    /* # of process slots in use */
 EXTERN struct machine machine;          /* machine information for users */
 EXTERN struct kmessages kmess;          /* diagnostic messages in kernel */
 EXTERN struct randomness krandom;       /* gather kernel random information */
@@ -3503,6 +3653,7 @@ EXTERN int irq_use;                             /* map of all in-use irq's */
 /* Miscellaneous. */
 EXTERN reg_t mon_ss, mon_sp;            /* boot monitor stack */
 EXTERN int mon_return;                  /* true if we can return to monitor */
+EXTERN unsigned long map_gen;           /* last memory map generation used */
 
 /* Variables that are initialized elsewhere are just extern here. */
 extern struct boot_image image[];       /* system image processes */
@@ -3541,6 +3692,7 @@ EXTERN _PROTOTYPE( void (*level0_func), (void) );
  * numbers are carefully defined so that it can easily be seen (based on 
  * the bits that are on) which checks should be done in sys_call().
  */
+#define SENDA              0    /* 0 0 0 0 :  asynchronous send */
 #define SEND               1    /* 0 0 0 1 :  blocking send */
 #define RECEIVE            2    /* 0 0 1 0 :  blocking receive */
 #define SENDREC            3    /* 0 0 1 1 :  SEND + RECEIVE */
@@ -3590,6 +3742,7 @@ struct proc {
   char p_quantum_size;          /* 分配给进程的时间片 */
 
   struct mem_map p_memmap[NR_LOCAL_SEGS];   /* 内存映射 memory map (T, D, S) */
+  unsigned long p_mapgen;       /* generation of the current memory map */
 
   clock_t p_user_time;          /* 用户时间滴答user time in ticks */
   clock_t p_sys_time;           /* 系统时间滴答sys time in ticks */
@@ -3632,7 +3785,7 @@ struct proc {
 /* Magic process table addresses. */
 #define BEG_PROC_ADDR (&proc[0])
 #define BEG_USER_ADDR (&proc[NR_TASKS])
-#define END_PROC_ADDR (&proc[NR_TASKS + NR_PROCS])
+#define END_PROC_ADDR (&proc[NR_TASKS + nr_procs])
 
 #define NIL_PROC          ((struct proc *) 0)           
 #define NIL_SYS_PROC      ((struct proc *) 1)           
@@ -3640,7 +3793,7 @@ struct proc {
 #define proc_addr(n)      (pproc_addr + NR_TASKS)[(n)]
 #define proc_nr(p)        ((p)->p_nr)
 
-#define isokprocn(n)      ((unsigned) ((n) + NR_TASKS) < NR_PROCS + NR_TASKS)
+#define isokprocn(n)      ((unsigned) ((n) + NR_TASKS) < nr_procs + NR_TASKS)
 #define isemptyn(n)       isemptyp(proc_addr(n)) 
 #define isemptyp(p)       ((p)->p_rts_flags == SLOT_FREE)
 #define iskernelp(p)      iskerneln((p)->p_nr)
@@ -3729,11 +3882,17 @@ struct priv {
   long s_call_mask;             /* allowed kernel calls */
 
   sys_map_t s_notify_pending;   /* bit map with pending notifications */
+  short s_notify_next;          /* id to start looking for notifications */
+  sys_map_t s_asyn_pending;     /* senders with asynchronous messages */
   irq_id_t s_int_pending;       /* pending hardware interrupts */
   sigset_t s_sig_pending;       /* pending signals */
 
+  vir_bytes s_asyntab;          /* table with asynchronous messages */
+  int s_asynsize;               /* number of entries in that table */
+
   timer_t s_alarm_timer;        /* synchronous alarm timer */ 
   struct far_mem s_farmem[NR_REMOTE_SEGS];  /* remote memory map */
+  cp_grant_t s_grants[NR_GRANTS];  /* memory granted to other processes */
   reg_t *s_stack_guard;         /* stack guard word for kernel tasks */
 };
 
@@ -3998,10 +4157,11 @@ PUBLIC char *t_stack[TOT_STACK_SPACE / sizeof(char *)];
 #define PM_C    ~(c(SYS_DEVIO) | c(SYS_SDEVIO) | c(SYS_VDEVIO) \
     | c(SYS_IRQCTL) | c(SYS_INT86))
 #define FS_C    (c(SYS_KILL) | c(SYS_VIRCOPY) | c(SYS_VIRVCOPY) | c(SYS_UMAP) \
-    | c(SYS_GETINFO) | c(SYS_EXIT) | c(SYS_TIMES) | c(SYS_SETALARM))
+    | c(SYS_GETINFO) | c(SYS_EXIT) | c(SYS_TIMES) | c(SYS_SETALARM) \
+    | c(SYS_SETGRANT) | c(SYS_SAFECOPY))
 #define DRV_C   (FS_C | c(SYS_SEGCTL) | c(SYS_IRQCTL) | c(SYS_INT86) \
     | c(SYS_DEVIO) | c(SYS_VDEVIO) | c(SYS_SDEVIO)) 
-#define MEM_C   (DRV_C | c(SYS_PHYSCOPY) | c(SYS_PHYSVCOPY))
+#define MEM_C   (DRV_C | c(SYS_PHYSCOPY) | c(SYS_PHYSVCOPY) | c(SYS_MEMSET))
 
 /* The system image table lists all programs that are part of the boot image. 
  * The order of the entries here MUST agree with the order of the programs
@@ -4655,8 +4815,14 @@ U16_t parmoff, parmsize;        /* boot parameters offset and length */
   kinfo.params_size = MIN(parmsize,sizeof(params)-2);
   phys_copy(kinfo.params_base, vir2phys(params), kinfo.params_size);
 
+  /* Number of process slots to use.  The tables have room for NR_PROCS. */
+  value = get_value(params, "nr_procs");
+  nr_procs = (value == NIL_PTR) ? NR_PROCS_DEF : atoi(value);
+  if (nr_procs < NR_BOOT_PROCS) nr_procs = NR_BOOT_PROCS;
+  if (nr_procs > NR_PROCS) nr_procs = NR_PROCS;
+
   /* Record miscellaneous information for user-space servers. */
-  kinfo.nr_procs = NR_PROCS;
+  kinfo.nr_procs = nr_procs;
   kinfo.nr_tasks = NR_TASKS;
   strncpy(kinfo.release, OS_RELEASE, sizeof(kinfo.release));
   kinfo.release[sizeof(kinfo.release)-1] = '\0';
@@ -5042,6 +5208,14 @@ FORWARD _PROTOTYPE( int mini_send, (struct proc *caller_ptr, int dst,
 FORWARD _PROTOTYPE( int mini_receive, (struct proc *caller_ptr, int src,
                 message *m_ptr, unsigned flags) );
 FORWARD _PROTOTYPE( int mini_notify, (struct proc *caller_ptr, int dst) );
+FORWARD _PROTOTYPE( int find_notify, (struct priv *privp, int src) );
+FORWARD _PROTOTYPE( int mini_senda, (struct proc *caller_ptr,
+                asynmsg_t *table, int size) );
+FORWARD _PROTOTYPE( int try_async, (struct proc *caller_ptr, int src,
+                message *m_ptr) );
+FORWARD _PROTOTYPE( int asyn_deliver, (struct proc *src_ptr,
+                struct proc *dst_ptr, message *m_ptr) );
+FORWARD _PROTOTYPE( int asyn_busy, (struct proc *caller_ptr) );
 
 FORWARD _PROTOTYPE( void enqueue, (struct proc *rp) );
 FORWARD _PROTOTYPE( void dequeue, (struct proc *rp) );
@@ -5098,8 +5272,11 @@ message *m_ptr;                 /* pointer to message in the caller's space */
       return(ECALLDENIED);              /* trap denied by mask or kernel */
   }
   
-  /* Require a valid source and/ or destination process, unless echoing. */
-  if (! (isokprocn(src_dst) || src_dst == ANY || function == ECHO)) { 
+  /* Require a valid source and/ or destination process, unless echoing. 
+   * For SENDA, 'src_dst' holds the size of the table with messages instead.
+   */
+  if (! (isokprocn(src_dst) || src_dst == ANY || function == ECHO
+          || function == SENDA)) { 
       kprintf("sys_call:  invalid src_dst, src_dst %d, caller %d\n", 
           src_dst, proc_nr(caller_ptr));
       return(EBADSRCDST);               /* invalid process number */
@@ -5146,6 +5323,7 @@ message *m_ptr;                 /* pointer to message in the caller's space */
    *   - SEND:     sender blocks until its message has been delivered
    *   - RECEIVE:  receiver blocks until an acceptable message has arrived
    *   - NOTIFY:   nonblocking call; deliver notification or mark pending
+   *   - SENDA:    nonblocking call; deliver or queue a table of messages
    *   - ECHO:     nonblocking call; directly echo back the message 
    */
   switch(function) {
@@ -5166,6 +5344,9 @@ message *m_ptr;                 /* pointer to message in the caller's space */
   case NOTIFY: 
       result = mini_notify(caller_ptr, src_dst);
       break;
+  case SENDA: 
+      result = mini_senda(caller_ptr, (asynmsg_t *) m_ptr, src_dst);
+      break;
   case ECHO: 
       CopyMess(caller_ptr->p_nr, caller_ptr, m_ptr, caller_ptr, m_ptr);
       result = OK;
@@ -5246,9 +5427,7 @@ unsigned flags;                         /* system call flags */
   register struct notification **ntf_q_pp;
   message m;
   int bit_nr;
-  sys_map_t *map;
-  bitchunk_t *chunk;
-  int i, src_id, src_proc_nr;
+  int src_id, src_proc_nr;
 
   /* Check to see if a message from desired source is already available.
    * The caller's SENDING flag may be set if SENDREC couldn't send. If it is
@@ -5259,17 +5438,10 @@ unsigned flags;                         /* system call flags */
     /* Check if there are pending notifications, except for SENDREC. */
     if (! (priv(caller_ptr)->s_flags & SENDREC_BUSY)) {
 
-        map = &priv(caller_ptr)->s_notify_pending;
-        for (chunk=&map->chunk[0]; chunk<&map->chunk[NR_SYS_CHUNKS]; chunk++) {
-
-            /* Find a pending notification from the requested source. */ 
-            if (! *chunk) continue;                     /* no bits in chunk */
-            for (i=0; ! (*chunk & (1<<i)); ++i) {}      /* look up the bit */
-            src_id = (chunk - &map->chunk[0]) * BITCHUNK_BITS + i;
-            if (src_id >= NR_SYS_PROCS) break;          /* out of range */
+        /* Find a pending notification from the requested source. */ 
+        if ((src_id = find_notify(priv(caller_ptr), src)) >= 0) {
             src_proc_nr = id_to_nr(src_id);             /* get source proc */
-            if (src!=ANY && src!=src_proc_nr) continue; /* source not ok */
-            *chunk &= ~(1 << i);                        /* no longer pending */
+            unset_sys_bit(priv(caller_ptr)->s_notify_pending, src_id);
 
             /* Found a suitable source, deliver the notification message. */
             BuildMess(&m, src_proc_nr, caller_ptr);     /* assemble message */
@@ -5290,6 +5462,12 @@ unsigned flags;                         /* system call flags */
         }
         xpp = &(*xpp)->p_q_link;                /* proceed to next */
     }
+
+    /* Check for asynchronous messages from a suitable source.  These are no
+     * replies either, so they cannot interrupt SENDREC.
+     */
+    if (! (priv(caller_ptr)->s_flags & SENDREC_BUSY) &&
+        try_async(caller_ptr, src, m_ptr) == OK) return(OK);
   }
 
   /* No suitable message is available or the caller couldn't send in SENDREC. 
@@ -5306,6 +5484,48 @@ unsigned flags;                         /* system call flags */
   }
 }
 	
+/*===========================================================================*
+ *                              find_notify                                  * 
+ *===========================================================================*/
+PRIVATE int find_notify(privp, src)
+register struct priv *privp;            /* receiver's privilege structure */
+int src;                                /* which message source is wanted */
+{
+/* Return the system id of a pending notification that is acceptable for 
+ * 'src', or -1 if there is none. A specific source is looked up directly by
+ * its id. For ANY, the search starts just after the source served last and
+ * wraps around, so that all sources are served in turn and a busy source, 
+ * such as HARDWARE during an interrupt storm, cannot starve the others.
+ */
+  bitchunk_t bits;
+  int src_id, c, n;
+
+  if (src != ANY) {
+      if (isemptyn(src)) return(-1);            /* source has no priv */
+      src_id = nr_to_id(src);
+      if (id_to_nr(src_id) != src) return(-1);  /* shared user structure */
+      return(get_sys_bit(privp->s_notify_pending, src_id) ? src_id : -1);
+  }
+
+  /* Scan the chunks once, starting with the bits from s_notify_next up, and
+   * finally look at the bits below s_notify_next in the first chunk. 
+   */
+  c = privp->s_notify_next / BITCHUNK_BITS;
+  bits = privp->s_notify_pending.chunk[c] & 
+      ((bitchunk_t) ~0 << (privp->s_notify_next % BITCHUNK_BITS));
+  for (n = 0; n <= NR_SYS_CHUNKS; n++) {
+      if (bits) {
+          src_id = c * BITCHUNK_BITS + bit_scan(bits);
+          if (src_id >= NR_SYS_PROCS) return(-1);       /* out of range */
+          privp->s_notify_next = (src_id + 1) % NR_SYS_PROCS;
+          return(src_id);
+      }
+      c = (c + 1) % NR_SYS_CHUNKS;
+      bits = privp->s_notify_pending.chunk[c];
+  }
+  return(-1);
+}
+	
 /*===========================================================================*
  *                              mini_notify                                  * 
  *===========================================================================*/
@@ -5345,6 +5565,182 @@ int dst;                                /* which process to notify */
   return(OK);
 }
 	
+/*===========================================================================*
+ *                              mini_senda                                   * 
+ *===========================================================================*/
+PRIVATE int mini_senda(caller_ptr, table, size)
+register struct proc *caller_ptr;       /* process sending asynchronously */
+asynmsg_t *table;                       /* table with messages to send */
+int size;                               /* number of entries in the table */
+{
+/* Register a table with asynchronous messages for 'caller_ptr'. Messages to
+ * a destination that is waiting for the caller are delivered right away. For
+ * the others, the destination is marked and delivery is done when it next
+ * calls mini_receive(). The caller never blocks. Completion is reported in 
+ * the table itself, by setting AMF_DONE and the result of each entry. 
+ * A different table, or a shorter one, is refused with EBUSY as long as the
+ * current table has messages waiting for delivery; passing the same table
+ * again to add entries is always allowed.  As with notifications, nothing
+ * is delivered to a process that waits for the reply to a SENDREC.
+ */
+  register struct priv *privp = priv(caller_ptr);
+  register struct proc *dst_ptr;
+  asynmsg_t am;                         /* kernel copy of a table entry */
+  phys_bytes phys;
+  int i, dst;
+
+  if (size < 0 || size > ASYN_TAB_SIZE) return(EINVAL);
+  if (size > 0 && umap_local(caller_ptr, D, (vir_bytes) table,
+          (vir_bytes) (size * sizeof(asynmsg_t))) == 0) return(EFAULT);
+  if (((vir_bytes) table != privp->s_asyntab || size < privp->s_asynsize)
+          && asyn_busy(caller_ptr)) return(EBUSY);
+  privp->s_asyntab = (vir_bytes) table;
+  privp->s_asynsize = size;
+
+  for (i = 0; i < size; i++) {
+      phys = umap_local(caller_ptr, D, (vir_bytes) &table[i], sizeof(am));
+      phys_copy(phys, vir2phys(&am), (phys_bytes) sizeof(am));
+      if ((am.flags & (AMF_VALID | AMF_DONE)) != AMF_VALID) continue;
+
+      /* Apply the checks sys_call() does for SEND to each destination. */
+      dst = am.dst;
+      if (! isokprocn(dst) || isemptyn(dst)) {
+          am.result = EDEADDST;
+      } else if (iskerneln(dst) ||
+              ! get_sys_bit(privp->s_ipc_to, nr_to_id(dst))) {
+          am.result = ECALLDENIED;
+      } else {
+          dst_ptr = proc_addr(dst);
+          if ((dst_ptr->p_rts_flags & (RECEIVING | SENDING)) == RECEIVING &&
+              ! (priv(dst_ptr)->s_flags & SENDREC_BUSY) &&
+              (dst_ptr->p_getfrom == ANY || 
+               dst_ptr->p_getfrom == proc_nr(caller_ptr))) {
+              /* Destination is waiting. Copy from the kernel's copy. */
+              CopyMess(proc_nr(caller_ptr), proc_addr(HARDWARE), &am.msg,
+                  dst_ptr, dst_ptr->p_messbuf);
+              if ((dst_ptr->p_rts_flags &= ~RECEIVING) == 0) enqueue(dst_ptr);
+              am.result = OK;
+          } else {
+              /* Leave the entry for delivery by mini_receive(). */
+              set_sys_bit(priv(dst_ptr)->s_asyn_pending, privp->s_id);
+              continue;
+          }
+      }
+      am.flags |= AMF_DONE;
+      phys_copy(vir2phys(&am), phys, (phys_bytes) sizeof(am));
+  }
+  return(OK);
+}
+	
+/*===========================================================================*
+ *                              try_async                                    * 
+ *===========================================================================*/
+PRIVATE int try_async(caller_ptr, src, m_ptr)
+register struct proc *caller_ptr;       /* process trying to get message */
+int src;                                /* which message source is wanted */
+message *m_ptr;                         /* pointer to message buffer */
+{
+/* Deliver an asynchronous message from 'src', or any source, if one of the 
+ * senders marked in the caller's map still has one in its table.
+ */
+  sys_map_t *map;
+  bitchunk_t *chunk;
+  int i, src_id, src_proc_nr;
+
+  map = &priv(caller_ptr)->s_asyn_pending;
+  for (chunk=&map->chunk[0]; chunk<&map->chunk[NR_SYS_CHUNKS]; chunk++) {
+      if (! *chunk) continue;                   /* no bits in chunk */
+      for (i=0; i < BITCHUNK_BITS; ++i) {
+          if (! (*chunk & (1<<i))) continue;
+          src_id = (chunk - &map->chunk[0]) * BITCHUNK_BITS + i;
+          if (src_id >= NR_SYS_PROCS) return(ENOTREADY);  /* out of range */
+          src_proc_nr = id_to_nr(src_id);       /* get source proc */
+          if (src_proc_nr == NONE || isemptyn(src_proc_nr)) {
+              /* Sender has gone; a new owner of its slot starts afresh. */
+              *chunk &= ~(1 << i);
+              continue;
+          }
+          if (src!=ANY && src!=src_proc_nr) continue;   /* source not ok */
+          if (asyn_deliver(proc_addr(src_proc_nr), caller_ptr, m_ptr) == OK)
+              return(OK);
+      }
+  }
+  return(ENOTREADY);
+}
+	
+/*===========================================================================*
+ *                              asyn_deliver                                 * 
+ *===========================================================================*/
+PRIVATE int asyn_deliver(src_ptr, dst_ptr, m_ptr)
+register struct proc *src_ptr;          /* sender with a table of messages */
+register struct proc *dst_ptr;          /* process to deliver to */
+message *m_ptr;                         /* pointer to destination buffer */
+{
+/* Deliver the first pending message for 'dst_ptr' in the table of 'src_ptr'.
+ * The sender's bit in the destination's map is cleared once no messages for 
+ * the destination are left, so that the map does not have to be rescanned.
+ * User processes share one map, so the bit stays while messages for any of
+ * them are left.
+ */
+  asynmsg_t *table = (asynmsg_t *) priv(src_ptr)->s_asyntab;
+  asynmsg_t am;                         /* kernel copy of a table entry */
+  phys_bytes phys;
+  int i, delivered = FALSE, shared = FALSE;
+
+  for (i = 0; i < priv(src_ptr)->s_asynsize; i++) {
+      phys = umap_local(src_ptr, D, (vir_bytes) &table[i], sizeof(am));
+      if (phys == 0) break;                     /* sender's memory changed */
+      phys_copy(phys, vir2phys(&am), (phys_bytes) sizeof(am));
+      if ((am.flags & (AMF_VALID | AMF_DONE)) != AMF_VALID) continue;
+      if (am.dst != proc_nr(dst_ptr)) {
+          if (isokprocn(am.dst) && priv(proc_addr(am.dst)) == priv(dst_ptr))
+              shared = TRUE;                    /* same map, keep the bit */
+          continue;
+      }
+      if (delivered) return(OK);                /* more left, keep the bit */
+
+      CopyMess(proc_nr(src_ptr), proc_addr(HARDWARE), &am.msg, dst_ptr, m_ptr);
+      am.result = OK;
+      am.flags |= AMF_DONE;
+      phys_copy(vir2phys(&am), phys, (phys_bytes) sizeof(am));
+      delivered = TRUE;
+  }
+  if (! shared)
+      unset_sys_bit(priv(dst_ptr)->s_asyn_pending, priv(src_ptr)->s_id);
+  return(delivered ? OK : ENOTREADY);
+}
+	
+/*===========================================================================*
+ *                              asyn_busy                                    * 
+ *===========================================================================*/
+PRIVATE int asyn_busy(caller_ptr)
+register struct proc *caller_ptr;       /* process with a table of messages */
+{
+/* Check whether the current table of 'caller_ptr' still has messages that
+ * wait for delivery. Messages to destinations that have gone meanwhile are 
+ * completed with EDEADDST, so that they do not hold up a new table forever.
+ */
+  asynmsg_t *table = (asynmsg_t *) priv(caller_ptr)->s_asyntab;
+  asynmsg_t am;                         /* kernel copy of a table entry */
+  phys_bytes phys;
+  int i, busy = FALSE;
+
+  for (i = 0; i < priv(caller_ptr)->s_asynsize; i++) {
+      phys = umap_local(caller_ptr, D, (vir_bytes) &table[i], sizeof(am));
+      if (phys == 0) break;                     /* table no longer mapped */
+      phys_copy(phys, vir2phys(&am), (phys_bytes) sizeof(am));
+      if ((am.flags & (AMF_VALID | AMF_DONE)) != AMF_VALID) continue;
+      if (isokprocn(am.dst) && ! isemptyn(am.dst)) {
+          busy = TRUE;
+          continue;
+      }
+      am.result = EDEADDST;
+      am.flags |= AMF_DONE;
+      phys_copy(vir2phys(&am), phys, (phys_bytes) sizeof(am));
+  }
+  return(busy);
+}
+	
 /*===========================================================================*
  *                              lock_notify                                  *
  *===========================================================================*/
@@ -5515,6 +5911,7 @@ PRIVATE void pick_proc()
    */
   for (q=0; q < NR_SCHED_QUEUES; q++) { 
       if ( (rp = rdy_head[q]) != NIL_PROC) {
+          clock_switch(rp);                     /* bill ticks, fix timer */
           next_ptr = rp;                        /* run process 'rp' next */
           if (priv(rp)->s_flags & BILLABLE)             
               bill_ptr = rp;                    /* bill for system time */
@@ -5949,9 +6346,10 @@ PUBLIC void prot_init()
   /* Build local descriptors in GDT for LDT's in process table.
    * The LDT's are allocated at compile time in the process table, and
    * initialized whenever a process' map is initialized or changed.
+   * This runs before 'nr_procs' is known, so do all NR_PROCS slots.
    */
   for (rp = BEG_PROC_ADDR, ldt_index = FIRST_LDT_INDEX;
-       rp < END_PROC_ADDR; ++rp, ldt_index++) {
+       rp < &proc[NR_TASKS + NR_PROCS]; ++rp, ldt_index++) {
         init_dataseg(&gdt[ldt_index], vir2phys(rp->p_ldt),
                                      sizeof(rp->p_ldt), INTR_PRIVILEGE);
         gdt[ldt_index].access = PRESENT | LDT;
@@ -6120,6 +6518,7 @@ register struct proc *rp;
   phys_bytes data_bytes;
   int privilege;
 
+  rp->p_mapgen = ++map_gen;             /* invalidates grants of old map */
   if (machine.protected) {
       data_bytes = (phys_bytes) (rp->p_memmap[S].mem_vir + 
           rp->p_memmap[S].mem_len) << CLICK_SHIFT;
@@ -6206,6 +6605,7 @@ register struct proc *rp;
 .define _level0         ! call a function at level 0
 .define _read_tsc       ! read the cycle counter (Pentium and up)
 .define _read_cpu_flags ! read the cpu flags
+.define _bit_scan       ! find the lowest bit set in a word
 
 ! The routines only guarantee to preserve the registers the C compiler
 ! expects to be preserved (ebx, esi, edi, ebp, esp, segment registers, and
@@ -6329,8 +6729,13 @@ csinit:  mov     eax, DS_SELECTOR
 ! space to anywhere else.  It also copies the source address provided as a
 ! parameter to the call into the first word of the destination message.
 !
+! Messages have a fixed size, so the copy is fully unrolled rather than done
+! with a string instruction; this avoids the 'rep movs' startup cost that
+! dominates for a copy this short.
+!
 ! Note that the message size, "Msize" is in DWORDS (not bytes) and must be set
-! correctly.  Changing the definition of message in the type file and not
+! correctly.  The unrolled copy below moves exactly Msize - 1 dwords after the
+! sender number.  Changing the definition of message in the type file and not
 ! changing it here will lead to total disaster.
 
 CM_ARGS =       4 + 4 + 4 + 4 + 4       ! 4 + 4 + 4 + 4 + 4
@@ -6338,7 +6743,6 @@ CM_ARGS =       4 + 4 + 4 + 4 + 4       ! 4 + 4 + 4 + 4 + 4
 
         .align  16
 _cp_mess: 
-        cld
         push    esi
         push    edi
         push    ds
@@ -6356,11 +6760,23 @@ _cp_mess:
         add     edi, CM_ARGS+4+4+4+4(esp)       ! dst offset
 
         mov     eax, CM_ARGS(esp)       ! process number of sender
-        stos                            ! copy number of sender to dest message
-        add     esi, 4                  ! do not copy first word
-        mov     ecx, Msize - 1          ! remember, first word does not count
-        rep
-        movs                            ! copy the message
+        mov     (edi), eax              ! copy number of sender to dest message
+        mov     eax, 4(esi)             ! do not copy first word, copy the
+        mov     edx, 8(esi)             ! remaining Msize - 1 dwords in pairs
+        mov     4(edi), eax
+        mov     8(edi), edx
+        mov     eax, 12(esi)
+        mov     edx, 16(esi)
+        mov     12(edi), eax
+        mov     16(edi), edx
+        mov     eax, 20(esi)
+        mov     edx, 24(esi)
+        mov     20(edi), eax
+        mov     24(edi), edx
+        mov     eax, 28(esi)
+        mov     edx, 32(esi)
+        mov     28(edi), eax
+        mov     32(edi), edx
 
         pop     es
         pop     ds
@@ -6570,10 +6986,16 @@ dis_already:
 !*===========================================================================*
 ! PUBLIC void phys_copy(phys_bytes source, phys_bytes destination,
 !                       phys_bytes bytecount);
-! Copy a block of physical memory.
+! Copy a block of physical memory.  Small counts are copied byte by byte.
+! Otherwise the destination is aligned first, since misaligned stores are
+! more expensive than misaligned loads, and the bulk is moved in dwords:
+! blocks below PC_REP_MIN dwords use an unrolled loop, because the startup
+! cost of 'rep movs' is not recovered on them, and larger blocks use 'rep
+! movs', which the processor runs fastest with an aligned destination.
 
-PC_ARGS =       4 + 4 + 4 + 4   ! 4 + 4 + 4
-!               es edi esi eip   src dst len
+PC_ARGS =       4 + 4 + 4 + 4 + 4       ! 4 + 4 + 4
+!               ds es edi esi eip        src dst len
+PC_REP_MIN =    16                      ! dwords below which rep is avoided
 
         .align  16
 _phys_copy: 
@@ -6581,8 +7003,10 @@ _phys_copy:
         push    esi
         push    edi
         push    es
+        push    ds
 
         mov     eax, FLAT_DS_SELECTOR
+        mov     ds, ax
         mov     es, ax
 
         mov     esi, PC_ARGS(esp)
@@ -6591,22 +7015,46 @@ _phys_copy:
 
         cmp     eax, 10                 ! avoid align overhead for small counts
         jb      pc_small
-        mov     ecx, esi                ! align source, hope target is too
+        mov     ecx, edi                ! align target, source may follow
         neg     ecx
         and     ecx, 3                  ! count for alignment
         sub     eax, ecx
         rep
-   eseg movsb
+        movsb
         mov     ecx, eax
         shr     ecx, 2                  ! count of dwords
+        and     eax, 3                  ! remainder
+        cmp     ecx, PC_REP_MIN
+        jb      pc_unrolled
         rep
-   eseg movs
-        and     eax, 3
+        movs                            ! bulk copy of aligned dwords
+        jmp     pc_small
+pc_unrolled: 
+        sub     ecx, 4                  ! four dwords per iteration
+        jb      pc_dwords
+pc_quad: 
+        mov     edx, (esi)
+        mov     (edi), edx
+        mov     edx, 4(esi)
+        mov     4(edi), edx
+        mov     edx, 8(esi)
+        mov     8(edi), edx
+        mov     edx, 12(esi)
+        mov     12(edi), edx
+        add     esi, 16
+        add     edi, 16
+        sub     ecx, 4
+        jae     pc_quad
+pc_dwords: 
+        add     ecx, 4                  ! zero to three dwords left
+        rep
+        movs
 pc_small: 
         xchg    ecx, eax                ! remainder
         rep
-   eseg movsb
+        movsb
 
+        pop     ds
         pop     es
         pop     edi
         pop     esi
@@ -6745,6 +7193,16 @@ _read_cpu_flags:
         popf
         ret
 
+!*===========================================================================*
+!*                            bit_scan                                       *
+!*===========================================================================*
+! PUBLIC int bit_scan(unsigned bits);
+! Return the number of the lowest bit set in a nonzero word. 
+.align 16
+_bit_scan: 
+        bsf eax, 4(esp)
+        ret
+
 
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                                       kernel/utility.c
@@ -6949,6 +7407,9 @@ _PROTOTYPE( int do_sigsend, (message *m_ptr) );
 _PROTOTYPE( int do_sigreturn, (message *m_ptr) );
 _PROTOTYPE( int do_times, (message *m_ptr) );           
 _PROTOTYPE( int do_setalarm, (message *m_ptr) );        
+_PROTOTYPE( int do_setgrant, (message *m_ptr) );
+_PROTOTYPE( int do_safecopy, (message *m_ptr) );
+_PROTOTYPE( int do_ksigs, (message *m_ptr) );
 
 #endif  /* SYSTEM_H */
 
@@ -7098,6 +7559,7 @@ PRIVATE void initialize(void)
   map(SYS_KILL, do_kill);               /* cause a process to be signaled */
   map(SYS_GETKSIG, do_getksig);         /* PM checks for pending signals */
   map(SYS_ENDKSIG, do_endksig);         /* PM finished processing signal */
+  map(SYS_KSIGS, do_ksigs);             /* same, for many processes */
   map(SYS_SIGSEND, do_sigsend);         /* start POSIX-style signal */
   map(SYS_SIGRETURN, do_sigreturn);     /* return from POSIX-style signal */
 
@@ -7119,6 +7581,8 @@ PRIVATE void initialize(void)
   map(SYS_PHYSCOPY, do_physcopy);       /* use physical addressing */
   map(SYS_VIRVCOPY, do_virvcopy);       /* vector with copy requests */
   map(SYS_PHYSVCOPY, do_physvcopy);     /* vector with copy requests */
+  map(SYS_SETGRANT, do_setgrant);       /* publish or revoke a grant */
+  map(SYS_SAFECOPY, do_safecopy);       /* copy through a memory grant */
 
   /* Clock functionality. */
   map(SYS_TIMES, do_times);             /* get uptime and process times */
@@ -7140,6 +7604,7 @@ int proc_type;                          /* system or user process flag */
  * structure. System processes get their own privilege structure. 
  */
   register struct priv *sp;                     /* privilege structure */
+  int i;
 
   if (proc_type == SYS_PROC) {                  /* find a new slot */
       for (sp = BEG_PRIV_ADDR; sp < END_PRIV_ADDR; ++sp) 
@@ -7148,6 +7613,12 @@ int proc_type;                          /* system or user process flag */
       rc->p_priv = sp;                          /* assign new slot */
       rc->p_priv->s_proc_nr = proc_nr(rc);      /* set association */
       rc->p_priv->s_flags = SYS_PROC;           /* mark as privileged */
+      for (i=0; i<NR_GRANTS; i++)               /* no grants of previous */
+          sp->s_grants[i].cp_flags = 0;         /* owner survive */
+      sp->s_asyntab = 0;                        /* nor pending messages */
+      sp->s_asynsize = 0;
+      for (i=0; i<NR_SYS_CHUNKS; i++)
+          sp->s_asyn_pending.chunk[i] = 0;
   } else {
       rc->p_priv = &priv[USER_PRIV_ID];         /* use shared slot */
       rc->p_priv->s_proc_nr = INIT_PROC_NR;     /* set association */
@@ -7498,6 +7969,7 @@ register message *m_ptr;        /* pointer to request message */
   reg_t sp;                     /* new sp */
   phys_bytes phys_name;
   char *np;
+  int i;
 
   rp = proc_addr(m_ptr->PR_PROC_NR);
   sp = (reg_t) m_ptr->PR_STACK_PTR;
@@ -7506,6 +7978,10 @@ register message *m_ptr;        /* pointer to request message */
         (LDT_SIZE - EXTRA_LDT_INDEX) * sizeof(rp->p_ldt[0]));
   rp->p_reg.pc = (reg_t) m_ptr->PR_IP_PTR;      /* set pc */
   rp->p_rts_flags &= ~RECEIVING;        /* PM does not reply to EXEC call */
+  rp->p_mapgen = ++map_gen;             /* revoke grants of the old image */
+  if (priv(rp)->s_flags & SYS_PROC) {   /* and those it made itself */
+      for (i=0; i<NR_GRANTS; i++) priv(rp)->s_grants[i].cp_flags = 0;
+  }
   if (rp->p_rts_flags == 0) lock_enqueue(rp);
 
   /* Save command name for debugging, ps(1) output, etc. */
@@ -7522,6 +7998,235 @@ register message *m_ptr;        /* pointer to request message */
 }
 #endif /* USE_EXEC */
 
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      kernel/system/do_safecopy.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* The kernel calls implemented in this file: 
+ *   m_type:     SYS_SETGRANT
+ *   m_type:     SYS_SAFECOPY
+ *
+ * The parameters for SYS_SETGRANT are: 
+ *    m2_i1:     SG_GRANT_ID             (grant slot, GRANT_INVALID for new)
+ *    m2_i2:     SG_WHO                  (process that may use the grant)
+ *    m2_i3:     SG_OWNER                (process whose memory is granted)
+ *    m2_p1:     SG_ADDR                 (start of granted range)
+ *    m2_l1:     SG_LEN                  (length of granted range)
+ *    m2_l2:     SG_FLAGS                (access allowed, 0 to revoke)
+ *
+ * The parameters for SYS_SAFECOPY are: 
+ *    m5_c1:     SCP_REQUEST             (CPF_READ or CPF_WRITE)
+ *    m5_i1:     SCP_FROM_TO             (process that made the grant)
+ *    m5_i2:     SCP_GID                 (grant id at that process)
+ *    m5_l1:     SCP_OFFSET              (offset within granted range)
+ *    m5_l2:     SCP_ADDRESS             (address in caller's D space)
+ *    m5_l3:     SCP_BYTES               (number of bytes to copy)
+ *
+ * Grants live in the privilege structure of the granting system process. The
+ * physical address of the range is computed once, when the grant is made, so 
+ * that a copy through a grant only needs a bounds check on the granted side. 
+ * A grant on behalf of another process is only valid as long as that process'
+ * memory is not moved; the granter must revoke it before replying to the 
+ * process, which cannot exec or brk while it is blocked on the granter.
+ * Should it not, the grant still dies with the owner's memory map: each new
+ * map, exec or slot reuse gives the owner a fresh p_mapgen from the kernel
+ * wide counter map_gen, which no other map ever had. A granter that exits
+ * or execs takes its grants with it.
+ */
+
+#include "../system.h"
+
+#if USE_SETGRANT
+
+/*===========================================================================*
+ *                              do_setgrant                                  *
+ *===========================================================================*/
+PUBLIC int do_setgrant(m_ptr)
+register message *m_ptr;        /* pointer to request message */
+{
+/* Publish a memory grant, or revoke it if no access is given. */
+  struct proc *caller_ptr, *owner_ptr;
+  cp_grant_t *gp;
+  int gid, owner, who;
+  vir_bytes addr, bytes;
+  phys_bytes phys;
+
+  /* Grants are kept per privilege structure, which user processes share. */
+  caller_ptr = proc_addr(m_ptr->m_source);
+  if (! (priv(caller_ptr)->s_flags & SYS_PROC)) return(EPERM);
+
+  /* Find the grant slot, or a free one if a new grant is requested. */
+  gid = m_ptr->SG_GRANT_ID;
+  if (gid == GRANT_INVALID) {
+      for (gid = 0; gid < NR_GRANTS; gid++)
+          if (! (priv(caller_ptr)->s_grants[gid].cp_flags & CPF_USED)) break;
+      if (gid >= NR_GRANTS) return(ENOSPC);
+  }
+  else if (gid < 0 || gid >= NR_GRANTS) return(EINVAL);
+  gp = &priv(caller_ptr)->s_grants[gid];
+
+  /* A grant without access rights revokes the slot. */
+  if ((m_ptr->SG_FLAGS & (CPF_READ | CPF_WRITE)) == 0) {
+      gp->cp_flags = 0;
+      return(OK);
+  }
+
+  /* Granting another process' memory requires the right to copy it. */
+  owner = m_ptr->SG_OWNER;
+  if (owner == SELF) owner = m_ptr->m_source;
+  if (! isokprocn(owner) || isemptyn(owner)) return(EINVAL);
+  if (owner != m_ptr->m_source &&
+      ! (priv(caller_ptr)->s_call_mask & (1 << (SYS_VIRCOPY-KERNEL_CALL))))
+      return(EPERM);
+  who = m_ptr->SG_WHO;
+  if (who != ANY && ! isokprocn(who)) return(EINVAL);
+
+  /* Map the range once. This also checks that it falls in the segments. */
+  addr = (vir_bytes) m_ptr->SG_ADDR;
+  bytes = (vir_bytes) m_ptr->SG_LEN;
+  owner_ptr = proc_addr(owner);
+  if ((phys = umap_local(owner_ptr, D, addr, bytes)) == 0) return(EFAULT);
+
+  gp->cp_who = who;
+  gp->cp_owner = owner;
+  gp->cp_addr = addr;
+  gp->cp_len = bytes;
+  gp->cp_phys = phys;
+  gp->cp_mapgen = owner_ptr->p_mapgen;
+  gp->cp_flags = CPF_USED | (m_ptr->SG_FLAGS & (CPF_READ | CPF_WRITE));
+  m_ptr->SG_GRANT_ID = gid;
+  return(OK);
+}
+#endif /* USE_SETGRANT */
+
+#if USE_SAFECOPY
+
+/*===========================================================================*
+ *                              do_safecopy                                  *
+ *===========================================================================*/
+PUBLIC int do_safecopy(m_ptr)
+register message *m_ptr;        /* pointer to request message */
+{
+/* Copy from or to a range that another process granted to the caller. */
+  struct proc *granter_ptr;
+  cp_grant_t *gp;
+  int granter, gid, access;
+  vir_bytes offset, bytes;
+  phys_bytes granted, local;
+
+  granter = m_ptr->SCP_FROM_TO;
+  gid = m_ptr->SCP_GID;
+  access = m_ptr->SCP_REQUEST;
+  offset = (vir_bytes) m_ptr->SCP_OFFSET;
+  bytes = (vir_bytes) m_ptr->SCP_BYTES;
+  if (bytes <= 0) return(EDOM);
+  if (access != CPF_READ && access != CPF_WRITE) return(EINVAL);
+  if (! isokprocn(granter) || gid < 0 || gid >= NR_GRANTS) return(EINVAL);
+  if (isemptyn(granter)) return(EDEADDST);
+
+  /* Check the grant. Only system processes have grants of their own. */
+  granter_ptr = proc_addr(granter);
+  if (! (priv(granter_ptr)->s_flags & SYS_PROC) ||
+      priv(granter_ptr)->s_proc_nr != granter) return(EPERM);
+  gp = &priv(granter_ptr)->s_grants[gid];
+  if (! (gp->cp_flags & CPF_USED)) return(EPERM);
+  if (! (gp->cp_flags & access)) return(EPERM);
+  if (gp->cp_who != ANY && gp->cp_who != m_ptr->m_source) return(EPERM);
+  if (offset >= gp->cp_len || bytes > gp->cp_len - offset) return(EPERM);
+  if (isemptyn(gp->cp_owner) ||
+      proc_addr(gp->cp_owner)->p_mapgen != gp->cp_mapgen)
+      return(EPERM);                    /* owner exited, exec'd or moved */
+  granted = gp->cp_phys + offset;
+
+  /* The caller's own buffer must be mapped as usual. */
+  local = umap_local(proc_addr(m_ptr->m_source), D,
+      (vir_bytes) m_ptr->SCP_ADDRESS, bytes);
+  if (local == 0) return(EFAULT);
+
+  if (access == CPF_READ) phys_copy(granted, local, (phys_bytes) bytes);
+  else phys_copy(local, granted, (phys_bytes) bytes);
+  return(OK);
+}
+#endif /* USE_SAFECOPY */
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      kernel/system/do_ksigs.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* The kernel call implemented in this file:
+ *   m_type:    SYS_KSIGS
+ *
+ * The parameters for this kernel call are:
+ *     m2_l2:   SIG_REQUEST     (S_GETSIG or S_ENDSIG)
+ *     m2_p1:   SIG_VEC         (vector of struct ksig in caller's space)
+ *     m2_i3:   SIG_COUNT       (size of vector, or number of entries)
+ *
+ * This is SYS_GETKSIG and SYS_ENDKSIG for many processes at once.  With
+ * S_GETSIG, the pending kernel signals of as many processes as fit in the
+ * vector are handed out, and the number of entries filled in is returned in
+ * SIG_COUNT.  With S_ENDSIG, PM says it is done with the entries handed out,
+ * and each process may run again unless a new signal has arrived for it.
+ */
+
+#include "../system.h"
+#include <signal.h>
+
+#if USE_KSIGS
+
+/*===========================================================================*
+ *                              do_ksigs                                     *
+ *===========================================================================*/
+PUBLIC int do_ksigs(m_ptr)
+register message *m_ptr;        /* pointer to request message */
+{
+  register struct proc *rp;
+  struct ksig ks;
+  phys_bytes vec;
+  int count, n;
+
+  count = m_ptr->SIG_COUNT;
+  if (count <= 0) return(EINVAL);
+  vec = umap_local(proc_addr(m_ptr->m_source), D,
+      (vir_bytes) m_ptr->SIG_VEC, (vir_bytes) (count * sizeof(ks)));
+  if (vec == 0) return(EFAULT);
+
+  switch (m_ptr->SIG_REQUEST) {
+  case S_GETSIG:
+      /* Find processes with pending signals until the vector is full. */
+      n = 0;
+      for (rp = BEG_USER_ADDR; rp < END_PROC_ADDR && n < count; rp++) {
+          if (! (rp->p_rts_flags & SIGNALED)) continue;
+          ks.ks_proc = rp->p_nr;
+          ks.ks_map = rp->p_pending;
+          sigemptyset(&rp->p_pending);          /* ball is in PM's court */
+          rp->p_rts_flags &= ~SIGNALED;         /* blocked by SIG_PENDING */
+          phys_copy(vir2phys(&ks), vec + n * sizeof(ks), sizeof(ks));
+          n++;
+      }
+      m_ptr->SIG_COUNT = n;
+      return(OK);
+
+  case S_ENDSIG:
+      /* PM has finished these signals. Perhaps the processes are ready now? */
+      for (n = 0; n < count; n++) {
+          phys_copy(vec + n * sizeof(ks), vir2phys(&ks), sizeof(ks));
+          if (! isokprocn(ks.ks_proc)) continue;
+          rp = proc_addr(ks.ks_proc);
+          if (isemptyp(rp)) continue;
+          if (! (rp->p_rts_flags & SIGNALED))          /* new signal arrived */
+              if ((rp->p_rts_flags &= ~SIG_PENDING)==0) /* not pending */
+                  lock_enqueue(rp);                    /* ready if no flags */
+      }
+      return(OK);
+
+  default:
+      return(EINVAL);
+  }
+}
+#endif /* USE_KSIGS */
+
+
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                                       kernel/clock.c
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -7542,6 +8247,14 @@ register message *m_ptr;        /* pointer to request message */
  * The function do_clocktick() is triggered by the clock's interrupt 
  * handler when a watchdog timer has expired or a process must be scheduled. 
  *
+ * On machines with a cycle counter (Pentium and up) the timer runs in one-shot
+ * mode. Each interrupt programs the next one, for when the next timer expires
+ * or the quantum of the process that runs ends, whichever comes first. When 
+ * another process is picked to run, clock_switch() bills the ticks that passed
+ * and fires the timer earlier if its quantum ends sooner. The time that passed
+ * is reconstructed from the cycle counter rather than by counting interrupts.
+ * Older machines keep the timer in periodic square wave mode.
+ *
  * In addition to the main clock_task() entry point, which starts the main 
  * loop, there are several other minor entry points: 
  *   clock_stop:         called just before MINIX shutdown
@@ -7549,6 +8262,7 @@ register message *m_ptr;        /* pointer to request message */
  *   set_timer:          set a watchdog timer (+)
  *   reset_timer:        reset a watchdog timer (+)
  *   read_clock:         read the counter of channel 0 of the 8253A timer
+ *   clock_switch:       another process is picked to run
  *
  * (+) The CLOCK task keeps tracks of watchdog timers for the entire kernel.
  * The watchdog functions of expired timers are executed in do_clocktick(). 
@@ -7566,14 +8280,21 @@ register message *m_ptr;        /* pointer to request message */
 FORWARD _PROTOTYPE( void init_clock, (void) );
 FORWARD _PROTOTYPE( int clock_handler, (irq_hook_t *hook) );
 FORWARD _PROTOTYPE( int do_clocktick, (message *m_ptr) );
+FORWARD _PROTOTYPE( void calibrate_tsc, (void) );
+FORWARD _PROTOTYPE( unsigned long tsc_ticks, (unsigned long tsc) );
+FORWARD _PROTOTYPE( void bill_ticks, (unsigned long ticks) );
+FORWARD _PROTOTYPE( clock_t next_shot, (struct proc *rp, clock_t past) );
+FORWARD _PROTOTYPE( void program_shot, (clock_t ticks) );
 
 /* Clock parameters. */
 #define COUNTER_FREQ (2*TIMER_FREQ) /* counter frequency using square wave */
 #define LATCH_COUNT     0x00    /* cc00xxxx, c = channel, x = any */
 #define SQUARE_WAVE     0x36    /* ccaammmb, a = access, m = mode, b = BCD */
                                 /*   11x11, 11 = LSB then MSB, x11 = sq wave */
+#define ONE_SHOT        0x30    /*   11000, 000 = interrupt on terminal count */
 #define TIMER_COUNT ((unsigned) (TIMER_FREQ/HZ)) /* initial value for counter*/
 #define TIMER_FREQ  1193182L    /* clock frequency for timer in PC and AT */
+#define MAX_SHOT_COUNT  0xFFFFL /* longest one-shot, 16 bits, no prescaler */
 
 #define CLOCK_ACK_BIT   0x80    /* PS/2 clock interrupt acknowledge bit */
 
@@ -7591,6 +8312,17 @@ PRIVATE clock_t next_timeout;           /* realtime that next timer expires */
 PRIVATE clock_t realtime;               /* real time clock */
 PRIVATE irq_hook_t clock_hook;          /* interrupt handler hook */
 
+/* One-shot operation. The cycle counter's low word at the last tick boundary
+ * that was accounted for in 'realtime' tells how much time has passed since.
+ * Whole ticks since then may already have been billed by clock_switch().
+ */
+PRIVATE int oneshot;                    /* timer is in one-shot mode */
+PRIVATE unsigned long tsc_per_tick;     /* cycles per clock tick */
+PRIVATE unsigned long tsc_per_count;    /* cycles per timer count */
+PRIVATE unsigned long tsc_edge;         /* cycle count at last tick boundary */
+PRIVATE clock_t shot_end;               /* realtime the timer is set to fire */
+PRIVATE unsigned long billed;           /* ticks past 'realtime' billed */
+
 /*===========================================================================*
  *                              clock_task                                   *
  *===========================================================================*/
@@ -7660,10 +8392,19 @@ PRIVATE void init_clock()
   /* Initialize the CLOCK's interrupt hook. */
   clock_hook.proc_nr = CLOCK;
 
-  /* Initialize channel 0 of the 8253A timer to, e.g., 60 Hz. */
-  outb(TIMER_MODE, SQUARE_WAVE);        /* set timer to run continuously */
-  outb(TIMER0, TIMER_COUNT);            /* load timer low byte */
-  outb(TIMER0, TIMER_COUNT >> 8);       /* load timer high byte */
+  /* Use one-shot mode if there is a cycle counter to keep time with. */
+  if (machine.processor > 486) calibrate_tsc();
+
+  if (oneshot) {
+      lock(9, "init_clock");
+      program_shot(1);                  /* first interrupt one tick ahead */
+      unlock(9);
+  } else {
+      /* Initialize channel 0 of the 8253A timer to, e.g., 60 Hz. */
+      outb(TIMER_MODE, SQUARE_WAVE);    /* set timer to run continuously */
+      outb(TIMER0, TIMER_COUNT);        /* load timer low byte */
+      outb(TIMER0, TIMER_COUNT >> 8);   /* load timer high byte */
+  }
   put_irq_handler(&clock_hook, CLOCK_IRQ, clock_handler);/* register handler */
   enable_irq(&clock_hook);              /* ready for clock interrupts */
 }
@@ -7710,28 +8451,35 @@ irq_hook_t *hook;
  *              since at worst the previous process would be billed.
  */
   register unsigned ticks;
+  unsigned long tsc_high, tsc_low;
 
   /* Acknowledge the PS/2 clock interrupt. */
   if (machine.ps_mca) outb(PORT_B, inb(PORT_B) | CLOCK_ACK_BIT);
 
-  /* Get number of ticks and update realtime. */
-  ticks = lost_ticks + 1;
+  /* Get number of ticks and update realtime. In one-shot mode the cycle
+   * counter tells how many tick boundaries were passed, which also covers 
+   * ticks lost while the boot monitor ran. An interrupt that arrives just 
+   * before the boundary counts as one tick and resynchronizes the boundary.
+   */
+  if (oneshot) {
+      read_tsc(&tsc_high, &tsc_low);
+      if ((ticks = tsc_ticks(tsc_low)) == 0) {
+          ticks = 1;
+          tsc_edge = tsc_low;
+      } else {
+          tsc_edge += ticks * tsc_per_tick;
+      }
+  } else {
+      ticks = lost_ticks + 1;
+  }
   lost_ticks = 0;
   realtime += ticks;
 
-  /* Update user and system accounting times. Charge the current process for
-   * user time. If the current process is not billable, that is, if a non-user
-   * process is running, charge the billable process for system time as well.
-   * Thus the unbillable process' user time is the billable user's system time.
+  /* Update user and system accounting times, except for the ticks that were
+   * billed when another process was picked to run.
    */
-  proc_ptr->p_user_time += ticks;
-  if (priv(proc_ptr)->s_flags & PREEMPTIBLE) {
-      proc_ptr->p_ticks_left -= ticks;
-  }
-  if (! (priv(proc_ptr)->s_flags & BILLABLE)) {
-      bill_ptr->p_sys_time += ticks;
-      bill_ptr->p_ticks_left -= ticks;
-  }
+  bill_ticks(ticks - billed);
+  billed = 0;
 
   /* Check if do_clocktick() must be called. Done for alarms and scheduling.
    * Some processes, such as the kernel tasks, cannot be preempted. 
@@ -7740,16 +8488,105 @@ irq_hook_t *hook;
       prev_ptr = proc_ptr;                      /* store running process */
       lock_notify(HARDWARE, CLOCK);             /* send notification */
   } 
+
+  /* In one-shot mode, program the next interrupt. */
+  if (oneshot)
+      program_shot(next_shot(next_ptr != NIL_PROC ? next_ptr :  proc_ptr, 0));
   return(1);                                    /* reenable interrupts */
 }
 	
+/*===========================================================================*
+ *                              bill_ticks                                   *
+ *===========================================================================*/
+PRIVATE void bill_ticks(ticks)
+unsigned long ticks;                    /* ticks the running process used */
+{
+/* Charge the current process for user time. If the current process is not
+ * billable, that is, if a non-user process is running, charge the billable
+ * process for system time as well. Thus the unbillable process' user time is
+ * the billable user's system time. One-shot intervals can be long, so the
+ * quanta stop at zero rather than wrap around.
+ */
+  if (ticks == 0) return;
+  proc_ptr->p_user_time += ticks;
+  if ((priv(proc_ptr)->s_flags & PREEMPTIBLE) && 
+          ! (oneshot && proc_ptr == proc_addr(IDLE))) {
+      /* IDLE needs no ticks in one-shot */
+      proc_ptr->p_ticks_left = ((long) ticks < proc_ptr->p_ticks_left) ?
+          proc_ptr->p_ticks_left - ticks :  0;
+  }
+  if (! (priv(proc_ptr)->s_flags & BILLABLE)) {
+      bill_ptr->p_sys_time += ticks;
+      bill_ptr->p_ticks_left = ((long) ticks < bill_ptr->p_ticks_left) ?
+          bill_ptr->p_ticks_left - ticks :  0;
+  }
+}
+	
+/*===========================================================================*
+ *                              next_shot                                    *
+ *===========================================================================*/
+PRIVATE clock_t next_shot(rp, past)
+struct proc *rp;                        /* process that runs next */
+clock_t past;                           /* ticks since boundary, billed */
+{
+/* Return after how many tick boundaries the next interrupt is needed:  when
+ * the quantum of 'rp' ends or the next timer expires, whichever comes first,
+ * but not before the next boundary. IDLE and processes that cannot be
+ * preempted have no quantum to watch; TMR_NEVER means no interrupt is needed.
+ */
+  clock_t shot = TMR_NEVER;
+
+  if ((priv(rp)->s_flags & PREEMPTIBLE) && rp != proc_addr(IDLE))
+      shot = past + (rp->p_ticks_left > 0 ? rp->p_ticks_left :  1);
+  if (next_timeout != TMR_NEVER && next_timeout - realtime < shot)
+      shot = next_timeout - realtime;
+  return(shot > past ? shot :  past + 1);
+}
+	
+/*===========================================================================*
+ *                              clock_switch                                 *
+ *===========================================================================*/
+PUBLIC void clock_switch(rp)
+struct proc *rp;                        /* process picked to run */
+{
+/* Another process is picked to run. In one-shot mode, the next interrupt
+ * would bill all ticks since the last one to 'rp', and may be set for after
+ * the end of its quantum. Bill the whole ticks that passed to the process
+ * that used them, and fire the timer earlier if need be. The caller must
+ * have interrupts disabled.
+ */
+  unsigned long tsc_high, tsc_low, ticks;
+  clock_t shot;
+
+  if (! oneshot || rp == proc_ptr) return;
+  read_tsc(&tsc_high, &tsc_low);
+  if ((ticks = tsc_ticks(tsc_low)) > billed) {
+      bill_ticks(ticks - billed);
+      billed = ticks;
+  }
+  shot = next_shot(rp, (clock_t) billed);
+  if (shot < shot_end - realtime) program_shot(shot);
+}
+	
 /*===========================================================================*
  *                              get_uptime                                   *
  *===========================================================================*/
 PUBLIC clock_t get_uptime()
 {
-/* Get and return the current clock uptime in ticks. */
-  return(realtime);
+/* Get and return the current clock uptime in ticks. In one-shot mode the 
+ * ticks that passed since the last interrupt are added. Retry if the clock
+ * interrupt updated 'realtime' meanwhile; no lock is needed that way.
+ */
+  clock_t before, uptime;
+  unsigned long tsc_high, tsc_low;
+
+  if (! oneshot) return(realtime);
+  do {
+      before = realtime;
+      read_tsc(&tsc_high, &tsc_low);
+      uptime = before + tsc_ticks(tsc_low);
+  } while (before != realtime);
+  return(uptime);
 }
 	
 /*===========================================================================*
@@ -7765,6 +8602,17 @@ tmr_func_t watchdog;            /* watchdog to be called */
  */
   tmrs_settimer(&clock_timers, tp, exp_time, watchdog, NULL);
   next_timeout = clock_timers->tmr_exp_time;
+
+  /* While IDLE runs, the timer may be set to fire after the new timeout. */
+  if (oneshot && next_timeout < shot_end) {
+      if (k_reenter >= 0) {                     /* already locked */
+          program_shot(next_timeout > realtime ? next_timeout - realtime : 1);
+      } else {
+          lock(8, "set_timer");
+          program_shot(next_timeout > realtime ? next_timeout - realtime : 1);
+          unlock(8);
+      }
+  }
 }
 	
 /*===========================================================================*
@@ -7788,9 +8636,12 @@ struct timer *tp;               /* pointer to timer structure */
 PUBLIC unsigned long read_clock()
 {
 /* Read the counter of channel 0 of the 8253A timer.  This counter counts
- * down at a rate of TIMER_FREQ and restarts at TIMER_COUNT-1 when it
- * reaches zero. A hardware interrupt (clock tick) occurs when the counter
- * gets to zero and restarts its cycle.  
+ * down at a rate of TIMER_FREQ.  In square wave mode it restarts at
+ * TIMER_COUNT when it reaches zero, and a hardware interrupt (clock tick)
+ * occurs once per cycle.  In one-shot mode it counts down from the value
+ * program_shot() loaded, interrupts when it gets to zero, and then goes on
+ * from 0xFFFF without interrupting again; the count says nothing about the
+ * time since the last tick then, which is why the cycle counter is used.
  */
   unsigned count;
 
@@ -7800,6 +8651,80 @@ PUBLIC unsigned long read_clock()
   
   return count;
 }
+	
+/*===========================================================================*
+ *                              calibrate_tsc                                *
+ *===========================================================================*/
+PRIVATE void calibrate_tsc()
+{
+/* Measure how many cycles the CPU makes during one clock tick, by letting the 
+ * timer count down at least TIMER_COUNT in one-shot mode. The counter only
+ * counts down from its maximum once the next count pulse has loaded it, so
+ * the measurement starts at the first count read after that. Both reads are
+ * within one pass from 0xFFFF, so the counts passed are their difference.
+ * One-shot operation is enabled if the result is usable.
+ */
+  unsigned long tsc_high, tsc_start, tsc_end, cycles;
+  unsigned long start, count;
+
+  outb(TIMER_MODE, ONE_SHOT);
+  outb(TIMER0, 0xFF);
+  outb(TIMER0, 0xFF);
+  while ((start = read_clock()) < 0xFFFF - TIMER_COUNT) {} /* not loaded */
+  read_tsc(&tsc_high, &tsc_start);
+  while (start - (count = read_clock()) < TIMER_COUNT) {}
+  read_tsc(&tsc_high, &tsc_end);
+
+  cycles = tsc_end - tsc_start;
+  tsc_per_count = cycles / (start - count);
+  tsc_per_tick = cycles - (start - count - TIMER_COUNT) * tsc_per_count;
+  tsc_edge = tsc_end;
+  oneshot = (tsc_per_count > 0);
+}
+	
+/*===========================================================================*
+ *                              tsc_ticks                                    *
+ *===========================================================================*/
+PRIVATE unsigned long tsc_ticks(tsc)
+unsigned long tsc;                      /* low word of the cycle counter */
+{
+/* Return the number of whole ticks since the last tick boundary. The one-shot
+ * interval is far below the wrap-around time of the low word. 
+ */
+  return((tsc - tsc_edge) / tsc_per_tick);
+}
+	
+/*===========================================================================*
+ *                              program_shot                                 *
+ *===========================================================================*/
+PRIVATE void program_shot(ticks)
+clock_t ticks;                          /* ticks after the last boundary */
+{
+/* Set the timer to interrupt once, 'ticks' tick boundaries after the last one.
+ * The counts that already passed since that boundary are subtracted, so that
+ * the latency of the interrupt handler does not make the clock drift. The 
+ * counter has 16 bits and no prescaler, so it reaches about 55 ms at most.
+ * A longer interval is chained:  the timer fires when the counter runs out,
+ * and clock_handler() programs the rest, as nothing is due yet then. The
+ * caller must have interrupts disabled.
+ */
+  unsigned long tsc_high, tsc_low, past, count;
+
+  read_tsc(&tsc_high, &tsc_low);
+  past = (tsc_low - tsc_edge) / tsc_per_count;  /* counts since boundary */
+  if (ticks > MAX_SHOT_COUNT / TIMER_COUNT + 1) {
+      count = MAX_SHOT_COUNT;
+  } else {
+      count = (unsigned long) ticks * TIMER_COUNT;
+      count = (past < count) ? count - past :  1;
+      if (count > MAX_SHOT_COUNT) count = MAX_SHOT_COUNT;
+  }
+
+  outb(TIMER_MODE, ONE_SHOT);           /* restart the counter */
+  outb(TIMER0, count);                  /* load timer low byte */
+  outb(TIMER0, count >> 8);             /* load timer high byte */
+  shot_end = (ticks < TMR_NEVER - realtime) ? realtime + ticks :  TMR_NEVER;
+}
 
 
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -8578,6 +9503,7 @@ FORWARD _PROTOTYPE( char *m_name, (void)                                );
 FORWARD _PROTOTYPE( struct device *m_prepare, (int device)              );
 FORWARD _PROTOTYPE( int m_transfer, (int proc_nr, int opcode, off_t position,
                                         iovec_t *iov, unsigned nr_req)  );
+FORWARD _PROTOTYPE( void m_vcopy, (struct vir_cp_req *vcp, int nr_vcp)  );
 FORWARD _PROTOTYPE( int m_do_open, (struct driver *dp, message *m_ptr)  );
 FORWARD _PROTOTYPE( void m_init, (void) );
 FORWARD _PROTOTYPE( int m_ioctl, (struct driver *dp, message *m_ptr)    );
@@ -8601,10 +9527,6 @@ PRIVATE struct driver m_dtab = {
   NULL
 };
 
-/* Buffer for the /dev/zero null byte feed. */
-#define ZERO_BUF_SIZE                   1024
-PRIVATE char dev_zero[ZERO_BUF_SIZE];
-
 #define click_to_round_k(n) \
         ((unsigned) ((((unsigned long) (n) << CLICK_SHIFT) + 512) / 1024))
 
@@ -8652,10 +9574,14 @@ off_t position;                 /* offset on device to read or write */
 iovec_t *iov;                   /* pointer to read or write request vector */
 unsigned nr_req;                /* length of request vector */
 {
-/* Read or write one the driver's minor devices. */
-  phys_bytes mem_phys;
+/* Read or write one the driver's minor devices.  The copies for a vector
+ * are collected and done with as few vectored copy calls as possible.
+ */
+  struct vir_cp_req vcp[CPVEC_NR], *vp;
+  int nr_vcp = 0;
+  phys_bytes mem_phys, user_phys;
   int seg;
-  unsigned count, left, chunk;
+  unsigned count;
   vir_bytes user_vir;
   struct device *dv;
   unsigned long dv_size;
@@ -8682,44 +9608,64 @@ unsigned nr_req;                /* length of request vector */
         case RAM_DEV: 
         case KMEM_DEV: 
         case BOOT_DEV: 
-            if (position >= dv_size) return(OK);        /* check for EOF */
+            if (position >= dv_size) { nr_req = 0; continue; }  /* EOF */
             if (position + count > dv_size) count = dv_size - position;
             seg = m_seg[m_device];
 
+            vp = &vcp[nr_vcp++];
             if (opcode == DEV_GATHER) {                 /* copy actual data */
-                sys_vircopy(SELF,seg,position, proc_nr,D,user_vir, count);
+                vp->src.proc_nr = MEM_PROC_NR;
+                vp->src.segment = seg;
+                vp->src.offset = position;
+                vp->dst.proc_nr = proc_nr;
+                vp->dst.segment = D;
+                vp->dst.offset = user_vir;
             } else {
-                sys_vircopy(proc_nr,D,user_vir, SELF,seg,position, count);
+                vp->src.proc_nr = proc_nr;
+                vp->src.segment = D;
+                vp->src.offset = user_vir;
+                vp->dst.proc_nr = MEM_PROC_NR;
+                vp->dst.segment = seg;
+                vp->dst.offset = position;
             }
+            vp->count = count;
             break;
 
         /* Physical copying. Only used to access entire memory. */
         case MEM_DEV: 
-            if (position >= dv_size) return(OK);        /* check for EOF */
+            if (position >= dv_size) { nr_req = 0; continue; }  /* EOF */
             if (position + count > dv_size) count = dv_size - position;
             mem_phys = cv64ul(dv->dv_base) + position;
 
+            vp = &vcp[nr_vcp++];
             if (opcode == DEV_GATHER) {                 /* copy data */
-                sys_physcopy(NONE, PHYS_SEG, mem_phys, 
-                        proc_nr, D, user_vir, count);
+                vp->src.proc_nr = NONE;
+                vp->src.segment = PHYS_SEG;
+                vp->src.offset = mem_phys;
+                vp->dst.proc_nr = proc_nr;
+                vp->dst.segment = D;
+                vp->dst.offset = user_vir;
             } else {
-                sys_physcopy(proc_nr, D, user_vir, 
-                        NONE, PHYS_SEG, mem_phys, count);
+                vp->src.proc_nr = proc_nr;
+                vp->src.segment = D;
+                vp->src.offset = user_vir;
+                vp->dst.proc_nr = NONE;
+                vp->dst.segment = PHYS_SEG;
+                vp->dst.offset = mem_phys;
             }
+            vp->count = count;
             break;
 
-        /* Null byte stream generator. */
+        /* Null byte stream generator.  Let the kernel clear the buffer. */
         case ZERO_DEV: 
-            if (opcode == DEV_GATHER) {
-                left = count;
-                while (left > 0) {
-                    chunk = (left > ZERO_BUF_SIZE) ? ZERO_BUF_SIZE :  left;
-                    if (OK != (s=sys_vircopy(SELF, D, (vir_bytes) dev_zero, 
-                            proc_nr, D, user_vir, chunk)))
-                        report("MEM","sys_vircopy failed", s);
-                    left -= chunk;
-                    user_vir += chunk;
+            if (opcode == DEV_GATHER && count > 0) {
+                if (OK != (s=sys_umap(proc_nr, D, user_vir, count,
+                                                        &user_phys))) {
+                    m_vcopy(vcp, nr_vcp);
+                    return(EFAULT);
                 }
+                if (OK != (s=sys_memset(0, user_phys, count)))
+                    report("MEM","sys_memset failed", s);
             }
             break;
 
@@ -8733,10 +9679,34 @@ unsigned nr_req;                /* length of request vector */
         iov->iov_addr += count;
         if ((iov->iov_size -= count) == 0) { iov++; nr_req--; }
 
+        /* Copy vector full? */
+        if (nr_vcp == CPVEC_NR) {
+            m_vcopy(vcp, nr_vcp);
+            nr_vcp = 0;
+        }
   }
+  m_vcopy(vcp, nr_vcp);
   return(OK);
 }
 	
+/*===========================================================================*
+ *                              m_vcopy                                      *
+ *===========================================================================*/
+PRIVATE void m_vcopy(vcp, nr_vcp)
+struct vir_cp_req *vcp;         /* copy requests */
+int nr_vcp;                     /* number of them */
+{
+/* Have the kernel carry out the collected copy requests in one call. */
+  int s, nr_ok;
+
+  if (nr_vcp == 0) return;
+  if (m_device == MEM_DEV)
+        s = sys_physvcopy(vcp, nr_vcp, &nr_ok);
+  else
+        s = sys_virvcopy(vcp, nr_vcp, &nr_ok);
+  if (s != OK) report("MEM","vectored copy failed", s);
+}
+	
 /*===========================================================================*
  *                              m_do_open                                    *
  *===========================================================================*/
@@ -8759,7 +9729,7 @@ message *m_ptr;
 PRIVATE void m_init()
 {
   /* Initialize this task. All minor devices are initialized one by one. */
-  int i, s;
+  int s;
 
   if (OK != (s=sys_getkinfo(&kinfo))) {
       panic("MEM","Couldn't get kernel information.",s);
@@ -8783,11 +9753,6 @@ PRIVATE void m_init()
       }
   }
 
-  /* Initialize /dev/zero. Simply write zeros into the buffer. */
-  for (i=0; i<ZERO_BUF_SIZE; i++) {
-       dev_zero[i] = '\0';
-  }
-
   /* Set up memory ranges for /dev/mem. */
   if (OK != (s=sys_getmachine(&machine))) {
       panic("MEM","Couldn't get machine information.",s);
@@ -8948,13 +9913,22 @@ _PROTOTYPE(int main, (void));
 #define   CMD_RECALIBRATE       0x10    /* recalibrate drive */
 #define   CMD_READ              0x20    /* read data */
 #define   CMD_READ_EXT          0x24    /* read data (LBA48 addressed) */
+#define   CMD_READ_DMA_EXT      0x25    /* read data using DMA (LBA48) */
+#define   CMD_READ_MULT_EXT     0x29    /* read multiple (LBA48 addressed) */
 #define   CMD_WRITE             0x30    /* write data */
 #define   CMD_WRITE_EXT         0x34    /* write data (LBA48 addressed) */
+#define   CMD_WRITE_DMA_EXT     0x35    /* write data using DMA (LBA48) */
+#define   CMD_WRITE_MULT_EXT    0x39    /* write multiple (LBA48 addressed) */
 #define   CMD_READVERIFY        0x40    /* read verify */
 #define   CMD_FORMAT            0x50    /* format track */
 #define   CMD_SEEK              0x70    /* seek cylinder */
 #define   CMD_DIAG              0x90    /* execute device diagnostics */
 #define   CMD_SPECIFY           0x91    /* specify parameters */
+#define   CMD_READ_MULT         0xC4    /* read data, a block per interrupt */
+#define   CMD_WRITE_MULT        0xC5    /* write data, a block per interrupt */
+#define   CMD_SET_MULTIPLE      0xC6    /* set sectors per block */
+#define   CMD_READ_DMA          0xC8    /* read data using bus master DMA */
+#define   CMD_WRITE_DMA         0xCA    /* write data using bus master DMA */
 #define   ATA_IDENTIFY          0xEC    /* identify drive */
 /* #define REG_CTL              0x206   */ /* control register */
 #define REG_CTL         0       /* control register */
@@ -8973,6 +9947,25 @@ _PROTOTYPE(int main, (void));
 #define   STATUS_CORR           0x04    /* correctable error occurred */
 #define   STATUS_CHECK          0x01    /* check error */
 
+/* Bus master registers, offset from the channel's bus master base. */
+#define BM_COMMAND          0   /* command */
+#define   BM_CMD_START          0x01    /* start the transfer */
+#define   BM_CMD_WRITE          0x08    /* write to memory (a disk read) */
+#define BM_STATUS           2   /* status */
+#define   BM_ST_ACTIVE          0x01    /* transfer in progress */
+#define   BM_ST_ERR             0x02    /* transfer failed */
+#define   BM_ST_INT             0x04    /* drive interrupted */
+#define BM_PRDTP            4   /* physical address of the PRD table */
+
+/* Physical region descriptor, one per contiguous piece of a DMA transfer. */
+struct prd {
+  u32_t prd_base;       /* physical address of the piece */
+  u16_t prd_count;      /* bytes, 0 means 64K */
+  u16_t prd_flags;
+};
+#define PRD_EOT         0x8000  /* last descriptor in the table */
+#define NR_PRDS          128    /* descriptors in the table */
+
 /* Interrupt request lines. */
 #define NO_IRQ           0      /* no IRQ set yet */
 
@@ -8988,6 +9981,12 @@ struct command {
   u8_t  cyl_hi;
   u8_t  ldh;
   u8_t  command;
+
+  /* The high order bytes of an LBA48 command. */
+  u8_t  count_prev;
+  u8_t  sector_prev;
+  u8_t  cyl_lo_prev;
+  u8_t  cyl_hi_prev;
 };
 
 /* Error codes */
@@ -9001,6 +10000,9 @@ struct command {
 #define MAX_DRIVES         8
 #define COMPAT_DRIVES      4
 #define MAX_SECS         256    /* controller can transfer this many sectors */
+#define MAX_SECS_EXT   65536    /* and this many with LBA48 commands */
+#define RECOVER_OK        64    /* good transfers before max_count grows */
+#define MAX_MULT          16    /* most sectors per block in multiple mode */
 #define MAX_ERRORS         4    /* how often to try rd/wt before quitting */
 #define NR_MINORS       (MAX_DRIVES * DEV_PER_DRIVE)
 #define SUB_PER_DRIVE   (NR_PARTITIONS * NR_PARTITIONS)
@@ -9021,7 +10023,7 @@ struct command {
 int timeout_ticks = DEF_TIMEOUT_TICKS, max_errors = MAX_ERRORS;
 int wakeup_ticks = WAKEUP;
 long w_standard_timeouts = 0, w_pci_debug = 0, w_instance = 0,
- w_lba48 = 0, atapi_debug = 0;
+ w_lba48 = 1, atapi_debug = 0, w_multiple = MAX_MULT, w_dma = 1;
 
 int w_testing = 0, w_silent = 0;
 
@@ -9038,11 +10040,14 @@ PRIVATE struct wini {           /* main drive struct, one entry per drive */
   unsigned w_status;            /* device status register */
   unsigned base_cmd;            /* command base register */
   unsigned base_ctl;            /* control base register */
+  unsigned base_dma;            /* bus master base register, 0 if none */
   unsigned irq;                 /* interrupt request line */
   unsigned irq_mask;            /* 1 << irq */
   unsigned irq_need_ack;        /* irq needs to be acknowledged */
   int irq_hook_id;              /* id of irq hook at the kernel */
   int lba48;                    /* supports lba48 */
+  int dma;                      /* transfers data with bus master DMA */
+  int top_dma;                  /* dma before any timeouts */
   unsigned lcylinders;          /* logical number of cylinders (BIOS) */
   unsigned lheads;              /* logical number of heads */
   unsigned lsectors;            /* logical number of sectors per track */
@@ -9052,6 +10057,11 @@ PRIVATE struct wini {           /* main drive struct, one entry per drive */
   unsigned ldhpref;             /* top four bytes of the LDH (head) register */
   unsigned precomp;             /* write precompensation cylinder / 4 */
   unsigned max_count;           /* max request for this drive */
+  unsigned top_count;           /* max_count before any timeouts */
+  unsigned good_ct;             /* good transfers since max_count was cut */
+  unsigned max_mult;            /* sectors per block the drive allows */
+  unsigned top_mult;            /* max_mult before any timeouts */
+  unsigned multiple;            /* sectors per block, 0 if not multiple */
   unsigned open_ct;             /* in-use count */
   struct device part[DEV_PER_DRIVE];    /* disks and partitions */
   struct device subpart[SUB_PER_DRIVE]; /* subpartitions */
@@ -9069,9 +10079,14 @@ PRIVATE int w_drive;                    /* selected drive */
 PRIVATE int w_controller;               /* selected controller */
 PRIVATE struct device *w_dv;            /* device's base and size */
 
+PRIVATE struct prd prd_buf[2 * NR_PRDS];        /* room to align the table */
+PRIVATE struct prd *prdt;               /* the PRD table */
+PRIVATE phys_bytes prdt_phys;           /* its physical address */
+
 FORWARD _PROTOTYPE( void init_params, (void)                            );
 FORWARD _PROTOTYPE( void init_drive, (struct wini *, int, int, int, int, int, int));
 FORWARD _PROTOTYPE( void init_params_pci, (int)                         );
+FORWARD _PROTOTYPE( void init_dma, (int devind, int drive)              );
 FORWARD _PROTOTYPE( int w_do_open, (struct driver *dp, message *m_ptr)  );
 FORWARD _PROTOTYPE( struct device *w_prepare, (int dev)                 );
 FORWARD _PROTOTYPE( int w_identify, (void)                              );
@@ -9080,7 +10095,11 @@ FORWARD _PROTOTYPE( int w_specify, (void)                               );
 FORWARD _PROTOTYPE( int w_io_test, (void)                               );
 FORWARD _PROTOTYPE( int w_transfer, (int proc_nr, int opcode, off_t position,
                                         iovec_t *iov, unsigned nr_req)  );
+FORWARD _PROTOTYPE( int setup_dma, (unsigned *nbytesp, int proc_nr,
+                                        iovec_t *iov, int opcode)       );
+FORWARD _PROTOTYPE( unsigned dma_stop, (void)                           );
 FORWARD _PROTOTYPE( int com_out, (struct command *cmd)                  );
+FORWARD _PROTOTYPE( int com_out_ext, (struct command *cmd)              );
 FORWARD _PROTOTYPE( void w_need_reset, (void)                           );
 FORWARD _PROTOTYPE( void ack_irqs, (unsigned int)                       );
 FORWARD _PROTOTYPE( int w_do_close, (struct driver *dp, message *m_ptr) );
@@ -9143,6 +10162,18 @@ PRIVATE void init_params()
   env_parse("ata_instance", "d", 0, &w_instance, 0, 8);
   env_parse("ata_lba48", "d", 0, &w_lba48, 0, 1);
   env_parse("atapi_debug", "d", 0, &atapi_debug, 0, 1);
+  env_parse("ata_multiple", "d", 0, &w_multiple, 0, MAX_MULT);
+  env_parse("ata_dma", "d", 0, &w_dma, 0, 1);
+
+  /* Place the PRD table so that it doesn't cross a 64K boundary. */
+  prdt = prd_buf;
+  if ((s=sys_umap(SELF, D, (vir_bytes) prd_buf, (phys_bytes) sizeof(prd_buf),
+                                                        &prdt_phys)) != OK)
+        panic(w_name(), "Couldn't map PRD table", s);
+  if ((size = dma_bytes_left(prdt_phys)) < NR_PRDS * sizeof(struct prd)) {
+        prdt = (struct prd *) ((char *) prd_buf + size);
+        prdt_phys += size;
+  }
 
   if (w_instance == 0) {
           /* Get the number of drives from the BIOS data area */
@@ -9194,6 +10225,7 @@ PRIVATE void init_params()
 	
 #define ATA_IF_NOTCOMPAT1 (1L << 0)
 #define ATA_IF_NOTCOMPAT2 (1L << 2)
+#define ATA_IF_BUSMASTER  (1L << 7)
 
 /*===========================================================================*
  *                              init_drive                                   *
@@ -9209,7 +10241,12 @@ PRIVATE void init_drive(struct wini *w, int base_cmd, int base_ctl, int irq, int
         w->irq_need_ack = ack;
         w->irq_hook_id = hook;
         w->ldhpref = ldh_init(drive);
-        w->max_count = MAX_SECS << SECTOR_SHIFT;
+        w->max_count = w->top_count = MAX_SECS << SECTOR_SHIFT;
+        w->good_ct = 0;
+        w->max_mult = w->top_mult = 0;
+        w->multiple = 0;
+        w->base_dma = 0;
+        w->dma = w->top_dma = 0;
         w->lba48 = 0;
 }
 	
@@ -9258,9 +10295,13 @@ PRIVATE void init_params_pci(int skip)
                 }
         } else {
                 /* If not.. this is not the ata-pci controller we're
-                 * looking for.
+                 * looking for.  Its bus master may serve the compatability
+                 * drives, though.
                  */
                 if (w_pci_debug) printf("atapci skipping compatability controller\n");
+                if (w_instance == 0 && (interface & ATA_IF_BUSMASTER) &&
+                                                wini[0].base_dma == 0)
+                        init_dma(devind, 0);
                 continue;
         }
 
@@ -9293,10 +10334,33 @@ PRIVATE void init_params_pci(int skip)
                                 printf("atapci %d:  0x%x 0x%x irq %d\n", devind, base_cmd, base_ctl, irq);
                 } else printf("atapci:  ignored drives on secondary channel, base %x\n", base_cmd);
         }
+        if (interface & ATA_IF_BUSMASTER) init_dma(devind, w_next_drive);
         w_next_drive += 4;
   }
 }
 	
+/*===========================================================================*
+ *                              init_dma                                     *
+ *===========================================================================*/
+PRIVATE void init_dma(int devind, int drive)
+{
+/* Give the four drives of a PCI IDE controller, starting at 'drive', the
+ * bus master registers of their channel and let the controller master
+ * the bus.
+ */
+  u32_t base_dma;
+  int i;
+
+  if (!w_dma) return;
+  base_dma = pci_attr_r32(devind, PCI_BAR_5) & 0xfffffff0;
+  if (base_dma == 0) return;
+  pci_attr_w16(devind, PCI_CR, pci_attr_r16(devind, PCI_CR) | PCI_CR_MAST_EN);
+
+  for (i = 0; i < 4 && drive + i < MAX_DRIVES; i++)
+        wini[drive + i].base_dma = base_dma + (i < 2 ? 0 : 8);
+  if (w_pci_debug) printf("atapci %d:  bus master 0x%x\n", devind, base_dma);
+}
+	
 /*===========================================================================*
  *                              w_do_open                                    *
  *===========================================================================*/
@@ -9392,6 +10456,7 @@ PRIVATE int w_identify()
   struct command cmd;
   int i, s;
   unsigned long size;
+  unsigned mult;
 #define id_byte(n)      (&tmp_buf[2 * (n)])
 #define id_word(n)      (((u16_t) id_byte(n)[0] <<  0) \
                         |((u16_t) id_byte(n)[1] <<  8))
@@ -9420,6 +10485,22 @@ PRIVATE int w_identify()
         wn->psectors = id_word(6);
         size = (u32_t) wn->pcylinders * wn->pheads * wn->psectors;
 
+        /* Largest power of two sectors per block READ/WRITE MULTIPLE may
+         * move, limited by the boot parameter.  Zero if not supported.
+         */
+        mult = MIN(id_word(47) & BYTE, w_multiple);
+        wn->max_mult = 1;
+        while (wn->max_mult * 2 <= mult) wn->max_mult *= 2;
+        if (wn->max_mult < 2) wn->max_mult = 0;
+        wn->top_mult = wn->max_mult;
+
+        /* Use DMA if the controller can master the bus and the drive
+         * supports DMA with a (multiword or ultra) mode selected.
+         */
+        wn->dma = wn->base_dma != 0 && (id_word(49) & 0x0100) &&
+                                ((id_word(63) | id_word(88)) & 0xFF00);
+        wn->top_dma = wn->dma;
+
         if ((id_byte(49)[1] & 0x02) && size > 512L*1024*2) {
                 /* Drive is LBA capable and is big enough to trust it to
                  * not make a mess of it.
@@ -9442,6 +10523,9 @@ PRIVATE int w_identify()
                         }
 
                         wn->lba48 = 1;
+                        wn->max_count = MAX_SECS_EXT << SECTOR_SHIFT;
+                        wn->top_count = wn->max_count;
+                        wn->good_ct = 0;
                 }
         }
 
@@ -9585,6 +10669,17 @@ PRIVATE int w_specify()
 
                 if (com_simple(&cmd) != OK) return(ERR);
         }
+
+        /* Let the drive move a block of sectors per interrupt.  A reset
+         * forgets the block size, so it is set again here every time.
+         */
+        wn->multiple = 0;
+        if (wn->max_mult != 0) {
+                cmd.count   = wn->max_mult;
+                cmd.ldh     = w_wn->ldhpref;
+                cmd.command = CMD_SET_MULTIPLE;
+                if (com_simple(&cmd) == OK) wn->multiple = wn->max_mult;
+        }
   }
   wn->state |= INITIALIZED;
   return(OK);
@@ -9594,17 +10689,45 @@ PRIVATE int w_specify()
  *                              do_transfer                                  *
  *===========================================================================*/
 PRIVATE int do_transfer(struct wini *wn, unsigned int precomp, unsigned int count,
-        unsigned int sector, unsigned int opcode)
+        unsigned int sector, unsigned int opcode, int do_dma)
 {
         struct command cmd;
         unsigned secspcyl = wn->pheads * wn->psectors;
+        int out = (opcode == DEV_SCATTER);
 
         cmd.precomp = precomp;
-        cmd.count   = count;
-        cmd.command = opcode == DEV_SCATTER ? CMD_WRITE :  CMD_READ;
-        /* 
-        if (w_lba48 && wn->lba48) {
-        } else  */
+        cmd.count   = count & BYTE;
+        if (do_dma)
+                cmd.command = out ? CMD_WRITE_DMA :  CMD_READ_DMA;
+        else if (wn->multiple != 0)
+                cmd.command = out ? CMD_WRITE_MULT :  CMD_READ_MULT;
+        else
+                cmd.command = out ? CMD_WRITE :  CMD_READ;
+
+        if (wn->lba48) {
+                /* LBA48: up to 65536 sectors, a 48 bit sector number of
+                 * which we use 32 bits.
+                 */
+                if (do_dma)
+                        cmd.command = out ? CMD_WRITE_DMA_EXT :
+                                                        CMD_READ_DMA_EXT;
+                else if (wn->multiple != 0)
+                        cmd.command = out ? CMD_WRITE_MULT_EXT :
+                                                        CMD_READ_MULT_EXT;
+                else
+                        cmd.command = out ? CMD_WRITE_EXT :  CMD_READ_EXT;
+                cmd.count_prev  = (count >>  8) & 0xFF;
+                cmd.sector      = (sector >>  0) & 0xFF;
+                cmd.cyl_lo      = (sector >>  8) & 0xFF;
+                cmd.cyl_hi      = (sector >> 16) & 0xFF;
+                cmd.sector_prev = (sector >> 24) & 0xFF;
+                cmd.cyl_lo_prev = 0;
+                cmd.cyl_hi_prev = 0;
+                cmd.ldh         = wn->ldhpref;
+
+                return com_out_ext(&cmd);
+        }
+
         if (wn->ldhpref & LDH_LBA) {
                 cmd.sector  = (sector >>  0) & 0xFF;
                 cmd.cyl_lo  = (sector >>  8) & 0xFF;
@@ -9636,10 +10759,11 @@ unsigned nr_req;                /* length of request vector */
 {
   struct wini *wn = w_wn;
   iovec_t *iop, *iov_end = iov + nr_req;
-  int r, s, errors;
+  int r, s, errors, do_dma;
   unsigned long block;
   unsigned long dv_size = cv64ul(w_dv->dv_size);
-  unsigned cylinder, head, sector, nbytes;
+  unsigned cylinder, head, sector, nbytes, chunk, count, left, n;
+  vir_bytes addr;
 
   /* Check disk address. */
   if ((position & SECTOR_MASK) != 0) return(EINVAL);
@@ -9665,23 +10789,57 @@ unsigned nr_req;                /* length of request vector */
         /* First check to see if a reinitialization is needed. */
         if (!(wn->state & INITIALIZED) && w_specify() != OK) return(EIO);
 
+        /* Use DMA if the request vector can be mapped for it. */
+        do_dma = wn->dma && setup_dma(&nbytes, proc_nr, iov, opcode) == OK;
+
         /* Tell the controller to transfer nbytes bytes. */
-        r = do_transfer(wn, wn->precomp, ((nbytes >> SECTOR_SHIFT) & BYTE),
-                block, opcode);
+        r = do_transfer(wn, wn->precomp, nbytes >> SECTOR_SHIFT,
+                block, opcode, do_dma);
+
+        if (do_dma) {
+                /* Start the bus master, one interrupt ends the transfer. */
+                if (r == OK) {
+                        if ((s=sys_outb(wn->base_dma + BM_COMMAND, BM_CMD_START
+                           | (opcode == DEV_GATHER ? BM_CMD_WRITE : 0))) != OK)
+                                panic(w_name(),"Couldn't start bus master",s);
+                        r = at_intr_wait();
+                        if (dma_stop() & BM_ST_ERR) r = ERR;
+                }
+
+                /* Book the bytes successfully transferred. */
+                if (r == OK) {
+                        position += nbytes;
+                        for (n = nbytes; n > 0; n -= count) {
+                                count = MIN(n, iov->iov_size);
+                                iov->iov_addr += count;
+                                if ((iov->iov_size -= count) == 0) {
+                                        iov++;
+                                        nr_req--;
+                                }
+                        }
+                        nbytes = 0;
+                }
+        }
 
         while (r == OK && nbytes > 0) {
-                /* For each sector, wait for an interrupt and fetch the data
+                /* For each block, wait for an interrupt and fetch the data
                  * (read), or supply data to the controller and wait for an
-                 * interrupt (write).
+                 * interrupt (write).  A block is one sector unless the drive
+                 * is in multiple mode.
                  */
+                chunk = MIN(nbytes, MAX(wn->multiple, 1) << SECTOR_SHIFT);
 
                 if (opcode == DEV_GATHER) {
                         /* First an interrupt, then data. */
                         if ((r = at_intr_wait()) != OK) {
                                 /* An error, send data to the bit bucket. */
-                                if (w_wn->w_status & STATUS_DRQ) {
+                                for (n = 0; n < chunk; n += SECTOR_SIZE) {
+                                        if (!(w_wn->w_status & STATUS_DRQ))
+                                                break;
         if ((s=sys_insw(wn->base_cmd + REG_DATA, SELF, tmp_buf, SECTOR_SIZE)) != OK)
                 panic(w_name(),"Call to sys_insw() failed", s);
+        if ((s=sys_inb(wn->base_cmd + REG_STATUS, &w_wn->w_status)) != OK)
+                panic(w_name(),"Couldn't read register",s);
                                 }
                                 break;
                         }
@@ -9690,23 +10848,43 @@ unsigned nr_req;                /* length of request vector */
                 /* Wait for data transfer requested. */
                 if (!w_waitfor(STATUS_DRQ, STATUS_DRQ)) { r = ERR; break; }
 
-                /* Copy bytes to or from the device's buffer. */
-                if (opcode == DEV_GATHER) {
-        if ((s=sys_insw(wn->base_cmd + REG_DATA, proc_nr, (void *) iov->iov_addr, SECTOR_SIZE)) != OK)
-                panic(w_name(),"Call to sys_insw() failed", s);
-                } else {
-        if ((s=sys_outsw(wn->base_cmd + REG_DATA, proc_nr, (void *) iov->iov_addr, SECTOR_SIZE)) != OK)
+                /* Copy the block to or from the device's buffer, one port
+                 * I/O call for each piece of the request vector it covers.
+                 */
+                iop = iov;
+                addr = iop->iov_addr;
+                left = iop->iov_size;
+                for (n = 0; n < chunk; n += count) {
+                        if (left == 0) {
+                                iop++;
+                                addr = iop->iov_addr;
+                                left = iop->iov_size;
+                        }
+                        count = MIN(chunk - n, left);
+                        if (opcode == DEV_GATHER) {
+        if ((s=sys_insw(wn->base_cmd + REG_DATA, proc_nr, (void *) addr, count)) != OK)
                 panic(w_name(),"Call to sys_insw() failed", s);
+                        } else {
+        if ((s=sys_outsw(wn->base_cmd + REG_DATA, proc_nr, (void *) addr, count)) != OK)
+                panic(w_name(),"Call to sys_outsw() failed", s);
+                        }
+                        addr += count;
+                        left -= count;
+                }
 
+                if (opcode == DEV_SCATTER) {
                         /* Data sent, wait for an interrupt. */
                         if ((r = at_intr_wait()) != OK) break;
                 }
 
                 /* Book the bytes successfully transferred. */
-                nbytes -= SECTOR_SIZE;
-                position += SECTOR_SIZE;
-                iov->iov_addr += SECTOR_SIZE;
-                if ((iov->iov_size -= SECTOR_SIZE) == 0) { iov++; nr_req--; }
+                nbytes -= chunk;
+                position += chunk;
+                for (n = chunk; n > 0; n -= count) {
+                        count = MIN(n, iov->iov_size);
+                        iov->iov_addr += count;
+                        if ((iov->iov_size -= count) == 0) { iov++; nr_req--; }
+                }
         }
 
         /* Any errors? */
@@ -9716,6 +10894,22 @@ unsigned nr_req;                /* length of request vector */
                         w_command = CMD_IDLE;
                         return(EIO);
                 }
+        } else
+        if ((wn->max_count < wn->top_count || wn->max_mult != wn->top_mult
+                        || wn->dma != wn->top_dma)
+                        && ++wn->good_ct == RECOVER_OK) {
+                /* The drive behaves again, let it try larger transfers,
+                 * and once they are back to full size, multiple mode and
+                 * DMA.  The block size is set again by w_specify().
+                 */
+                if (wn->max_count < wn->top_count) {
+                        wn->max_count = MIN(wn->max_count * 2, wn->top_count);
+                } else {
+                        wn->max_mult = wn->top_mult;
+                        wn->dma = wn->top_dma;
+                        wn->state &= ~INITIALIZED;
+                }
+                wn->good_ct = 0;
         }
   }
 
@@ -9723,6 +10917,90 @@ unsigned nr_req;                /* length of request vector */
   return(OK);
 }
 	
+/*===========================================================================*
+ *                              setup_dma                                    *
+ *===========================================================================*/
+PRIVATE int setup_dma(nbytesp, proc_nr, iov, opcode)
+unsigned *nbytesp;              /* bytes to transfer, may be cut short */
+int proc_nr;                    /* process doing the request */
+iovec_t *iov;                   /* pointer to read or write request vector */
+int opcode;                     /* DEV_GATHER or DEV_SCATTER */
+{
+/* Fill the PRD table for a DMA transfer of *nbytesp bytes from or to the
+ * request vector and point the bus master at it.  If the table fills up
+ * the transfer is cut short at a piece of the vector.  Fail if a piece
+ * can't be mapped or is not word aligned; the caller then uses programmed
+ * I/O.
+ */
+  struct wini *wn = w_wn;
+  struct prd *prd = prdt, *first;
+  phys_bytes phys;
+  unsigned nbytes = *nbytesp;
+  unsigned size, count, n, done, status;
+  int s;
+
+  for (n = 0; n < nbytes; iov++) {
+        size = MIN(iov->iov_size, nbytes - n);
+        if (sys_umap(proc_nr, D, iov->iov_addr, size, &phys) != OK)
+                return(ERR);
+        if ((phys | size) & 1) return(ERR);
+
+        first = prd;
+        done = n;
+        while (size > 0) {
+                /* A descriptor may not cross a 64K boundary. */
+                if (prd == prdt + NR_PRDS) {
+                        /* Table full, transfer the pieces that fit. */
+                        if ((done & SECTOR_MASK) != 0) return(ERR);
+                        prd = first;
+                        nbytes = done;
+                        break;
+                }
+                count = MIN(size, dma_bytes_left(phys));
+                prd->prd_base = phys;
+                prd->prd_count = count;         /* 64K becomes 0 */
+                prd->prd_flags = 0;
+                prd++;
+                phys += count;
+                size -= count;
+                n += count;
+        }
+  }
+  if (prd == prdt) return(ERR);
+  prd[-1].prd_flags = PRD_EOT;
+  *nbytesp = nbytes;
+
+  /* Load the table, clear old error and interrupt bits, set direction. */
+  if ((s=sys_outl(wn->base_dma + BM_PRDTP, prdt_phys)) != OK)
+        panic(w_name(),"Couldn't write register",s);
+  if ((s=sys_inb(wn->base_dma + BM_STATUS, &status)) != OK)
+        panic(w_name(),"Couldn't read register",s);
+  if ((s=sys_outb(wn->base_dma + BM_STATUS, status | BM_ST_ERR | BM_ST_INT))
+                                                                != OK)
+        panic(w_name(),"Couldn't write register",s);
+  if ((s=sys_outb(wn->base_dma + BM_COMMAND,
+                        opcode == DEV_GATHER ? BM_CMD_WRITE : 0)) != OK)
+        panic(w_name(),"Couldn't write register",s);
+  return(OK);
+}
+	
+/*===========================================================================*
+ *                              dma_stop                                     *
+ *===========================================================================*/
+PRIVATE unsigned dma_stop()
+{
+/* Stop the bus master and return its status. */
+  struct wini *wn = w_wn;
+  unsigned status;
+  int s;
+
+  if ((s=sys_outb(wn->base_dma + BM_COMMAND, 0)) != OK)
+        panic(w_name(),"Couldn't stop bus master",s);
+  if ((s=sys_inb(wn->base_dma + BM_STATUS, &status)) != OK)
+        panic(w_name(),"Couldn't read register",s);
+  return(status);
+}
+	
 /*===========================================================================*
  *                              com_out                                      *
  *===========================================================================*/
@@ -9775,6 +11053,59 @@ struct command *cmd;            /* Command block */
   return(OK);
 }
 	
+/*===========================================================================*
+ *                              com_out_ext                                  *
+ *===========================================================================*/
+PRIVATE int com_out_ext(cmd)
+struct command *cmd;            /* Command block */
+{
+/* Output an LBA48 command block to the winchester controller.  Each
+ * register is written twice, the high order byte first.
+ */
+
+  struct wini *wn = w_wn;
+  unsigned base_cmd = wn->base_cmd;
+  unsigned base_ctl = wn->base_ctl;
+  pvb_pair_t outbyte[11];               /* vector for sys_voutb() */
+  int s;                                /* status for sys_(v)outb() */
+
+  if (w_wn->state & IGNORING) return ERR;
+
+  if (!w_waitfor(STATUS_BSY, 0)) {
+        printf("%s:  controller not ready\n", w_name());
+        return(ERR);
+  }
+
+  /* Select drive. */
+  if ((s=sys_outb(base_cmd + REG_LDH, cmd->ldh)) != OK)
+        panic(w_name(),"Couldn't write register to select drive",s);
+
+  if (!w_waitfor(STATUS_BSY, 0)) {
+        printf("%s:  com_out_ext:  drive not ready\n", w_name());
+        return(ERR);
+  }
+
+  /* Schedule a wakeup call, see com_out(). */
+  sys_setalarm(wakeup_ticks, 0);
+
+  wn->w_status = STATUS_ADMBSY;
+  w_command = cmd->command;
+  pv_set(outbyte[0], base_ctl + REG_CTL, wn->pheads >= 8 ? CTL_EIGHTHEADS :  0);
+  pv_set(outbyte[1], base_cmd + REG_COUNT, cmd->count_prev);
+  pv_set(outbyte[2], base_cmd + REG_SECTOR, cmd->sector_prev);
+  pv_set(outbyte[3], base_cmd + REG_CYL_LO, cmd->cyl_lo_prev);
+  pv_set(outbyte[4], base_cmd + REG_CYL_HI, cmd->cyl_hi_prev);
+  pv_set(outbyte[5], base_cmd + REG_COUNT, cmd->count);
+  pv_set(outbyte[6], base_cmd + REG_SECTOR, cmd->sector);
+  pv_set(outbyte[7], base_cmd + REG_CYL_LO, cmd->cyl_lo);
+  pv_set(outbyte[8], base_cmd + REG_CYL_HI, cmd->cyl_hi);
+  pv_set(outbyte[9], base_cmd + REG_LDH, cmd->ldh);
+  pv_set(outbyte[10], base_cmd + REG_COMMAND, cmd->command);
+  if ((s=sys_voutb(outbyte,11)) != OK)
+        panic(w_name(),"Couldn't write registers with sys_voutb()",s);
+  return(OK);
+}
+	
 /*===========================================================================*
  *                              w_need_reset                                 *
  *===========================================================================*/
@@ -9834,14 +11165,33 @@ PRIVATE void w_timeout(void)
         break;          /* fine */
   case CMD_READ: 
   case CMD_WRITE: 
+  case CMD_READ_MULT: 
+  case CMD_WRITE_MULT: 
+  case CMD_READ_DMA: 
+  case CMD_WRITE_DMA: 
+  case CMD_READ_EXT: 
+  case CMD_WRITE_EXT: 
+  case CMD_READ_MULT_EXT: 
+  case CMD_WRITE_MULT_EXT: 
+  case CMD_READ_DMA_EXT: 
+  case CMD_WRITE_DMA_EXT: 
         /* Impossible, but not on PC's:   The controller does not respond. */
 
-        /* Limiting multisector I/O seems to help. */
+        /* Limiting multisector I/O seems to help.  w_transfer() lets
+         * max_count grow again after RECOVER_OK good transfers, and then
+         * restores multiple mode and DMA.
+         */
         if (wn->max_count > 8 * SECTOR_SIZE) {
                 wn->max_count = 8 * SECTOR_SIZE;
         } else {
                 wn->max_count = SECTOR_SIZE;
         }
+        wn->good_ct = 0;
+        wn->max_mult = 0;       /* back to a sector per interrupt */
+        if (wn->dma) {
+                (void) dma_stop();
+                wn->dma = 0;    /* and to programmed I/O */
+        }
         /*FALL THROUGH*/
   default: 
         /* Some other command. */
@@ -10144,7 +11494,8 @@ char *strerr(int e)
 
 #define LINEWRAP           1    /* console.c - wrap lines at column 80 */
 
-#define TTY_IN_BYTES     256    /* tty input queue size */
+#define TTY_IN_BYTES     256    /* console input queue size */
+#define TTY_IN_MAX      1024    /* max input queue size of other lines */
 #define TAB_SIZE           8    /* distance between tab stops */
 #define TAB_MASK           7    /* mask to compute a tab stop position */
 
@@ -10153,6 +11504,9 @@ char *strerr(int e)
 #define O_NOCTTY       00400    /* from <fcntl.h>, or cc will choke */
 #define O_NONBLOCK     04000
 
+/* Get the number of input characters a line has lost (Minix extension). */
+#define TIOCGOVR        _IOR('T', 21, unsigned long)
+
 struct tty;
 typedef _PROTOTYPE( int (*devfun_t), (struct tty *tp, int try_only) );
 typedef _PROTOTYPE( void (*devfunarg_t), (struct tty *tp, int c) );
@@ -10163,6 +11517,8 @@ typedef struct tty {
   int tty_minor;                /* device minor number */
 
   /* Input queue.  Typed characters are stored here until read by a program. */
+  u16_t *tty_inbuf;             /* tty input buffer, tty_insize entries */
+  int tty_insize;               /* size of the input queue */
   u16_t *tty_inhead;            /* pointer to place where next char goes */
   u16_t *tty_intail;            /* pointer to next char to be given to prog */
   int tty_incount;              /* # chars in the input queue */
@@ -10170,6 +11526,7 @@ typedef struct tty {
   devfun_t tty_devread;         /* routine to read from low level buffers */
   devfun_t tty_icancel;         /* cancel any device input */
   int tty_min;                  /* minimum requested #chars in input queue */
+  unsigned long tty_overruns;   /* # chars discarded, input queue was full */
   timer_t tty_tmr;              /* the timer for this tty */
 
   /* Output section. */
@@ -10183,26 +11540,28 @@ typedef struct tty {
   char tty_reprint;             /* 1 when echoed input messed up, else 0 */
   char tty_escaped;             /* 1 when LNEXT (^V) just seen, else 0 */
   char tty_inhibited;           /* 1 when STOP (^S) just seen (stops output) */
-  char tty_pgrp;                /* slot number of controlling process */
+  int tty_pgrp;                 /* slot number of controlling process */
   char tty_openct;              /* count of number of opens of this tty */
 
   /* Information about incomplete I/O requests is stored here. */
   char tty_inrepcode;           /* reply code, TASK_REPLY or REVIVE */
   char tty_inrevived;           /* set to 1 if revive callback is pending */
   char tty_incaller;            /* process that made the call (usually FS) */
-  char tty_inproc;              /* process that wants to read from tty */
+  int tty_inproc;               /* process that wants to read from tty */
   vir_bytes tty_in_vir;         /* virtual address where data is to go */
   int tty_inleft;               /* how many chars are still needed */
   int tty_incum;                /* # chars input so far */
   char tty_outrepcode;          /* reply code, TASK_REPLY or REVIVE */
   char tty_outrevived;          /* set to 1 if revive callback is pending */
   char tty_outcaller;           /* process that made the call (usually FS) */
-  char tty_outproc;             /* process that wants to write to tty */
+  int tty_outproc;              /* process that wants to write to tty */
   vir_bytes tty_out_vir;        /* virtual address where data comes from */
   int tty_outleft;              /* # chars yet to be output */
   int tty_outcum;               /* # chars output so far */
+  char tty_outburst;            /* 1 if output stopped at the burst limit */
+  struct wwait *tty_wwait;      /* writes waiting for the one in progress */
   char tty_iocaller;            /* process that made the call (usually FS) */
-  char tty_ioproc;              /* process that wants to do an ioctl */
+  int tty_ioproc;               /* process that wants to do an ioctl */
   int tty_ioreq;                /* ioctl request code */
   vir_bytes tty_iovir;          /* virtual address of ioctl buffer */
 
@@ -10216,9 +11575,6 @@ typedef struct tty {
   void *tty_priv;               /* pointer to per device private data */
   struct termios tty_termios;   /* terminal attributes */
   struct winsize tty_winsize;   /* window size (#lines and #columns) */
-
-  u16_t tty_inbuf[TTY_IN_BYTES];/* tty input buffer */
-
 } tty_t;
 
 /* Memory allocated in tty.c, so extern here. */
@@ -10253,6 +11609,7 @@ extern clock_t tty_next_timeout;        /* next TTY timeout */
 /* Number of elements and limit of a buffer. */
 #define buflen(buf)     (sizeof(buf) / sizeof((buf)[0]))
 #define bufend(buf)     ((buf) + buflen(buf))
+#define inbufend(tp)    ((tp)->tty_inbuf + (tp)->tty_insize)
 
 /* Memory allocated in tty.c, so extern here. */
 extern struct machine machine;  /* machine information (a.o.:  pc_at, ega) */
@@ -10408,6 +11765,8 @@ FORWARD _PROTOTYPE( void do_open, (tty_t *tp, message *m_ptr)           );
 FORWARD _PROTOTYPE( void do_close, (tty_t *tp, message *m_ptr)          );
 FORWARD _PROTOTYPE( void do_read, (tty_t *tp, message *m_ptr)           );
 FORWARD _PROTOTYPE( void do_write, (tty_t *tp, message *m_ptr)          );
+FORWARD _PROTOTYPE( int write_wait, (tty_t *tp, message *m_ptr)         );
+FORWARD _PROTOTYPE( void write_next, (tty_t *tp)                        );
 FORWARD _PROTOTYPE( void do_select, (tty_t *tp, message *m_ptr)         );
 FORWARD _PROTOTYPE( void do_status, (message *m_ptr)                    );
 FORWARD _PROTOTYPE( void in_transfer, (tty_t *tp)                       );
@@ -10431,6 +11790,17 @@ PRIVATE struct termios termios_defaults = {
 };
 PRIVATE struct winsize winsize_defaults;        /* = all zeroes */
 
+/* Writes waiting for the write in progress on their line, by process slot.
+ * A process can only wait in one write, so there is always room.
+ */
+PRIVATE struct wwait {
+  tty_t *ww_tty;                /* line waited for, NULL if slot is free */
+  struct wwait *ww_next;        /* next write waiting on the same line */
+  int ww_caller;                /* process that made the call (usually FS) */
+  vir_bytes ww_vir;             /* virtual address where data comes from */
+  int ww_count;                 /* # chars to write */
+} wwait[NR_PROCS];
+
 /* Global variables for the TTY task (declared extern in tty.h). */
 PUBLIC tty_t tty_table[NR_CONS+NR_RS_LINES+NR_PTYS];
 PUBLIC int ccurrent;                    /* currently active console */
@@ -10447,7 +11817,7 @@ PUBLIC void main(void)
 
   message tty_mess;             /* buffer for all incoming messages */
   unsigned line;
-  int s;
+  int s, busy;
   char *types[] = {"task","driver","server", "user"};
   register struct proc *rp;
   register tty_t *tp;
@@ -10467,13 +11837,22 @@ PUBLIC void main(void)
 
   while (TRUE) {
 
-        /* Check for and handle any events on any of the ttys. */
+        /* Check for and handle any events on any of the ttys.  A line that
+         * stopped at its output burst limit gets its next turn on the next
+         * pass, so one large write cannot hold up the other lines.
+         */
+        busy = FALSE;
         for (tp = FIRST_TTY; tp < END_TTY; tp++) {
-                if (tp->tty_events) handle_events(tp);
+                if (tp->tty_events || tp->tty_outburst) handle_events(tp);
+                if (tp->tty_outburst) busy = TRUE;
         }
 
-        /* Get a request message. */
-        receive(ANY, &tty_mess);
+        /* Get a request message.  Don't block while output is still due,
+         * but make another pass if no message is waiting.
+         */
+        if (busy) {
+                if (nb_receive(ANY, &tty_mess) != OK) continue;
+        } else receive(ANY, &tty_mess);
 
         /* First handle all kernel notification types that the TTY supports. 
          *  - An alarm went off, expire all timers and handle the events. 
@@ -10587,6 +11966,7 @@ PRIVATE void do_status(m_ptr)
 message *m_ptr;
 {
   register struct tty *tp;
+  struct tty *wtp;
   int event_found;
   int status;
   int ops;
@@ -10596,6 +11976,7 @@ message *m_ptr;
    * call to see if there is more.
    */
   event_found = 0;
+  wtp = NULL;
   for (tp = FIRST_TTY; tp < END_TTY; tp++) {
         if ((ops = select_try(tp, tp->tty_select_ops)) && 
                         tp->tty_select_proc == m_ptr->m_source) {
@@ -10631,6 +12012,7 @@ message *m_ptr;
                 tp->tty_outcum = 0;
                 tp->tty_outrevived = 0;         /* unmark revive event */
                 event_found = 1;
+                wtp = tp;                       /* line is free for writes */
                 break;
         }
   }
@@ -10649,6 +12031,9 @@ message *m_ptr;
   if ((status = send(m_ptr->m_source, m_ptr)) != OK) {
         panic("TTY","send in do_status failed, status\n", status);
   }
+
+  /* A writer was revived; start the next write waiting on its line. */
+  if (wtp != NULL) write_next(wtp);
 }
 	
 /*===========================================================================*
@@ -10738,18 +12123,19 @@ register message *m_ptr;        /* pointer to message sent to the task */
   int r;
   phys_bytes phys_addr;
 
-  /* Check if there is already a process hanging in a write, check if the
-   * parameters are correct, do I/O.
+  /* Check if the parameters are correct, check if there is already a process
+   * hanging in a write, do I/O.
    */
-  if (tp->tty_outleft > 0) {
-        r = EIO;
-  } else
   if (m_ptr->COUNT <= 0) {
         r = EINVAL;
   } else
   if (sys_umap(m_ptr->PROC_NR, D, (vir_bytes) m_ptr->ADDRESS, m_ptr->COUNT,
                 &phys_addr) != OK) {
         r = EFAULT;
+  } else
+  if (tp->tty_outleft > 0 || tp->tty_outrevived) {
+        /* Wait behind the write in progress, unless nonblocking. */
+        r = (m_ptr->TTY_FLAGS & O_NONBLOCK) ? EAGAIN :  write_wait(tp, m_ptr);
   } else {
         /* Copy message parameters to the tty structure. */
         tp->tty_outrepcode = TASK_REPLY;
@@ -10777,6 +12163,64 @@ register message *m_ptr;        /* pointer to message sent to the task */
   tty_reply(TASK_REPLY, m_ptr->m_source, m_ptr->PROC_NR, r);
 }
 	
+/*===========================================================================*
+ *                              write_wait                                   *
+ *===========================================================================*/
+PRIVATE int write_wait(tp, m_ptr)
+register tty_t *tp;
+register message *m_ptr;        /* pointer to message sent to the task */
+{
+/* Another write is in progress on the line.  Queue this one behind it and
+ * suspend the caller; write_next() starts it when the line is free.
+ */
+  struct wwait *wp, **wpp;
+  int proc_nr;
+
+  proc_nr = m_ptr->PROC_NR;
+  if (proc_nr < 0 || proc_nr >= NR_PROCS) return(EIO);
+  wp = &wwait[proc_nr];
+  if (wp->ww_tty != NULL) return(EIO);          /* already waiting */
+
+  wp->ww_tty = tp;
+  wp->ww_caller = m_ptr->m_source;
+  wp->ww_vir = (vir_bytes) m_ptr->ADDRESS;
+  wp->ww_count = m_ptr->COUNT;
+  wp->ww_next = NULL;
+  for (wpp = &tp->tty_wwait; *wpp != NULL; wpp = &(*wpp)->ww_next) {}
+  *wpp = wp;
+  return(SUSPEND);
+}
+	
+/*===========================================================================*
+ *                              write_next                                   *
+ *===========================================================================*/
+PRIVATE void write_next(tp)
+register tty_t *tp;
+{
+/* The write in progress on a line has ended.  Start the first write that is
+ * waiting for the line, or tell a selecting process that it is writable.
+ */
+  struct wwait *wp;
+
+  if (tp->tty_outleft > 0 || tp->tty_outrevived) return;
+
+  if ((wp = tp->tty_wwait) == NULL) {
+        if (tp->tty_select_ops) select_retry(tp);
+        return;
+  }
+  tp->tty_wwait = wp->ww_next;
+  wp->ww_tty = NULL;
+
+  /* The caller is already suspended, so it is always revived. */
+  tp->tty_outrepcode = REVIVE;
+  tp->tty_outcaller = wp->ww_caller;
+  tp->tty_outproc = wp - wwait;
+  tp->tty_out_vir = wp->ww_vir;
+  tp->tty_outleft = wp->ww_count;
+  tp->tty_outcum = 0;
+  handle_events(tp);
+}
+	
 /*===========================================================================*
  *                              do_ioctl                                     *
  *===========================================================================*/
@@ -10816,6 +12260,10 @@ message *m_ptr;                 /* pointer to message sent to task */
         size = sizeof(struct winsize);
         break;
 
+    case TIOCGOVR:       /* get input overrun count (Minix extension) */
+        size = sizeof(unsigned long);
+        break;
+
     case KIOCSMAP:       /* load keymap (Minix extension) */
         size = sizeof(keymap_t);
         break;
@@ -10909,6 +12357,12 @@ message *m_ptr;                 /* pointer to message sent to task */
         /* SIGWINCH... */
         break;
 
+    case TIOCGOVR: 
+        r = sys_vircopy(SELF, D, (vir_bytes) &tp->tty_overruns,
+                m_ptr->PROC_NR, D, (vir_bytes) m_ptr->ADDRESS, 
+                (vir_bytes) size);
+        break;
+
     case KIOCSMAP: 
         /* Load a new keymap (only /dev/console). */
         if (isconsole(tp)) r = kbd_loadmap(m_ptr);
@@ -10992,6 +12446,7 @@ message *m_ptr;                 /* pointer to message sent to task */
 
   int proc_nr;
   int mode;
+  struct wwait **wpp;
 
   /* Check the parameters carefully, to avoid cancelling twice. */
   proc_nr = m_ptr->PROC_NR;
@@ -11006,12 +12461,21 @@ message *m_ptr;                 /* pointer to message sent to task */
         (*tp->tty_ocancel)(tp, 0);
         tp->tty_outleft = tp->tty_outcum = 0;
   }
+  if ((mode & W_BIT) && proc_nr >= 0 && proc_nr < NR_PROCS
+                                        && wwait[proc_nr].ww_tty == tp) {
+        /* Process was waiting for another write.  Take it off the queue. */
+        wpp = &tp->tty_wwait;
+        while (*wpp != &wwait[proc_nr]) wpp = &(*wpp)->ww_next;
+        *wpp = wwait[proc_nr].ww_next;
+        wwait[proc_nr].ww_tty = NULL;
+  }
   if (tp->tty_ioreq != 0 && proc_nr == tp->tty_ioproc) {
         /* Process was waiting for output to drain. */
         tp->tty_ioreq = 0;
   }
   tp->tty_events = 1;
   tty_reply(TASK_REPLY, m_ptr->m_source, proc_nr, EINTR);
+  write_next(tp);                       /* the line may be free now */
 }
 	
 PUBLIC int select_try(struct tty *tp, int ops)
@@ -11042,8 +12506,10 @@ PUBLIC int select_try(struct tty *tp, int ops)
         }
 
         if (ops & SEL_WR)  {
-                if (tp->tty_outleft > 0)  ready_ops |= SEL_WR;
-                else if ((*tp->tty_devwrite)(tp, 1)) ready_ops |= SEL_WR;
+                /* A write waits while another one is in progress. */
+                if (tp->tty_outleft == 0 && !tp->tty_outrevived
+                                        && (*tp->tty_devwrite)(tp, 1))
+                        ready_ops |= SEL_WR;
         }
 
         return ready_ops;
@@ -11120,11 +12586,15 @@ tty_t *tp;                      /* TTY to check for events. */
 PRIVATE void in_transfer(tp)
 register tty_t *tp;             /* pointer to terminal to read from */
 {
-/* Transfer bytes from the input queue to a process reading from a terminal. */
+/* Transfer bytes from the input queue to a process reading from a terminal.
+ * The characters are gathered in one buffer, large enough for a full input
+ * queue, and copied to the reader with a single call.
+ */
 
   int ch;
   int count;
-  char buf[64], *bp;
+  static char buf[MAX(TTY_IN_BYTES, TTY_IN_MAX)];
+  char *bp;
 
   /* Force read to succeed if the line is hung up, looks like EOF to reader. */
   if (tp->tty_termios.c_ospeed == B0) tp->tty_min = 0;
@@ -11138,21 +12608,12 @@ register tty_t *tp;             /* pointer to terminal to read from */
 
         if (!(ch & IN_EOF)) {
                 /* One character to be delivered to the user. */
-                *bp = ch & IN_CHAR;
+                *bp++ = ch & IN_CHAR;
                 tp->tty_inleft--;
-                if (++bp == bufend(buf)) {
-                        /* Temp buffer full, copy to user space. */
-                        sys_vircopy(SELF, D, (vir_bytes) buf, 
-                                tp->tty_inproc, D, tp->tty_in_vir,
-                                (vir_bytes) buflen(buf));
-                        tp->tty_in_vir += buflen(buf);
-                        tp->tty_incum += buflen(buf);
-                        bp = buf;
-                }
         }
 
         /* Remove the character from the input queue. */
-        if (++tp->tty_intail == bufend(tp->tty_inbuf))
+        if (++tp->tty_intail == inbufend(tp))
                 tp->tty_intail = tp->tty_inbuf;
         tp->tty_incount--;
         if (ch & IN_EOT) {
@@ -11163,7 +12624,7 @@ register tty_t *tp;             /* pointer to terminal to read from */
   }
 
   if (bp > buf) {
-        /* Leftover characters in the buffer. */
+        /* Copy the characters to user space. */
         count = bp - buf;
         sys_vircopy(SELF, D, (vir_bytes) buf, 
                 tp->tty_inproc, D, tp->tty_in_vir, (vir_bytes) count);
@@ -11311,9 +12772,12 @@ int count;                      /* number of input characters */
         }
 
         /* Is there space in the input buffer? */
-        if (tp->tty_incount == buflen(tp->tty_inbuf)) {
+        if (tp->tty_incount == tp->tty_insize) {
                 /* No space; discard in canonical mode, keep in raw mode. */
-                if (tp->tty_termios.c_lflag & ICANON) continue;
+                if (tp->tty_termios.c_lflag & ICANON) {
+                        tp->tty_overruns++;
+                        continue;
+                }
                 break;
         }
 
@@ -11334,13 +12798,13 @@ int count;                      /* number of input characters */
 
         /* Save the character in the input queue. */
         *tp->tty_inhead++ = ch;
-        if (tp->tty_inhead == bufend(tp->tty_inbuf))
+        if (tp->tty_inhead == inbufend(tp))
                 tp->tty_inhead = tp->tty_inbuf;
         tp->tty_incount++;
         if (ch & IN_EOT) tp->tty_eotct++;
 
         /* Try to finish input if the queue threatens to overflow. */
-        if (tp->tty_incount == buflen(tp->tty_inbuf)) in_transfer(tp);
+        if (tp->tty_incount == tp->tty_insize) in_transfer(tp);
   }
   return ct;
 }
@@ -11431,7 +12895,7 @@ register tty_t *tp;
 
   if (tp->tty_incount == 0) return(0);  /* queue empty */
   head = tp->tty_inhead;
-  if (head == tp->tty_inbuf) head = bufend(tp->tty_inbuf);
+  if (head == tp->tty_inbuf) head = inbufend(tp);
   if (*--head & IN_EOT) return(0);              /* can't erase "line breaks" */
   if (tp->tty_reprint) reprint(tp);             /* reprint if messed up */
   tp->tty_inhead = head;
@@ -11466,7 +12930,7 @@ register tty_t *tp;             /* pointer to tty struct */
   head = tp->tty_inhead;
   count = tp->tty_incount;
   while (count > 0) {
-        if (head == tp->tty_inbuf) head = bufend(tp->tty_inbuf);
+        if (head == tp->tty_inbuf) head = inbufend(tp);
         if (head[-1] & IN_EOT) break;
         head--;
         count--;
@@ -11480,7 +12944,7 @@ register tty_t *tp;             /* pointer to tty struct */
 
   /* Reprint from the last break onwards. */
   do {
-        if (head == bufend(tp->tty_inbuf)) head = tp->tty_inbuf;
+        if (head == inbufend(tp)) head = tp->tty_inbuf;
         *head = tty_echo(tp, *head);
         head++;
         count++;
@@ -11618,7 +13082,7 @@ tty_t *tp;
         inp = tp->tty_intail;
         while (count > 0) {
                 *inp |= IN_EOT;
-                if (++inp == bufend(tp->tty_inbuf)) inp = tp->tty_inbuf;
+                if (++inp == inbufend(tp)) inp = tp->tty_inbuf;
                 --count;
         }
   }
@@ -11716,19 +13180,33 @@ register tty_t *tp;
  *===========================================================================*/
 PRIVATE void tty_init()
 {
-/* Initialize tty structure and call device initialization routines. */
+/* Initialize tty structure and call device initialization routines.  The
+ * input queues are taken from 'inpool'.  Consoles are only fed by the keyboard
+ * and get TTY_IN_BYTES entries; RS232 lines and pseudo terminals may receive
+ * bursts and get as many as the "tty_inbytes" boot parameter says.
+ */
 
+  static u16_t inpool[NR_CONS * TTY_IN_BYTES
+                                + (NR_RS_LINES + NR_PTYS) * TTY_IN_MAX];
   register tty_t *tp;
+  u16_t *inp;
+  long inbytes = TTY_IN_MAX;
   int s;
   struct sigaction sigact;
 
+  env_parse("tty_inbytes", "d", 0, &inbytes, TTY_IN_BYTES, TTY_IN_MAX);
+
   /* Initialize the terminal lines. */
+  inp = inpool;
   for (tp = FIRST_TTY,s=0; tp < END_TTY; tp++,s++) {
 
         tp->tty_index = s;
 
         tmr_inittimer(&tp->tty_tmr);
 
+        tp->tty_inbuf = inp;
+        tp->tty_insize = tp < tty_addr(NR_CONS) ? TTY_IN_BYTES :  (int) inbytes;
+        inp += tp < tty_addr(NR_CONS) ? TTY_IN_BYTES :  TTY_IN_MAX;
         tp->tty_intail = tp->tty_inhead = tp->tty_inbuf;
         tp->tty_min = 1;
         tp->tty_termios = termios_defaults;
@@ -12029,7 +13507,10 @@ PRIVATE int kb_read(tp, try)
 tty_t *tp;
 int try;
 {
-/* Process characters from the circular keyboard buffer. */
+/* Process characters from the circular keyboard buffer.  In raw mode,
+ * characters that in_process() leaves when the input queue is full cannot
+ * be held back, so they are lost and counted as overruns.
+ */
   char buf[3];
   int scode;
   unsigned ch;
@@ -12055,14 +13536,14 @@ int try;
         if (ch <= 0xFF) {
                 /* A normal character. */
                 buf[0] = ch;
-                (void) in_process(tp, buf, 1);
+                tp->tty_overruns += 1 - in_process(tp, buf, 1);
         } else
         if (HOME <= ch && ch <= INSRT) {
                 /* An ASCII escape sequence generated by the numeric pad. */
                 buf[0] = ESC;
                 buf[1] = '[';
                 buf[2] = numpad_map[ch - HOME];
-                (void) in_process(tp, buf, 3);
+                tp->tty_overruns += 3 - in_process(tp, buf, 3);
         } else
         if (ch == ALEFT) {
                 /* Choose lower numbered console as current console. */
@@ -12546,6 +14027,13 @@ message *m;                     /* request message to TTY */
  * (word) addresses for simplicity and assume there is no wrapping.  The
  * assembly support functions translate the word addresses to byte addresses
  * and the scrolling function worries about wrapping.
+ *
+ * Video memory is slow, so the driver does not write it directly.  All
+ * changes are made to 'shadow', a copy of video memory in main memory, and
+ * the chunks of it that changed are written out by cons_sync() at the end
+ * of a write, an echo or a kernel message.  Many lines of output and many
+ * scrolled lines thus cost one copy to the screen, and the origin and the
+ * cursor are set only once.
  */
 
 #include "../drivers.h"
@@ -12567,8 +14055,10 @@ message *m;                     /* request message to TTY */
 #define BLANK_COLOR   0x0700    /* determines cursor color on blank screen */
 #define SCROLL_UP          0    /* scroll forward */
 #define SCROLL_DOWN        1    /* scroll backward */
-#define BLANK_MEM ((u16_t *) 0) /* tells mem_vid_copy() to blank the screen */
+#define BLANK_MEM ((u16_t *) 0) /* tells shadow_copy() to blank the screen */
 #define CONS_RAM_WORDS    80    /* video ram buffer size */
+#define CONS_OUT_BYTES  1024    /* bytes of a write done in one burst */
+#define VID_CHUNK         64    /* words per dirty flag of the shadow */
 #define MAX_ESC_PARMS      4    /* number of escape sequence params allowed */
 
 /* Constants relating to the controller chips. */
@@ -12609,6 +14099,13 @@ PRIVATE unsigned font_lines;    /* font lines per character */
 PRIVATE unsigned scr_width;     /* # characters on a line */
 PRIVATE unsigned scr_lines;     /* # lines on the screen */
 PRIVATE unsigned scr_size;      /* # characters on the screen */
+PRIVATE unsigned hw_org;        /* origin as last set in the 6845 */
+PRIVATE unsigned hw_cur;        /* cursor as last set in the 6845 */
+
+/* Copy of video memory, and which chunks of it must still be written out. */
+PRIVATE u16_t shadow[EGA_SIZE / 2];
+PRIVATE char shadow_dirty[EGA_SIZE / 2 / VID_CHUNK];
+PRIVATE int shadow_changed;     /* set if any chunk is dirty */
 
 /* Per console data. */
 typedef struct console {
@@ -12654,6 +14151,12 @@ FORWARD _PROTOTYPE( void putk, (int c)                                  );
 FORWARD _PROTOTYPE( void beep, (void)                                   );
 FORWARD _PROTOTYPE( void do_escape, (console_t *cons, int c)            );
 FORWARD _PROTOTYPE( void flush, (console_t *cons)                       );
+FORWARD _PROTOTYPE( void shadow_copy, (u16_t *src, unsigned dst,
+                                                        unsigned count) );
+FORWARD _PROTOTYPE( void shadow_move, (unsigned src, unsigned dst,
+                                                        unsigned count) );
+FORWARD _PROTOTYPE( void mark_dirty, (unsigned dst, unsigned count)     );
+FORWARD _PROTOTYPE( void cons_sync, (void)                              );
 FORWARD _PROTOTYPE( void parse_escape, (console_t *cons, int c)         );
 FORWARD _PROTOTYPE( void scroll_screen, (console_t *cons, int dir)      );
 FORWARD _PROTOTYPE( void set_6845, (int reg, unsigned val)              );
@@ -12670,15 +14173,15 @@ PRIVATE int cons_write(tp, try)
 register struct tty *tp;        /* tells which terminal is to be used */
 int try;
 {
-/* Copy as much data as possible to the output queue, then start I/O.  On
- * memory-mapped terminals, such as the IBM console, the I/O will also be
- * finished, and the counts updated.  Keep repeating until all I/O done.
+/* Copy the next burst of the user's data to the output queue and put it on
+ * the screen.  A large write is done one burst per pass of the TTY main loop,
+ * so that keyboard input and the other consoles get their turn in between.
+ * The writer is replied to or revived when the last burst has been shown.
  */
-
+  static char outqueue[CONS_OUT_BYTES];
   int count;
   int result;
   register char *tbuf;
-  char buf[64];
   console_t *cons = tp->tty_priv;
 
   if (try) return 1;    /* we can always write to console */
@@ -12686,17 +14189,16 @@ int try;
   /* Check quickly for nothing to do, so this can be called often without
    * unmodular tests elsewhere.
    */
+  tp->tty_outburst = 0;
   if ((count = tp->tty_outleft) == 0 || tp->tty_inhibited) return;
 
-  /* Copy the user bytes to buf[] for decent addressing. Loop over the
-   * copies, since the user buffer may be much larger than buf[].
+  /* Copy the user bytes to the queue for decent addressing, as many as
+   * fit at once.
    */
-  do {
-        if (count > sizeof(buf)) count = sizeof(buf);
-        if ((result = sys_vircopy(tp->tty_outproc, D, tp->tty_out_vir, 
-                        SELF, D, (vir_bytes) buf, (vir_bytes) count)) != OK)
-                break;
-        tbuf = buf;
+  if (count > sizeof(outqueue)) count = sizeof(outqueue);
+  if ((result = sys_vircopy(tp->tty_outproc, D, tp->tty_out_vir, 
+                SELF, D, (vir_bytes) outqueue, (vir_bytes) count)) == OK) {
+        tbuf = outqueue;
 
         /* Update terminal data structure. */
         tp->tty_out_vir += count;
@@ -12719,13 +14221,24 @@ int try;
                         cons->c_column++;
                 }
         } while (--count != 0);
-  } while ((count = tp->tty_outleft) != 0 && !tp->tty_inhibited);
 
-  flush(cons);                  /* transfer anything buffered to the screen */
+        flush(cons);            /* transfer anything buffered to the screen */
+        cons_sync();            /* and the changes to video memory */
+  } else {
+        tp->tty_outleft = 0;    /* give up on the rest */
+  }
+
+  /* More to come?  Then leave it for the next pass of the main loop. */
+  if (tp->tty_outleft > 0) {
+        tp->tty_outburst = 1;
+        return;
+  }
 
-  /* Reply to the writer if all output is finished or if an error occured. */
-  if (tp->tty_outleft == 0 || result != OK) {
-        /* REVIVE is not possible. I/O on memory mapped consoles finishes. */
+  /* All output is finished or an error occured, tell the writer. */
+  if (tp->tty_outrepcode == REVIVE) {
+        notify(tp->tty_outcaller);
+        tp->tty_outrevived = 1;
+  } else {
         tty_reply(tp->tty_outrepcode, tp->tty_outcaller, tp->tty_outproc,
                                                         tp->tty_outcum);
         tp->tty_outcum = 0;
@@ -12744,6 +14257,7 @@ int c;                          /* character to be echoed */
 
   out_char(cons, c);
   flush(cons);
+  cons_sync();
 }
 	
 /*===========================================================================*
@@ -12854,10 +14368,10 @@ int dir;                        /* SCROLL_UP or SCROLL_DOWN */
   if (dir == SCROLL_UP) {
         /* Scroll one line up in 3 ways:  soft, avoid wrap, use origin. */
         if (softscroll) {
-                vid_vid_copy(cons->c_start + scr_width, cons->c_start, chars);
+                shadow_move(cons->c_start + scr_width, cons->c_start, chars);
         } else
         if (!wrap && cons->c_org + scr_size + scr_width >= cons->c_limit) {
-                vid_vid_copy(cons->c_org + scr_width, cons->c_start, chars);
+                shadow_move(cons->c_org + scr_width, cons->c_start, chars);
                 cons->c_org = cons->c_start;
         } else {
                 cons->c_org = (cons->c_org + scr_width) & vid_mask;
@@ -12866,23 +14380,22 @@ int dir;                        /* SCROLL_UP or SCROLL_DOWN */
   } else {
         /* Scroll one line down in 3 ways:  soft, avoid wrap, use origin. */
         if (softscroll) {
-                vid_vid_copy(cons->c_start, cons->c_start + scr_width, chars);
+                shadow_move(cons->c_start, cons->c_start + scr_width, chars);
         } else
         if (!wrap && cons->c_org < cons->c_start + scr_width) {
                 new_org = cons->c_limit - scr_size;
-                vid_vid_copy(cons->c_org, new_org + scr_width, chars);
+                shadow_move(cons->c_org, new_org + scr_width, chars);
                 cons->c_org = new_org;
         } else {
                 cons->c_org = (cons->c_org - scr_width) & vid_mask;
         }
         new_line = cons->c_org;
   }
-  /* Blank the new line at top or bottom. */
+  /* Blank the new line at top or bottom.  The new origin is set by
+   * cons_sync().
+   */
   blank_color = cons->c_blank;
-  mem_vid_copy(BLANK_MEM, new_line, scr_width);
-
-  /* Set the new video origin. */
-  if (cons == curcons) set_6845(VID_ORG, cons->c_org);
+  shadow_copy(BLANK_MEM, new_line, scr_width);
   flush(cons);
 }
 	
@@ -12892,15 +14405,15 @@ int dir;                        /* SCROLL_UP or SCROLL_DOWN */
 PRIVATE void flush(cons)
 register console_t *cons;       /* pointer to console struct */
 {
-/* Send characters buffered in 'ramqueue' to screen memory, check the new
- * cursor position, compute the new hardware cursor position and set it.
+/* Send characters buffered in 'ramqueue' to the shadow of screen memory,
+ * check the new cursor position and compute the new hardware cursor position.
  */
   unsigned cur;
   tty_t *tp = cons->c_tty;
 
   /* Have the characters in 'ramqueue' transferred to the screen. */
   if (cons->c_rwords > 0) {
-        mem_vid_copy(cons->c_ramqueue, cons->c_cur, cons->c_rwords);
+        shadow_copy(cons->c_ramqueue, cons->c_cur, cons->c_rwords);
         cons->c_rwords = 0;
 
         /* TTY likes to know the current column and if echoing messed up. */
@@ -12913,13 +14426,101 @@ register console_t *cons;       /* pointer to console struct */
   if (cons->c_column > scr_width) cons->c_column = scr_width;
   if (cons->c_row < 0) cons->c_row = 0;
   if (cons->c_row >= scr_lines) cons->c_row = scr_lines - 1;
-  cur = cons->c_org + cons->c_row * scr_width + cons->c_column;
-  if (cur != cons->c_cur) {
-        if (cons == curcons) set_6845(CURSOR, cur);
-        cons->c_cur = cur;
+  cons->c_cur = cons->c_org + cons->c_row * scr_width + cons->c_column;
+}
+	
+/*===========================================================================*
+ *                              shadow_copy                                  *
+ *===========================================================================*/
+PRIVATE void shadow_copy(src, dst, count)
+u16_t *src;                     /* words to copy, or BLANK_MEM */
+unsigned dst;                   /* video memory word address */
+unsigned count;                 /* number of words */
+{
+/* Copy words to the shadow of video memory, as mem_vid_copy() would to video
+ * memory itself.  If 'src' is BLANK_MEM, fill with 'blank_color'.
+ */
+  unsigned i;
+
+  mark_dirty(dst, count);
+  for (i = 0; i < count; i++)
+        shadow[(dst + i) & vid_mask] = src == BLANK_MEM ? blank_color :  src[i];
+}
+	
+/*===========================================================================*
+ *                              shadow_move                                  *
+ *===========================================================================*/
+PRIVATE void shadow_move(src, dst, count)
+unsigned src;                   /* video memory word address to copy from */
+unsigned dst;                   /* video memory word address to copy to */
+unsigned count;                 /* number of words */
+{
+/* Move words within the shadow of video memory, as vid_vid_copy() would
+ * within video memory.  The areas may overlap.
+ */
+  unsigned i;
+
+  mark_dirty(dst, count);
+  if (src > dst) {
+        for (i = 0; i < count; i++)
+                shadow[(dst + i) & vid_mask] = shadow[(src + i) & vid_mask];
+  } else {
+        for (i = count; i > 0; i--)
+                shadow[(dst + i-1) & vid_mask] = shadow[(src + i-1) & vid_mask];
   }
 }
 	
+/*===========================================================================*
+ *                              mark_dirty                                   *
+ *===========================================================================*/
+PRIVATE void mark_dirty(dst, count)
+unsigned dst;                   /* video memory word address */
+unsigned count;                 /* number of words changed */
+{
+/* Remember which chunks of the shadow must be written to video memory. */
+  unsigned chunk, nchunks;
+
+  if (count == 0) return;
+  chunk = (dst & vid_mask) / VID_CHUNK;
+  nchunks = ((dst % VID_CHUNK) + count + VID_CHUNK-1) / VID_CHUNK;
+  if (nchunks > vid_size / VID_CHUNK) nchunks = vid_size / VID_CHUNK;
+  while (nchunks-- > 0) {
+        shadow_dirty[chunk] = TRUE;
+        if (++chunk == vid_size / VID_CHUNK) chunk = 0;
+  }
+  shadow_changed = TRUE;
+}
+	
+/*===========================================================================*
+ *                              cons_sync                                    *
+ *===========================================================================*/
+PRIVATE void cons_sync()
+{
+/* Write the changed chunks of the shadow to video memory, each run of
+ * adjacent chunks with one copy, then bring the origin and cursor of the
+ * visible console up to date.
+ */
+  unsigned chunk, n, nchunks;
+
+  if (shadow_changed) {
+        nchunks = vid_size / VID_CHUNK;
+        for (chunk = 0; chunk < nchunks; chunk += n) {
+                for (n = 0; chunk + n < nchunks && shadow_dirty[chunk + n]; n++)
+                        shadow_dirty[chunk + n] = FALSE;
+                if (n == 0) {
+                        n = 1;
+                        continue;
+                }
+                mem_vid_copy(&shadow[chunk * VID_CHUNK], chunk * VID_CHUNK,
+                                                        n * VID_CHUNK);
+        }
+        shadow_changed = FALSE;
+  }
+
+  if (curcons->c_org != hw_org) set_6845(VID_ORG, hw_org = curcons->c_org);
+  if (curcons->c_cur != hw_cur) set_6845(CURSOR, hw_cur = curcons->c_cur);
+}
+	
 /*===========================================================================*
  *                              parse_escape                                 *
  *===========================================================================*/
@@ -13061,7 +14662,7 @@ char c;                         /* next character in escape sequence */
                         dst = cons->c_org;
                 }
                 blank_color = cons->c_blank;
-                mem_vid_copy(BLANK_MEM, dst, count);
+                shadow_copy(BLANK_MEM, dst, count);
                 break;
 
             case 'K':            /* ESC [sK clears line from cursor */
@@ -13083,7 +14684,7 @@ char c;                         /* next character in escape sequence */
                         dst = cons->c_cur;
                 }
                 blank_color = cons->c_blank;
-                mem_vid_copy(BLANK_MEM, dst, count);
+                shadow_copy(BLANK_MEM, dst, count);
                 break;
 
             case 'L':            /* ESC [nL inserts n lines at cursor */
@@ -13095,9 +14696,9 @@ char c;                         /* next character in escape sequence */
                 src = cons->c_org + cons->c_row * scr_width;
                 dst = src + n * scr_width;
                 count = (scr_lines - cons->c_row - n) * scr_width;
-                vid_vid_copy(src, dst, count);
+                shadow_move(src, dst, count);
                 blank_color = cons->c_blank;
-                mem_vid_copy(BLANK_MEM, src, n * scr_width);
+                shadow_copy(BLANK_MEM, src, n * scr_width);
                 break;
 
             case 'M':            /* ESC [nM deletes n lines at cursor */
@@ -13109,9 +14710,9 @@ char c;                         /* next character in escape sequence */
                 dst = cons->c_org + cons->c_row * scr_width;
                 src = dst + n * scr_width;
                 count = (scr_lines - cons->c_row - n) * scr_width;
-                vid_vid_copy(src, dst, count);
+                shadow_move(src, dst, count);
                 blank_color = cons->c_blank;
-                mem_vid_copy(BLANK_MEM, dst + count, n * scr_width);
+                shadow_copy(BLANK_MEM, dst + count, n * scr_width);
                 break;
 
             case '@':            /* ESC [n@ inserts n chars at cursor */
@@ -13123,9 +14724,9 @@ char c;                         /* next character in escape sequence */
                 src = cons->c_cur;
                 dst = src + n;
                 count = scr_width - cons->c_column - n;
-                vid_vid_copy(src, dst, count);
+                shadow_move(src, dst, count);
                 blank_color = cons->c_blank;
-                mem_vid_copy(BLANK_MEM, src, n);
+                shadow_copy(BLANK_MEM, src, n);
                 break;
 
             case 'P':            /* ESC [nP deletes n chars at cursor */
@@ -13137,9 +14738,9 @@ char c;                         /* next character in escape sequence */
                 dst = cons->c_cur;
                 src = dst + n;
                 count = scr_width - cons->c_column - n;
-                vid_vid_copy(src, dst, count);
+                shadow_move(src, dst, count);
                 blank_color = cons->c_blank;
-                mem_vid_copy(BLANK_MEM, dst + count, n);
+                shadow_copy(BLANK_MEM, dst + count, n);
                 break;
 
             case 'm':            /* ESC [nm enables rendition n */
@@ -13367,9 +14968,21 @@ tty_t *tp;
 
         s = sys_segctl(&vid_index, &vid_seg, &vid_off, vid_base, vid_size);
 
+        /* Start the shadow off with what is on the screen now, read through
+         * the video segment just set up.  TTY may not use sys_physcopy().
+         */
+        s = sys_vircopy(SELF, vid_index, (vir_bytes) 0,
+                SELF, D, (vir_bytes) shadow, (phys_bytes) vid_size);
+        hw_org = hw_cur = ~0;   /* 6845 registers are unknown */
+
         vid_size >>= 1;         /* word count */
         vid_mask = vid_size - 1;
 
+        /* If the screen could not be read, blank it rather than have the
+         * first update fill video memory with zeros.
+         */
+        if (s != OK) shadow_copy(BLANK_MEM, 0, vid_size);
+
         /* Size of the screen (number of displayed characters.) */
         scr_size = scr_lines * scr_width;
 
@@ -13388,7 +15001,7 @@ tty_t *tp;
   if (line != 0) {
         /* Clear the non-console vtys. */
         blank_color = BLANK_COLOR;
-        mem_vid_copy(BLANK_MEM, cons->c_start, scr_size);
+        shadow_copy(BLANK_MEM, cons->c_start, scr_size);
   } else {
         int i, n;
         /* Set the cursor of the console vty at the bottom. c_cur
@@ -13493,6 +15106,7 @@ int c;                          /* character to print */
         out_char(&cons_table[0], (int) c);
   } else {
         flush(&cons_table[0]);
+        cons_sync();
   }
 }
 	
@@ -13536,7 +15150,7 @@ PRIVATE void cons_org0()
                 n = vid_size - scr_size;        /* amount of unused memory */
                 if (n > cons->c_org - cons->c_start)
                         n = cons->c_org - cons->c_start;
-                vid_vid_copy(cons->c_org, cons->c_org - n, scr_size);
+                shadow_move(cons->c_org, cons->c_org - n, scr_size);
                 cons->c_org -= n;
         }
         flush(cons);
@@ -13554,8 +15168,7 @@ PUBLIC void select_console(int cons_line)
   if (cons_line < 0 || cons_line >= nr_cons) return;
   ccurrent = cons_line;
   curcons = &cons_table[cons_line];
-  set_6845(VID_ORG, curcons->c_org);
-  set_6845(CURSOR, curcons->c_cur);
+  cons_sync();                  /* show it, with the new origin and cursor */
 }
 	
 /*===========================================================================*
@@ -13680,6 +15293,15 @@ int try;
 #define PM_PID             0    /* PM's process id number */
 #define INIT_PID           1    /* INIT's process id number */
 
+#define LAST_FEW           2    /* last few slots reserved for superuser */
+
+#define NR_PID_HASH  NR_PROCS   /* buckets in the pid and group hash tables */
+#define PID_HASH(pid)   ((unsigned) (pid) % NR_PID_HASH)
+
+#define NR_TEXT_CACHE      8    /* text segments kept after their last user */
+
+#define KSIG_BATCH        16    /* kernel signals fetched per kernel call */
+
 
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                                       servers/pm/type.h
@@ -13708,6 +15330,7 @@ struct memory;
 _PROTOTYPE( phys_clicks alloc_mem, (phys_clicks clicks)                 );
 _PROTOTYPE( void free_mem, (phys_clicks base, phys_clicks clicks)       );
 _PROTOTYPE( void mem_init, (struct memory *chunks, phys_clicks *free)   );
+_PROTOTYPE( void get_mem_stats, (struct mem_stats *msp)                 );
 #define swap_in()                       ((void)0)
 #define swap_inqueue(rmp)               ((void)0)
 
@@ -13727,16 +15350,27 @@ _PROTOTYPE( int do_fkey_pressed, (void)
 
 /* exec.c */
 _PROTOTYPE( int do_exec, (void)                                         );
-_PROTOTYPE( void rw_seg, (int rw, int fd, int proc, int seg,
+_PROTOTYPE( int do_spawn, (void)                                        );
+_PROTOTYPE( int rw_seg, (int rw, int fd, int proc, int seg,
                                                 phys_bytes seg_bytes)   );
 _PROTOTYPE( struct mproc *find_share, (struct mproc *mp_ign, Ino_t ino,
                         Dev_t dev, time_t ctime)                        );
+_PROTOTYPE( void text_release, (struct mproc *rmp)                      );
+_PROTOTYPE( void load_done, (int status)                                );
+_PROTOTYPE( int load_cancel, (struct mproc *rmp)                        );
+_PROTOTYPE( int text_reclaim, (void)                                    );
 
 /* forkexit.c */
 _PROTOTYPE( int do_fork, (void)                                         );
 _PROTOTYPE( int do_pm_exit, (void)                                      );
 _PROTOTYPE( int do_waitpid, (void)                                      );
 _PROTOTYPE( void pm_exit, (struct mproc *rmp, int exit_status)          );
+_PROTOTYPE( pid_t alloc_pid, (void)                                     );
+_PROTOTYPE( struct mproc *find_pid, (pid_t pid)                         );
+_PROTOTYPE( void pid_link, (struct mproc *rmp)                          );
+_PROTOTYPE( void pid_unlink, (struct mproc *rmp)                        );
+_PROTOTYPE( struct mproc *grp_chain, (pid_t pgrp)                       );
+_PROTOTYPE( void child_link, (struct mproc *rmp)                        );
 
 /* getset.c */
 _PROTOTYPE( int do_getset, (void)                                       );
@@ -13810,8 +15444,10 @@ _PROTOTYPE( int proc_from_pid, (pid_t p));
 /* Global variables. */
 EXTERN struct mproc *mp;        /* ptr to 'mproc' slot of current process */
 EXTERN int procs_in_use;        /* how many processes are marked as IN_USE */
+EXTERN int nr_procs;            /* # of 'mproc' slots in use, from kernel */
 EXTERN char monitor_params[128*sizeof(char *)]; /* boot monitor parameters */
 EXTERN struct kinfo kinfo;                      /* kernel information */
+EXTERN struct text_stats text_stats;            /* text cache statistics */
 
 /* The parameters of the call are kept here. */
 EXTERN message m_in;            /* the incoming message itself is kept here. */
@@ -13847,6 +15483,10 @@ EXTERN struct mproc {
   pid_t mp_procgrp;             /* pid of process group (used for signals) */
   pid_t mp_wpid;                /* pid this process is waiting for */
   int mp_parent;                /* index of parent process */
+  struct mproc *mp_pidnext;     /* next in pid hash chain */
+  struct mproc *mp_grpnext;     /* next in process group hash chain */
+  struct mproc *mp_children;    /* first child of this process */
+  struct mproc *mp_sibling;     /* next child of the same parent */
 
   /* Child user and system times. Accounting done on child exit. */
   clock_t mp_child_utime;       /* cumulative user time of children */
@@ -13903,6 +15543,7 @@ EXTERN struct mproc {
 #define SWAPIN          0x800   /* set if on the "swap this in" queue */
 #define DONT_SWAP      0x1000   /* never swap out this process */
 #define PRIV_PROC      0x2000   /* system process, special privileges */
+#define LOADING        0x4000   /* set while FS loads the EXEC image */
 
 #define NIL_MPROC ((struct mproc *) 0)
 
@@ -13924,6 +15565,8 @@ EXTERN struct mproc {
 #define sig             m6_i1
 #define stack_bytes     m1_i2
 #define stack_ptr       m1_p2
+#define spawn_acts      m1_p3
+#define spawn_nacts     m1_i3
 #define status          m1_i1
 #define usr_id          m1_i1
 #define request         m2_i2
@@ -13967,6 +15610,16 @@ EXTERN struct mproc {
 #define tell_fs_arg2    m1_i2
 #define tell_fs_arg3    m1_i3
 
+/* The following names are used to have FS load an EXEC image. */
+#define load_uid        m5_c1
+#define load_gid        m5_c2
+#define load_fd         m5_i1
+#define load_proc       m5_i2
+#define load_text       m5_l1
+#define load_data       m5_l2
+#define load_flags      m5_l3
+#define load_status     m5_i1   /* in FS' reply: OK or why the load failed */
+
 
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                                       servers/pm/table.c
@@ -14055,7 +15708,7 @@ _PROTOTYPE (int (*call_vec[NCALLS]), (void) ) = {
 
         no_sys,         /* 64 = unused */
         no_sys,         /* 65 = UNPAUSE */
-        no_sys,         /* 66 = unused  */
+        no_sys,         /* 66 = EXEC_LOAD */
         no_sys,         /* 67 = REVIVE  */
         no_sys,         /* 68 = TASK_REPLY  */
         no_sys,         /* 69 = unused  */
@@ -14081,6 +15734,7 @@ _PROTOTYPE (int (*call_vec[NCALLS]), (void) ) = {
         do_getsetpriority,      /* 88 = getpriority */
         do_getsetpriority,      /* 89 = setpriority */
         do_time,        /* 90 = gettimeofday */
+        do_spawn,       /* 91 = spawn */
 };
 /* This should not fail with "array size is negative":  */
 extern int dummy[sizeof(call_vec) == NCALLS * sizeof(call_vec[0]) ? 1 :  -1];
@@ -14151,6 +15805,9 @@ PUBLIC int main()
                 sigset = m_in.NOTIFY_ARG;
                 if (sigismember(&sigset, SIGKSIG))  (void) ksig_pending();
                 result = SUSPEND;               /* don't reply */
+        } else if (call_nr == EXEC_LOAD && who == FS_PROC_NR) {
+                load_done(m_in.load_status);    /* an EXEC image is in */
+                result = SUSPEND;               /* don't reply */
         }
         /* Else, if the system call number is valid, perform the call. */
         else if ((unsigned) call_nr >= NCALLS) {
@@ -14167,7 +15824,7 @@ PUBLIC int main()
         /* Send out all pending reply messages, including the answer to
          * the call just made above.  The processes must not be swapped out.
          */
-        for (proc_nr=0, rmp=mproc; proc_nr < NR_PROCS; proc_nr++, rmp++) {
+        for (proc_nr=0, rmp=mproc; proc_nr < nr_procs; proc_nr++, rmp++) {
                 /* In the meantime, the process may have been killed by a
                  * signal (e.g. if a lethal pending signal was unblocked)
                  * without the PM realizing it. If the slot is no longer in
@@ -14276,6 +15933,7 @@ PRIVATE void pm_init()
   get_mem_chunks(mem_chunks);
   if ((s=sys_getkinfo(&kinfo)) != OK)
       panic(__FILE__,"get kernel info failed",s);
+  nr_procs = kinfo.nr_procs;            /* as many slots as the kernel uses */
 
   /* Get the memory map of the kernel to see how much memory it uses. */
   if ((s=get_mem_map(SYSTASK, mem_map)) != OK)
@@ -14305,7 +15963,7 @@ PRIVATE void pm_init()
                         sigemptyset(&rmp->mp_ignore);   
                 }
                 else {                                  /* system process */
-                        rmp->mp_pid = get_free_pid();
+                        rmp->mp_pid = alloc_pid();
                         rmp->mp_flags |= IN_USE | DONT_SWAP | PRIV_PROC; 
                         sigfillset(&rmp->mp_ignore);    
                 }
@@ -14335,6 +15993,15 @@ PRIVATE void pm_init()
   mproc[PM_PROC_NR].mp_pid = PM_PID;            /* magically override pid */
   mproc[PM_PROC_NR].mp_parent = PM_PROC_NR;     /* PM doesn't have parent */
 
+  /* Now that all pids are final, enter the boot processes in the index and
+   * in the child lists of their parents.
+   */
+  for (rmp = &mproc[0]; rmp < &mproc[nr_procs]; rmp++) {
+        if (!(rmp->mp_flags & IN_USE)) continue;
+        pid_link(rmp);
+        if (rmp != &mproc[PM_PROC_NR]) child_link(rmp);
+  }
+
   /* Tell FS that no more system processes follow and synchronize. */
   mess.PR_PROC_NR = NONE;
   if (sendrec(FS_PROC_NR, &mess) != OK || mess.m_type != OK)
@@ -14458,6 +16125,18 @@ struct mem_map *map_ptr;                        /* memory to remove */
  *   do_pm_exit:  perform the EXIT system call (by calling pm_exit())
  *   pm_exit:     actually do the exiting
  *   do_wait:     perform the WAITPID or WAIT system call
+ *   alloc_pid:   find a free pid for a new process
+ *   find_pid:    find the process with a given pid
+ *   pid_link:    enter a process in the pid and process group index
+ *   pid_unlink:  remove a process from the index
+ *   grp_chain:   find the hash chain that holds a process group
+ *   child_link:  enter a new process in its parent's list of children
+ *
+ * Processes are found by pid through a hash table, and the pids used as
+ * process group ids through another, so that neither FORK nor KILL has to
+ * search the whole process table.  A process is in the index from FORK until
+ * its slot is released by WAIT.  Likewise each process has a list of its
+ * children, which WAIT and EXIT use instead of searching the table.
  */
 
 #include "pm.h"
@@ -14468,9 +16147,12 @@ struct mem_map *map_ptr;                        /* memory to remove */
 #include "mproc.h"
 #include "param.h"
 
-#define LAST_FEW            2   /* last few slots reserved for superuser */
-
 FORWARD _PROTOTYPE (void cleanup, (register struct mproc *child) );
+FORWARD _PROTOTYPE (int grp_in_use, (pid_t pgrp) );
+FORWARD _PROTOTYPE (void child_unlink, (struct mproc *rmp) );
+
+PRIVATE struct mproc *pid_hash[NR_PID_HASH];    /* processes by pid */
+PRIVATE struct mproc *grp_hash[NR_PID_HASH];    /* processes by group */
 
 /*===========================================================================*
  *                              do_fork                                      *
@@ -14489,8 +16171,8 @@ PUBLIC int do_fork()
   * way through is such a nuisance.
   */
   rmp = mp;
-  if ((procs_in_use == NR_PROCS) || 
-                (procs_in_use >= NR_PROCS-LAST_FEW && rmp->mp_effuid != 0))
+  if ((procs_in_use == nr_procs) || 
+                (procs_in_use >= nr_procs-LAST_FEW && rmp->mp_effuid != 0))
   {
         printf("PM:  warning, process table is full!\n");
         return(EAGAIN);
@@ -14511,13 +16193,14 @@ PUBLIC int do_fork()
   if (s < 0) panic(__FILE__,"do_fork can't copy", s);
 
   /* Find a slot in 'mproc' for the child process.  A slot must exist. */
-  for (rmc = &mproc[0]; rmc < &mproc[NR_PROCS]; rmc++)
+  for (rmc = &mproc[0]; rmc < &mproc[nr_procs]; rmc++)
         if ( (rmc->mp_flags & IN_USE) == 0) break;
 
   /* Set up the child and its memory map; copy its 'mproc' slot from parent. */
   child_nr = (int)(rmc - mproc);        /* slot number of the child */
   procs_in_use++;
   *rmc = *rmp;                  /* copy parent's process slot to child's */
+  tmr_inittimer(&rmc->mp_timer);        /* alarms are not inherited */
   rmc->mp_parent = who;                 /* record child's parent */
   /* inherit only these flags */
   rmc->mp_flags &= (IN_USE|SEPARATE|PRIV_PROC|DONT_SWAP);
@@ -14535,8 +16218,10 @@ PUBLIC int do_fork()
   rmc->mp_sigstatus = 0;
 
   /* Find a free pid for the child and put it in the table. */
-  new_pid = get_free_pid();
+  new_pid = alloc_pid();
   rmc->mp_pid = new_pid;        /* assign pid to child */
+  pid_link(rmc);
+  child_link(rmc);
 
   /* Tell kernel and file system about the (now successful) FORK. */
   sys_fork(who, child_nr);
@@ -14577,7 +16262,7 @@ int exit_status;                /* the process' exit status (for parent) */
   register int proc_nr;
   int parent_waiting, right_child;
   pid_t pidarg, procgrp;
-  struct mproc *p_mp;
+  struct mproc *p_mp, *init_mp, *rmc;
   clock_t t[5];
 
   proc_nr = (int) (rmp - mproc);        /* get process slot number */
@@ -14601,11 +16286,10 @@ int exit_status;                /* the process' exit status (for parent) */
   /* Pending reply messages for the dead process cannot be delivered. */
   rmp->mp_flags &= ~REPLY;
   
-  /* Release the memory occupied by the child. */
-  if (find_share(rmp, rmp->mp_ino, rmp->mp_dev, rmp->mp_ctime) == NULL) {
-        /* No other process shares the text segment, so free it. */
-        free_mem(rmp->mp_seg[T].mem_phys, rmp->mp_seg[T].mem_len);
-  }
+  /* Release the memory occupied by the child.  The text segment may be kept
+   * in the text cache.
+   */
+  text_release(rmp);
   /* Free the data and stack segments. */
   free_mem(rmp->mp_seg[D].mem_phys,
       rmp->mp_seg[S].mem_vir 
@@ -14627,13 +16311,15 @@ int exit_status;                /* the process' exit status (for parent) */
   }
 
   /* If the process has children, disinherit them.  INIT is the new parent. */
-  for (rmp = &mproc[0]; rmp < &mproc[NR_PROCS]; rmp++) {
-        if (rmp->mp_flags & IN_USE && rmp->mp_parent == proc_nr) {
-                /* 'rmp' now points to a child to be disinherited. */
-                rmp->mp_parent = INIT_PROC_NR;
-                parent_waiting = mproc[INIT_PROC_NR].mp_flags & WAITING;
-                if (parent_waiting && (rmp->mp_flags & ZOMBIE)) cleanup(rmp);
-        }
+  init_mp = &mproc[INIT_PROC_NR];
+  while ((rmc = rmp->mp_children) != NIL_MPROC) {
+        /* 'rmc' now points to a child to be disinherited. */
+        rmp->mp_children = rmc->mp_sibling;
+        rmc->mp_parent = INIT_PROC_NR;
+        rmc->mp_sibling = init_mp->mp_children;
+        init_mp->mp_children = rmc;
+        parent_waiting = init_mp->mp_flags & WAITING;
+        if (parent_waiting && (rmc->mp_flags & ZOMBIE)) cleanup(rmc);
   }
 
   /* Send a hangup to the process' process group if it was a session leader. */
@@ -14668,24 +16354,22 @@ PUBLIC int do_waitpid()
    *    pidarg  < -1 means wait for any child whose process group = -pidarg
    */
   children = 0;
-  for (rp = &mproc[0]; rp < &mproc[NR_PROCS]; rp++) {
-        if ( (rp->mp_flags & IN_USE) && rp->mp_parent == who) {
-                /* The value of pidarg determines which children qualify. */
-                if (pidarg  > 0 && pidarg != rp->mp_pid) continue;
-                if (pidarg < -1 && -pidarg != rp->mp_procgrp) continue;
-
-                children++;             /* this child is acceptable */
-                if (rp->mp_flags & ZOMBIE) {
-                        /* This child meets the pid test and has exited. */
-                        cleanup(rp);    /* this child has already exited */
-                        return(SUSPEND);
-                }
-                if ((rp->mp_flags & STOPPED) && rp->mp_sigstatus) {
-                        /* This child meets the pid test and is being traced.*/
-                        mp->mp_reply.reply_res2 = 0177|(rp->mp_sigstatus << 8);
-                        rp->mp_sigstatus = 0;
-                        return(rp->mp_pid);
-                }
+  for (rp = mp->mp_children; rp != NIL_MPROC; rp = rp->mp_sibling) {
+        /* The value of pidarg determines which children qualify. */
+        if (pidarg  > 0 && pidarg != rp->mp_pid) continue;
+        if (pidarg < -1 && -pidarg != rp->mp_procgrp) continue;
+
+        children++;             /* this child is acceptable */
+        if (rp->mp_flags & ZOMBIE) {
+                /* This child meets the pid test and has exited. */
+                cleanup(rp);    /* this child has already exited */
+                return(SUSPEND);
+        }
+        if ((rp->mp_flags & STOPPED) && rp->mp_sigstatus) {
+                /* This child meets the pid test and is being traced.*/
+                mp->mp_reply.reply_res2 = 0177|(rp->mp_sigstatus << 8);
+                rp->mp_sigstatus = 0;
+                return(rp->mp_pid);
         }
   }
 
@@ -14721,6 +16405,8 @@ register struct mproc *child;   /* tells which process is exiting */
   parent->mp_flags &= ~WAITING;         /* parent no longer waiting */
 
   /* Release the process table entry and reinitialize some field. */
+  pid_unlink(child);
+  child_unlink(child);
   child->mp_pid = 0;
   child->mp_flags = 0;
   child->mp_child_utime = 0;
@@ -14728,11 +16414,142 @@ register struct mproc *child;   /* tells which process is exiting */
   procs_in_use--;
 }
 	
+/*===========================================================================*
+ *                              alloc_pid                                    *
+ *===========================================================================*/
+PUBLIC pid_t alloc_pid()
+{
+/* Find a free pid.  Pids are handed out in increasing order, wrapping around
+ * at NR_PIDS.  A pid is not reused while it is the pid of a process or the id
+ * of a process group, even if that process is a zombie.
+ */
+  static pid_t next_pid = INIT_PID + 1;         /* next pid to be assigned */
 
+  do {
+        next_pid = (next_pid < NR_PIDS ? next_pid + 1 : INIT_PID + 1);
+  } while (find_pid(next_pid) != NIL_MPROC || grp_in_use(next_pid));
+  return(next_pid);
+}
+	
+/*===========================================================================*
+ *                              find_pid                                     *
+ *===========================================================================*/
+PUBLIC struct mproc *find_pid(pid)
+pid_t pid;                      /* pid to look for */
+{
+/* Return the process with the given pid, or NIL_MPROC if there is none. */
+  register struct mproc *rmp;
 
+  rmp = pid_hash[PID_HASH(pid)];
+  while (rmp != NIL_MPROC && rmp->mp_pid != pid) rmp = rmp->mp_pidnext;
+  return(rmp);
+}
+	
+/*===========================================================================*
+ *                              grp_in_use                                   *
+ *===========================================================================*/
+PRIVATE int grp_in_use(pgrp)
+pid_t pgrp;                     /* process group id */
+{
+/* Return TRUE if some process is a member of process group 'pgrp'. */
+  register struct mproc *rmp;
 
-++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
-                                      servers/pm/exec.c
+  for (rmp = grp_hash[PID_HASH(pgrp)]; rmp != NIL_MPROC; rmp = rmp->mp_grpnext)
+        if (rmp->mp_procgrp == pgrp) return(TRUE);
+  return(FALSE);
+}
+	
+/*===========================================================================*
+ *                              grp_chain                                    *
+ *===========================================================================*/
+PUBLIC struct mproc *grp_chain(pgrp)
+pid_t pgrp;                     /* process group id, not 0 */
+{
+/* Return the first process on the hash chain of process group 'pgrp'.  All
+ * members of the group are on the chain, which is followed by mp_grpnext,
+ * but so may be members of other groups.
+ */
+  return(grp_hash[PID_HASH(pgrp)]);
+}
+	
+/*===========================================================================*
+ *                              pid_link                                     *
+ *===========================================================================*/
+PUBLIC void pid_link(rmp)
+register struct mproc *rmp;     /* process to enter in the index */
+{
+/* Enter a process under its pid, and under its process group if it has one.
+ * PM itself is never in a process group, although handle_sig() borrows its
+ * mp_procgrp field.
+ */
+  struct mproc **hp;
+
+  hp = &pid_hash[PID_HASH(rmp->mp_pid)];
+  rmp->mp_pidnext = *hp;
+  *hp = rmp;
+  if (rmp->mp_procgrp != 0 && rmp != &mproc[PM_PROC_NR]) {
+        hp = &grp_hash[PID_HASH(rmp->mp_procgrp)];
+        rmp->mp_grpnext = *hp;
+        *hp = rmp;
+  }
+}
+	
+/*===========================================================================*
+ *                              pid_unlink                                   *
+ *===========================================================================*/
+PUBLIC void pid_unlink(rmp)
+register struct mproc *rmp;     /* process to remove from the index */
+{
+/* Remove a process from the index.  Its pid and process group must be the
+ * ones it was entered with.
+ */
+  struct mproc **hp;
+
+  hp = &pid_hash[PID_HASH(rmp->mp_pid)];
+  while (*hp != rmp) hp = &(*hp)->mp_pidnext;
+  *hp = rmp->mp_pidnext;
+  if (rmp->mp_procgrp != 0 && rmp != &mproc[PM_PROC_NR]) {
+        hp = &grp_hash[PID_HASH(rmp->mp_procgrp)];
+        while (*hp != rmp) hp = &(*hp)->mp_grpnext;
+        *hp = rmp->mp_grpnext;
+  }
+}
+	
+/*===========================================================================*
+ *                              child_link                                   *
+ *===========================================================================*/
+PUBLIC void child_link(rmp)
+register struct mproc *rmp;     /* new process, with mp_parent set */
+{
+/* Enter a new process in its parent's list of children.  It has no children
+ * of its own yet, whatever was copied from the parent's slot.
+ */
+  struct mproc *p_mp = &mproc[rmp->mp_parent];
+
+  rmp->mp_children = NIL_MPROC;
+  rmp->mp_sibling = p_mp->mp_children;
+  p_mp->mp_children = rmp;
+}
+	
+/*===========================================================================*
+ *                              child_unlink                                 *
+ *===========================================================================*/
+PRIVATE void child_unlink(rmp)
+register struct mproc *rmp;     /* process whose slot is being released */
+{
+/* Remove a process from its parent's list of children. */
+  struct mproc **cp;
+
+  cp = &mproc[rmp->mp_parent].mp_children;
+  while (*cp != rmp) cp = &(*cp)->mp_sibling;
+  *cp = rmp->mp_sibling;
+}
+	
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      servers/pm/exec.c
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
 /* This file handles the EXEC system call.  It performs the work as follows: 
@@ -14747,10 +16564,29 @@ register struct mproc *child;   /* tells which process is exiting */
  *    - tell kernel about EXEC
  *    - save offset to initial argc (for ps)
  *
+ * SPAWN does the same for a new child of the caller, without first copying
+ * the caller's core image as FORK would.
+ *
+ * Separate I & D text segments are shared with running processes, and are
+ * kept in a small LRU cache after their last user is gone, so that programs
+ * that are executed over and over need not have their text read in again.
+ *
+ * The text and data segments are read in by FS on PM's behalf, without PM
+ * waiting for them.  Requests and replies go both ways with senda(), so that
+ * neither server ever blocks on the other.  FS also makes the set-uid and
+ * set-gid changes and closes the FD_CLOEXEC files, and closes the exec file
+ * when it is done.  Only when FS reports that the image is in is the new
+ * program started.  Meanwhile PM is free to serve other requests.
+ *
  * The entry points into this file are: 
  *   do_exec:     perform the EXEC system call
+ *   do_spawn:    perform the SPAWN system call
  *   rw_seg:      read or write a segment from or to a file
  *   find_share:  find a process whose text segment can be shared
+ *   text_release: a process no longer uses its text segment
+ *   text_reclaim: free a cached text segment when memory is short
+ *   load_done:   FS has loaded an image; start the new program
+ *   load_cancel: a process is killed before FS has started on its image
  */
 
 #include "pm.h"
@@ -14763,9 +16599,65 @@ register struct mproc *child;   /* tells which process is exiting */
 #include "mproc.h"
 #include "param.h"
 
-FORWARD _PROTOTYPE( int new_mem, (struct mproc *sh_mp, vir_bytes text_bytes,
-                vir_bytes data_bytes, vir_bytes bss_bytes,
-                vir_bytes stk_bytes, phys_bytes tot_bytes)              );
+/* What EXEC and SPAWN know about the program being loaded. */
+struct image {
+  int fd;                       /* exec file, open in PM */
+  int ft;                       /* SEPARATE for separate I & D, else 0 */
+  char *name;                   /* name of the file, or of its interpreter */
+  vir_bytes text_bytes;         /* text segment size in bytes */
+  vir_bytes data_bytes;         /* size of initialized data in bytes */
+  vir_bytes bss_bytes;          /* size of bss in bytes */
+  vir_bytes stk_bytes;          /* size of initial stack in bytes */
+  phys_bytes tot_bytes;         /* total space for program, including gap */
+  vir_bytes pc;                 /* program entry point */
+  struct stat s_buf[2];         /* file status, [1] if it is a script */
+  struct stat *s_p;             /* status of the file actually loaded */
+  clock_t start;                /* uptime when the EXEC started */
+};
+
+/* Text segments whose last user has gone, by file <ino, dev, ctime>. */
+PRIVATE struct text_cache {
+  ino_t tc_ino;                 /* parameters that uniquely identify a file */
+  dev_t tc_dev;
+  time_t tc_ctime;
+  struct mem_map tc_seg;        /* the text segment, mem_len 0 if unused */
+  unsigned long tc_stamp;       /* when it was cached, 0 if unused */
+} text_cache[NR_TEXT_CACHE];
+PRIVATE unsigned long text_clock;       /* stamp of the newest entry */
+
+/* EXEC images that FS is to load.  FS loads one at a time, the first in the
+ * ring, and replies when it is done.  A load whose process has been killed
+ * before FS got it stays in the ring with ld_mp NIL_MPROC, as FS must still
+ * close the exec file.
+ */
+#define NR_LOADS           8    /* max # of loads in progress or queued */
+PRIVATE struct load {
+  struct mproc *ld_mp;          /* process that gets the new image */
+  int ld_fd;                    /* exec file, open in PM */
+  int ld_flags;                 /* LD_SHARED, LD_SETUID, LD_SETGID */
+  vir_bytes ld_text;            /* text segment size in bytes */
+  vir_bytes ld_data;            /* size of initialized data in bytes */
+  vir_bytes ld_pc;              /* program entry point */
+  clock_t ld_start;             /* uptime when the EXEC started */
+} loads[NR_LOADS];
+PRIVATE int load_first;         /* index of the load FS is working on */
+PRIVATE int nr_loads;           /* number of loads in the ring */
+PRIVATE asynmsg_t load_req;     /* EXEC_LOAD for FS, passed to senda() */
+
+FORWARD _PROTOTYPE( int open_image, (struct image *ip)                  );
+FORWARD _PROTOTYPE( void load_image, (struct mproc *rmp, struct image *ip,
+                struct mem_map *sh_text)                                );
+FORWARD _PROTOTYPE( void start_load, (struct load *ld)                  );
+FORWARD _PROTOTYPE( void exec_done, (struct mproc *rmp, vir_bytes pc,
+                clock_t start)                                          );
+FORWARD _PROTOTYPE( struct mem_map *find_text, (struct mproc *rmp,
+                struct image *ip, struct mem_map *cached)               );
+FORWARD _PROTOTYPE( void text_put, (Ino_t ino, Dev_t dev, time_t ctime,
+                struct mem_map *seg)                                    );
+FORWARD _PROTOTYPE( int new_mem, (struct mproc *rmp, struct mem_map *sh_text,
+                vir_bytes text_bytes, vir_bytes data_bytes,
+                vir_bytes bss_bytes, vir_bytes stk_bytes,
+                phys_bytes tot_bytes)                                   );
 FORWARD _PROTOTYPE( void patch_ptr, (char stack[ARG_MAX], vir_bytes base) );
 FORWARD _PROTOTYPE( int insert_arg, (char stack[ARG_MAX],
                 vir_bytes *stk_bytes, char *arg, int replace)           );
@@ -14779,6 +16671,9 @@ FORWARD _PROTOTYPE( int read_header, (int fd, int *ft, vir_bytes *text_bytes,
 #define ESCRIPT (-2000) /* Returned by read_header for a #! script. */
 #define PTRSIZE sizeof(char *) /* Size of pointers in argv[] and envp[]. */
 
+PRIVATE char mbuf[ARG_MAX];     /* buffer for stack and zeroes */
+PRIVATE char name_buf[PATH_MAX]; /* the name of the file to exec */
+
 /*===========================================================================*
  *                              do_exec                                      *
  *===========================================================================*/
@@ -14789,22 +16684,157 @@ PUBLIC int do_exec()
  * is copied to a buffer inside PM, and then to the new core image.
  */
   register struct mproc *rmp;
-  struct mproc *sh_mp;
-  int m, r, fd, ft, sn;
-  static char mbuf[ARG_MAX];    /* buffer for stack and zeroes */
-  static char name_buf[PATH_MAX]; /* the name of the file to exec */
-  char *new_sp, *name, *basename;
-  vir_bytes src, dst, text_bytes, data_bytes, bss_bytes, stk_bytes, vsp;
-  phys_bytes tot_bytes;         /* total space for program, including gap */
+  struct mem_map *sh_text, cached;
+  struct image img;
+  int r;
+
+  rmp = mp;
+  if ((r = open_image(&img)) != OK) return(r);
+
+  /* Can the process' text be shared, or is it in the text cache? */
+  sh_text = find_text(rmp, &img, &cached);
+
+  /* Allocate new memory and release old memory.  Fix map and tell kernel. */
+  r = new_mem(rmp, sh_text, img.text_bytes, img.data_bytes, img.bss_bytes,
+                                        img.stk_bytes, img.tot_bytes);
+  if (r != OK) {
+        if (sh_text == &cached) text_put(img.s_p->st_ino, img.s_p->st_dev,
+                                        img.s_p->st_ctime, &cached);
+        close(img.fd);          /* insufficient core or program too big */
+        return(r);
+  }
+  sys_newmap(who, rmp->mp_seg);   /* report new map to the kernel */
+
+  /* Save file identification to allow it to be shared. */
+  rmp->mp_ino = img.s_p->st_ino;
+  rmp->mp_dev = img.s_p->st_dev;
+  rmp->mp_ctime = img.s_p->st_ctime;
+
+  load_image(rmp, &img, sh_text);
+  return(SUSPEND);              /* no reply, new program just runs */
+}
+	
+/*===========================================================================*
+ *                              do_spawn                                     *
+ *===========================================================================*/
+PUBLIC int do_spawn()
+{
+/* Perform the spawn(name, argv, envp, acts, nacts) call.  The result is that
+ * of a FORK followed by an EXEC in the child, but the caller's core image is
+ * never copied:  the child's slot is made from the parent's, memory is only
+ * allocated for the new program, and the image is loaded into it directly.
+ * The file actions are done by FS after it has been told about the FORK.
+ */
+  register struct mproc *rmp;   /* pointer to parent */
+  register struct mproc *rmc;   /* pointer to child */
+  struct mem_map *sh_text, cached;
+  struct image img;
+  static struct spawn_fdact acts[SPAWN_FDACTS_MAX];
+  int child_nr, nacts, i, r;
+  pid_t new_pid;
+  message m;
+
+  /* As with FORK, don't start if the tables might fill up. */
+  rmp = mp;
+  if ((procs_in_use == nr_procs) || 
+                (procs_in_use >= nr_procs-LAST_FEW && rmp->mp_effuid != 0))
+  {
+        printf("PM:  warning, process table is full!\n");
+        return(EAGAIN);
+  }
+
+  /* Fetch the file actions, then the program, before anything is changed. */
+  nacts = m_in.spawn_nacts;
+  if (nacts < 0 || nacts > SPAWN_FDACTS_MAX) return(EINVAL);
+  if (nacts > 0) {
+        r = sys_datacopy(who, (vir_bytes) m_in.spawn_acts, PM_PROC_NR,
+                (vir_bytes) acts, (phys_bytes) nacts * sizeof(acts[0]));
+        if (r != OK) return(r);
+  }
+  if ((r = open_image(&img)) != OK) return(r);
+
+  /* Find a slot in 'mproc' for the child process.  A slot must exist.  It is
+   * copied from the parent's, but stays out of use until the child's memory
+   * has been allocated, so new_mem() has no old image to release.
+   */
+  for (rmc = &mproc[0]; rmc < &mproc[nr_procs]; rmc++)
+        if ( (rmc->mp_flags & IN_USE) == 0) break;
+  child_nr = (int)(rmc - mproc);        /* slot number of the child */
+  *rmc = *rmp;                  /* copy parent's process slot to child's */
+  tmr_inittimer(&rmc->mp_timer);        /* alarms are not inherited */
+  rmc->mp_flags = 0;
+
+  sh_text = find_text(rmc, &img, &cached);
+  r = new_mem(rmc, sh_text, img.text_bytes, img.data_bytes, img.bss_bytes,
+                                        img.stk_bytes, img.tot_bytes);
+  if (r != OK) {
+        if (sh_text == &cached) text_put(img.s_p->st_ino, img.s_p->st_dev,
+                                        img.s_p->st_ctime, &cached);
+        close(img.fd);          /* insufficient core or program too big */
+        return(r);
+  }
+
+  /* From here on the SPAWN cannot fail.  Set up the rest of the child. */
+  procs_in_use++;
+  rmc->mp_flags = IN_USE | (rmp->mp_flags & (PRIV_PROC|DONT_SWAP));
+  rmc->mp_parent = who;                 /* record child's parent */
+  rmc->mp_child_utime = 0;              /* reset administration */
+  rmc->mp_child_stime = 0;              /* reset administration */
+  rmc->mp_exitstatus = 0;
+  rmc->mp_sigstatus = 0;
+  rmc->mp_ino = img.s_p->st_ino;
+  rmc->mp_dev = img.s_p->st_dev;
+  rmc->mp_ctime = img.s_p->st_ctime;
+  new_pid = alloc_pid();
+  rmc->mp_pid = new_pid;        /* assign pid to child */
+  pid_link(rmc);
+  child_link(rmc);
+
+  /* Tell kernel and file system about the child and report its map. */
+  sys_fork(who, child_nr);
+  tell_fs(FORK, who, child_nr, new_pid);
+  sys_newmap(child_nr, rmc->mp_seg);
+
+  /* Let FS do the file actions on the child's descriptors.  If one fails the
+   * child exits with status 127 before it ever runs, as after a failed EXEC.
+   */
+  for (i = 0; i < nacts; i++) {
+        m.tell_fs_arg1 = child_nr;
+        m.tell_fs_arg2 = acts[i].sfa_fd;
+        m.tell_fs_arg3 = acts[i].sfa_oldfd;
+        if (_taskcall(FS_PROC_NR, SPAWN, &m) != OK) break;
+  }
+  if (i < nacts) {
+        close(img.fd);
+        pm_exit(rmc, 127);
+  } else {
+        load_image(rmc, &img, sh_text);
+  }
+
+  rmp->mp_reply.procnr = child_nr;      /* child's process number */
+  return(new_pid);                      /* child's pid */
+}
+	
+/*===========================================================================*
+ *                              open_image                                   *
+ *===========================================================================*/
+PRIVATE int open_image(ip)
+struct image *ip;               /* place to return what is found */
+{
+/* Fetch the file name and stack of an EXEC or SPAWN from the caller, check
+ * that the file may be executed, and read its header.  On success the file
+ * is left open in PM at ip->fd and the stack is in mbuf.
+ */
+  int m, r;
   long sym_bytes;
   vir_clicks sc;
-  struct stat s_buf[2], *s_p;
-  vir_bytes pc;
+  vir_bytes src, dst;
+
+  getuptime(&ip->start);
 
   /* Do some validity checks. */
-  rmp = mp;
-  stk_bytes = (vir_bytes) m_in.stack_bytes;
-  if (stk_bytes > ARG_MAX) return(ENOMEM);      /* stack too big */
+  ip->stk_bytes = (vir_bytes) m_in.stack_bytes;
+  if (ip->stk_bytes > ARG_MAX) return(ENOMEM);  /* stack too big */
   if (m_in.exec_len <= 0 || m_in.exec_len > PATH_MAX) return(EINVAL);
 
   /* Get the exec file name and see if the file is executable. */
@@ -14818,82 +16848,81 @@ PUBLIC int do_exec()
   src = (vir_bytes) m_in.stack_ptr;
   dst = (vir_bytes) mbuf;
   r = sys_datacopy(who, (vir_bytes) src,
-                        PM_PROC_NR, (vir_bytes) dst, (phys_bytes)stk_bytes);
+                PM_PROC_NR, (vir_bytes) dst, (phys_bytes)ip->stk_bytes);
   /* can't fetch stack (e.g. bad virtual addr) */
   if (r != OK) return(EACCES);  
 
   r = 0;        /* r = 0 (first attempt), or 1 (interpreted script) */
-  name = name_buf;      /* name of file to exec. */
+  ip->name = name_buf;  /* name of file to exec. */
   do {
-        s_p = &s_buf[r];
+        ip->s_p = &ip->s_buf[r];
         tell_fs(CHDIR, who, FALSE, 0);  /* switch to the user's FS environ */
-        fd = allowed(name, s_p, X_BIT); /* is file executable? */
-        if (fd < 0)  return(fd);                /* file was not executable */
+        ip->fd = allowed(ip->name, ip->s_p, X_BIT); /* is file executable? */
+        if (ip->fd < 0)  return(ip->fd);        /* file was not executable */
 
         /* Read the file header and extract the segment sizes. */
-        sc = (stk_bytes + CLICK_SIZE - 1) >> CLICK_SHIFT;
+        sc = (ip->stk_bytes + CLICK_SIZE - 1) >> CLICK_SHIFT;
 
-        m = read_header(fd, &ft, &text_bytes, &data_bytes, &bss_bytes, 
-                                        &tot_bytes, &sym_bytes, sc, &pc);
+        m = read_header(ip->fd, &ip->ft, &ip->text_bytes, &ip->data_bytes,
+                &ip->bss_bytes, &ip->tot_bytes, &sym_bytes, sc, &ip->pc);
         if (m != ESCRIPT || ++r > 1) break;
-  } while ((name = patch_stack(fd, mbuf, &stk_bytes, name_buf)) != NULL);
+  } while ((ip->name = patch_stack(ip->fd, mbuf, &ip->stk_bytes, name_buf))
+                                                                != NULL);
 
   if (m < 0) {
-        close(fd);              /* something wrong with header */
-        return(stk_bytes > ARG_MAX ? ENOMEM :  ENOEXEC);
-  }
-
-  /* Can the process' text be shared with that of one already running? */
-  sh_mp = find_share(rmp, s_p->st_ino, s_p->st_dev, s_p->st_ctime);
-
-  /* Allocate new memory and release old memory.  Fix map and tell kernel. */
-  r = new_mem(sh_mp, text_bytes, data_bytes, bss_bytes, stk_bytes, tot_bytes);
-  if (r != OK) {
-        close(fd);              /* insufficient core or program too big */
-        return(r);
+        close(ip->fd);          /* something wrong with header */
+        return(ip->stk_bytes > ARG_MAX ? ENOMEM :  ENOEXEC);
   }
+  return(OK);
+}
+	
+/*===========================================================================*
+ *                              load_image                                   *
+ *===========================================================================*/
+PRIVATE void load_image(rmp, ip, sh_text)
+register struct mproc *rmp;     /* process that gets the new image */
+struct image *ip;               /* the program, as found by open_image() */
+struct mem_map *sh_text;        /* shared or cached text segment, if any */
+{
+/* The memory for the new image has been allocated and reported.  Copy the
+ * stack into it and fix up the process table.  The text and data segments
+ * are queued for FS to load; the program is started by load_done() when they
+ * are in.  If too many loads are queued already, read them in right here.
+ */
+  int proc_nr, r, sn, setids;
+  char *basename;
+  vir_bytes src, vsp;
+  struct load *ld;
 
-  /* Save file identification to allow it to be shared. */
-  rmp->mp_ino = s_p->st_ino;
-  rmp->mp_dev = s_p->st_dev;
-  rmp->mp_ctime = s_p->st_ctime;
+  proc_nr = (int) (rmp - mproc);
 
   /* Patch up stack and copy it from PM to new core image. */
   vsp = (vir_bytes) rmp->mp_seg[S].mem_vir << CLICK_SHIFT;
   vsp += (vir_bytes) rmp->mp_seg[S].mem_len << CLICK_SHIFT;
-  vsp -= stk_bytes;
+  vsp -= ip->stk_bytes;
   patch_ptr(mbuf, vsp);
   src = (vir_bytes) mbuf;
   r = sys_datacopy(PM_PROC_NR, (vir_bytes) src,
-                        who, (vir_bytes) vsp, (phys_bytes)stk_bytes);
-  if (r != OK) panic(__FILE__,"do_exec stack copy err on", who);
+                        proc_nr, (vir_bytes) vsp, (phys_bytes)ip->stk_bytes);
+  if (r != OK) panic(__FILE__,"do_exec stack copy err on", proc_nr);
 
-  /* Read in text and data segments. */
-  if (sh_mp != NULL) {
-        lseek(fd, (off_t) text_bytes, SEEK_CUR);  /* shared:  skip text */
-  } else {
-        rw_seg(0, fd, who, T, text_bytes);
-  }
-  rw_seg(0, fd, who, D, data_bytes);
-
-  close(fd);                    /* don't need exec file any more */
-
-  /* Take care of setuid/setgid bits. */
+  /* Take care of setuid/setgid bits.  FS is told along with the load. */
+  setids = 0;
   if ((rmp->mp_flags & TRACED) == 0) { /* suppress if tracing */
-        if (s_buf[0].st_mode & I_SET_UID_BIT) {
-                rmp->mp_effuid = s_buf[0].st_uid;
-                tell_fs(SETUID,who, (int)rmp->mp_realuid, (int)rmp->mp_effuid);
+        if (ip->s_buf[0].st_mode & I_SET_UID_BIT) {
+                rmp->mp_effuid = ip->s_buf[0].st_uid;
+                setids |= LD_SETUID;
         }
-        if (s_buf[0].st_mode & I_SET_GID_BIT) {
-                rmp->mp_effgid = s_buf[0].st_gid;
-                tell_fs(SETGID,who, (int)rmp->mp_realgid, (int)rmp->mp_effgid);
+        if (ip->s_buf[0].st_mode & I_SET_GID_BIT) {
+                rmp->mp_effgid = ip->s_buf[0].st_gid;
+                setids |= LD_SETGID;
         }
   }
 
   /* Save offset to initial argc (for ps) */
   rmp->mp_procargs = vsp;
 
-  /* Fix 'mproc' fields, tell kernel that exec is done,  reset caught sigs. */
+  /* Fix 'mproc' fields and reset caught sigs. */
   for (sn = 1; sn <= _NSIG; sn++) {
         if (sigismember(&rmp->mp_catch, sn)) {
                 sigdelset(&rmp->mp_catch, sn);
@@ -14903,22 +16932,216 @@ PUBLIC int do_exec()
   }
 
   rmp->mp_flags &= ~SEPARATE;   /* turn off SEPARATE bit */
-  rmp->mp_flags |= ft;          /* turn it on for separate I & D files */
-  new_sp = (char *) vsp;
-
-  tell_fs(EXEC, who, 0, 0);     /* allow FS to handle FD_CLOEXEC files */
+  rmp->mp_flags |= ip->ft;      /* turn it on for separate I & D files */
 
   /* System will save command line for debugging, ps(1) output, etc. */
-  basename = strrchr(name, '/');
-  if (basename == NULL) basename = name; else basename++;
+  basename = strrchr(ip->name, '/');
+  if (basename == NULL) basename = ip->name; else basename++;
   strncpy(rmp->mp_name, basename, PROC_NAME_LEN-1);
   rmp->mp_name[PROC_NAME_LEN] = '\0';
-  sys_exec(who, new_sp, basename, pc);
+
+  if (nr_loads < NR_LOADS) {
+        /* Queue the segments for FS.  Signals are held until they are in. */
+        ld = &loads[(load_first + nr_loads) % NR_LOADS];
+        ld->ld_mp = rmp;
+        ld->ld_fd = ip->fd;
+        ld->ld_flags = setids | (sh_text != NULL ? LD_SHARED :  0);
+        ld->ld_text = ip->text_bytes;
+        ld->ld_data = ip->data_bytes;
+        ld->ld_pc = ip->pc;
+        ld->ld_start = ip->start;
+        rmp->mp_flags |= LOADING;
+        if (nr_loads++ == 0) start_load(ld);
+        return;
+  }
+
+  /* Tell FS now, and read in text and data segments while PM waits. */
+  if (setids & LD_SETUID) tell_fs(SETUID, proc_nr,
+                        (int)rmp->mp_realuid, (int)rmp->mp_effuid);
+  if (setids & LD_SETGID) tell_fs(SETGID, proc_nr,
+                        (int)rmp->mp_realgid, (int)rmp->mp_effgid);
+  tell_fs(EXEC, proc_nr, 0, 0); /* allow FS to handle FD_CLOEXEC files */
+  if (sh_text != NULL) {
+        r = lseek(ip->fd, (off_t) ip->text_bytes, SEEK_CUR) < 0 ? EIO :  OK;
+  } else {
+        r = rw_seg(0, ip->fd, proc_nr, T, ip->text_bytes);
+  }
+  if (r == OK) r = rw_seg(0, ip->fd, proc_nr, D, ip->data_bytes);
+  close(ip->fd);                /* don't need exec file any more */
+  if (r != OK) {
+        /* The old image is gone, so the process dies as if by SIGKILL.  Its
+         * text may not be in, so it must not go into the text cache.
+         */
+        rmp->mp_ino = 0;
+        rmp->mp_sigstatus = (char) SIGKILL;
+        pm_exit(rmp, 0);
+        return;
+  }
+  exec_done(rmp, ip->pc, ip->start);
+}
+	
+/*===========================================================================*
+ *                              start_load                                   *
+ *===========================================================================*/
+PRIVATE void start_load(ld)
+struct load *ld;                /* the load to hand to FS */
+{
+/* Ask FS to read in the text and data segments of a new image, and to close
+ * the exec file.  The request is left with senda(), so PM does not wait for
+ * FS to take it.  FS replies the same way when it is done.  The previous
+ * request has been taken, as FS has replied to it.
+ */
+  message *m_ptr = &load_req.msg;
+  int s;
+
+  m_ptr->m_type = EXEC_LOAD;
+  m_ptr->load_fd = ld->ld_fd;
+  if (ld->ld_mp == NIL_MPROC) {
+        m_ptr->load_proc = NONE;        /* process is gone; just close */
+  } else {
+        m_ptr->load_proc = (int) (ld->ld_mp - mproc);
+        m_ptr->load_uid = ld->ld_mp->mp_effuid;
+        m_ptr->load_gid = ld->ld_mp->mp_effgid;
+  }
+  m_ptr->load_flags = ld->ld_flags;
+  m_ptr->load_text = ld->ld_text;
+  m_ptr->load_data = ld->ld_data;
+  load_req.dst = FS_PROC_NR;
+  load_req.flags = AMF_VALID;
+  if ((s = senda(&load_req, 1)) != OK)
+        panic(__FILE__, "PM can't send EXEC_LOAD to FS", s);
+}
+	
+/*===========================================================================*
+ *                              load_done                                    *
+ *===========================================================================*/
+PUBLIC void load_done(status)
+int status;                     /* OK, or why FS could not load the image */
+{
+/* FS has loaded the first image in the ring, and closed the exec file.  Give
+ * FS the next load, if any, then start the new program and deliver the
+ * signals that came in meanwhile.  A process that was killed while FS was
+ * busy with it is not started at all.
+ */
+  struct load *ld;
+  struct mproc *rmp;
+
+  if (nr_loads == 0) return;            /* nothing was asked for */
+  ld = &loads[load_first];
+  load_first = (load_first + 1) % NR_LOADS;
+  nr_loads--;
+  if (nr_loads > 0) start_load(&loads[load_first]);
+
+  if ((rmp = ld->ld_mp) == NIL_MPROC) return;   /* killed before the load */
+  rmp->mp_flags &= ~LOADING;
+  if (status != OK) {
+        /* The old image is gone, so the process dies as if by SIGKILL. */
+        rmp->mp_ino = 0;                /* text may not be in; don't cache */
+        rmp->mp_sigstatus = (char) SIGKILL;
+        pm_exit(rmp, 0);
+  } else if (sigismember(&rmp->mp_sigpending, SIGKILL)) {
+        check_pending(rmp);             /* SIGKILL goes first */
+  } else {
+        exec_done(rmp, ld->ld_pc, ld->ld_start);
+        check_pending(rmp);
+  }
+}
+	
+/*===========================================================================*
+ *                              load_cancel                                  *
+ *===========================================================================*/
+PUBLIC int load_cancel(rmp)
+struct mproc *rmp;              /* process that is being killed */
+{
+/* A SIGKILL has come in for a process whose image is still to be loaded.  If
+ * FS has not been given the load yet, the process need not wait for it and
+ * can die right away; FS is only left to close the exec file.  Return FALSE
+ * if FS is busy with the load, as it still writes into the process' memory.
+ */
+  int i;
+  struct load *ld;
+
+  for (i = 1; i < nr_loads; i++) {
+        ld = &loads[(load_first + i) % NR_LOADS];
+        if (ld->ld_mp != rmp) continue;
+        ld->ld_mp = NIL_MPROC;
+        ld->ld_flags = 0;
+        ld->ld_text = ld->ld_data = 0;
+        rmp->mp_ino = 0;                /* text is not in; don't cache */
+        rmp->mp_flags &= ~LOADING;
+        return(TRUE);
+  }
+  return(FALSE);
+}
+	
+/*===========================================================================*
+ *                              exec_done                                    *
+ *===========================================================================*/
+PRIVATE void exec_done(rmp, pc, start)
+register struct mproc *rmp;     /* process that got the new image */
+vir_bytes pc;                   /* program entry point */
+clock_t start;                  /* uptime when the EXEC started */
+{
+/* The new image is complete and the exec file is closed.  Tell the kernel
+ * that the new program is ready to run.
+ */
+  int proc_nr;
+  clock_t now;
+
+  proc_nr = (int) (rmp - mproc);
+  sys_exec(proc_nr, (char *) rmp->mp_procargs, rmp->mp_name, pc);
 
   /* Cause a signal if this process is traced. */
   if (rmp->mp_flags & TRACED) check_sig(rmp->mp_pid, SIGTRAP);
 
-  return(SUSPEND);              /* no reply, new program just runs */
+  if (getuptime(&now) == OK) {
+        text_stats.ts_execs++;
+        text_stats.ts_exec_ticks += now - start;
+  }
+}
+	
+/*===========================================================================*
+ *                              find_text                                    *
+ *===========================================================================*/
+PRIVATE struct mem_map *find_text(rmp, ip, cached)
+struct mproc *rmp;              /* process that gets the new image */
+struct image *ip;               /* the program, as found by open_image() */
+struct mem_map *cached;         /* place to return a text segment from cache */
+{
+/* See if the text of the program need not be read in.  Return the text
+ * segment of a process that runs it, or 'cached' if it was taken from the
+ * text cache, or NULL.  A cached segment belongs to the caller now, who must
+ * give it back with text_put() if the EXEC fails.
+ */
+  struct mproc *sh_mp;
+  register struct text_cache *tc;
+
+  sh_mp = find_share(rmp, ip->s_p->st_ino, ip->s_p->st_dev,
+                                                ip->s_p->st_ctime);
+  if (sh_mp != NULL && !(sh_mp->mp_flags & LOADING))
+        return(&sh_mp->mp_seg[T]);      /* text is in; share it */
+  if (ip->ft != SEPARATE) return(NULL);   /* no text segment at all */
+
+  for (tc = &text_cache[0]; tc < &text_cache[NR_TEXT_CACHE]; tc++) {
+        if (tc->tc_seg.mem_len == 0) continue;
+        if (tc->tc_ino != ip->s_p->st_ino) continue;
+        if (tc->tc_dev != ip->s_p->st_dev) continue;
+        if (tc->tc_ctime != ip->s_p->st_ctime) {
+                /* The file has changed since; the cached text is useless. */
+                free_mem(tc->tc_seg.mem_phys, tc->tc_seg.mem_len);
+                tc->tc_seg.mem_len = 0;
+                tc->tc_stamp = 0;
+                text_stats.ts_stale++;
+                break;
+        }
+        *cached = tc->tc_seg;
+        tc->tc_seg.mem_len = 0;
+        tc->tc_stamp = 0;
+        text_stats.ts_hits++;
+        return(cached);
+  }
+  text_stats.ts_misses++;
+  return(NULL);
 }
 	
 /*===========================================================================*
@@ -15015,27 +17238,28 @@ vir_bytes *pc;                  /* program entry point (initial PC) */
 /*===========================================================================*
  *                              new_mem                                      *
  *===========================================================================*/
-PRIVATE int new_mem(sh_mp, text_bytes, data_bytes,
+PRIVATE int new_mem(rmp, sh_text, text_bytes, data_bytes,
         bss_bytes,stk_bytes,tot_bytes)
-struct mproc *sh_mp;            /* text can be shared with this process */
+register struct mproc *rmp;     /* process that gets the new image */
+struct mem_map *sh_text;        /* shared or cached text segment, if any */
 vir_bytes text_bytes;           /* text segment size in bytes */
 vir_bytes data_bytes;           /* size of initialized data in bytes */
 vir_bytes bss_bytes;            /* size of bss in bytes */
 vir_bytes stk_bytes;            /* size of initial stack segment in bytes */
 phys_bytes tot_bytes;           /* total memory to allocate, including gap */
 {
-/* Allocate new memory and release the old memory.  Change the map and report
- * the new map to the kernel.  Zero the new core image's bss, gap and stack.
+/* Allocate new memory and release the old memory.  Change the map; the caller
+ * reports it to the kernel.  Zero the new core image's bss, gap and stack.
+ * A SPAWN child is not yet IN_USE here and has no old memory to release.
  */
 
-  register struct mproc *rmp = mp;
   vir_clicks text_clicks, data_clicks, gap_clicks, stack_clicks, tot_clicks;
   phys_clicks new_base;
   phys_bytes bytes, base, bss_offset;
   int s;
 
   /* No need to allocate text if it can be shared. */
-  if (sh_mp != NULL) text_bytes = 0;
+  if (sh_text != NULL) text_bytes = 0;
 
   /* Allow the old data to be swapped out to make room.  (Which is really a
    * waste of time, because we are going to throw it away anyway.)
@@ -15058,23 +17282,20 @@ phys_bytes tot_bytes;           /* total memory to allocate, including gap */
   if (new_base == NO_MEM) return(ENOMEM);
 
   /* We've got memory for the new core image.  Release the old one. */
-  rmp = mp;
-
-  if (find_share(rmp, rmp->mp_ino, rmp->mp_dev, rmp->mp_ctime) == NULL) {
-        /* No other process shares the text segment, so free it. */
-        free_mem(rmp->mp_seg[T].mem_phys, rmp->mp_seg[T].mem_len);
+  if (rmp->mp_flags & IN_USE) {
+        text_release(rmp);      /* free or cache the text segment */
+        /* Free the data and stack segments. */
+        free_mem(rmp->mp_seg[D].mem_phys, rmp->mp_seg[S].mem_vir
+                + rmp->mp_seg[S].mem_len - rmp->mp_seg[D].mem_vir);
   }
-  /* Free the data and stack segments. */
-  free_mem(rmp->mp_seg[D].mem_phys,
-   rmp->mp_seg[S].mem_vir + rmp->mp_seg[S].mem_len - rmp->mp_seg[D].mem_vir);
 
   /* We have now passed the point of no return.  The old core image has been
    * forever lost, memory for a new core image has been allocated.  Set up
    * and report new map.
    */
-  if (sh_mp != NULL) {
+  if (sh_text != NULL) {
         /* Share the text segment. */
-        rmp->mp_seg[T] = sh_mp->mp_seg[T];
+        rmp->mp_seg[T] = *sh_text;
   } else {
         rmp->mp_seg[T].mem_phys = new_base;
         rmp->mp_seg[T].mem_vir = 0;
@@ -15087,8 +17308,6 @@ phys_bytes tot_bytes;           /* total memory to allocate, including gap */
   rmp->mp_seg[S].mem_vir = rmp->mp_seg[D].mem_vir + data_clicks + gap_clicks;
   rmp->mp_seg[S].mem_len = stack_clicks;
 
-  sys_newmap(who, rmp->mp_seg);   /* report new map to the kernel */
-
   /* The old memory may have been swapped out, but the new memory is real. */
   rmp->mp_flags &= ~(WAITING|ONSWAP|SWAPIN);
 
@@ -15243,7 +17462,7 @@ char *script;                   /* name of script to interpret */
 /*===========================================================================*
  *                              rw_seg                                       *
  *===========================================================================*/
-PUBLIC void rw_seg(rw, fd, proc, seg, seg_bytes0)
+PUBLIC int rw_seg(rw, fd, proc, seg, seg_bytes0)
 int rw;                         /* 0 = read, 1 = write */
 int fd;                         /* file descriptor to read from / write to */
 int proc;                       /* process number */
@@ -15263,7 +17482,7 @@ phys_bytes seg_bytes0;          /* how much is to be transferred? */
  *
  * The byte count on read is usually smaller than the segment count, because
  * a segment is padded out to a click multiple, and the data segment is only
- * partially initialized.
+ * partially initialized.  Return OK, or EIO if the transfer fell short.
  */
 
   int new_fd, bytes, r;
@@ -15282,10 +17501,11 @@ phys_bytes seg_bytes0;          /* how much is to be transferred? */
         } else {
                 r = write(new_fd, ubuf_ptr, bytes);
         }
-        if (r != bytes) break;
+        if (r != bytes) return(EIO);
         ubuf_ptr += bytes;
         seg_bytes -= bytes;
   }
+  return(OK);
 }
 	
 /*===========================================================================*
@@ -15302,7 +17522,7 @@ time_t ctime;
  * call is made.
  */
   struct mproc *sh_mp;
-  for (sh_mp = &mproc[0]; sh_mp < &mproc[NR_PROCS]; sh_mp++) {
+  for (sh_mp = &mproc[0]; sh_mp < &mproc[nr_procs]; sh_mp++) {
 
         if (!(sh_mp->mp_flags & SEPARATE)) continue;
         if (sh_mp == mp_ign) continue;
@@ -15313,6 +17533,97 @@ time_t ctime;
   }
   return(NULL);
 }
+	
+/*===========================================================================*
+ *                              text_release                                 *
+ *===========================================================================*/
+PUBLIC void text_release(rmp)
+register struct mproc *rmp;     /* process that gives up its text */
+{
+/* Process 'rmp' exits or executes another program.  If no other process
+ * shares its text segment, keep the segment in the text cache, so that the
+ * next EXEC of the same file finds it there.  Common I & D processes have
+ * no text segment to keep.  Sharers are found by the segment itself, not by
+ * file:  two EXECs that both had to load the same file have one segment each.
+ */
+  register struct mproc *sh_mp;
+
+  if (rmp->mp_flags & SEPARATE) {
+        for (sh_mp = &mproc[0]; sh_mp < &mproc[nr_procs]; sh_mp++) {
+                if (!(sh_mp->mp_flags & SEPARATE)) continue;
+                if (sh_mp == rmp) continue;
+                if (sh_mp->mp_seg[T].mem_phys == rmp->mp_seg[T].mem_phys)
+                        return;         /* still in use */
+        }
+  }
+
+  if (!(rmp->mp_flags & SEPARATE) || rmp->mp_ino == 0) {
+        /* Nothing worth keeping, so free it. */
+        free_mem(rmp->mp_seg[T].mem_phys, rmp->mp_seg[T].mem_len);
+        return;
+  }
+  text_put(rmp->mp_ino, rmp->mp_dev, rmp->mp_ctime, &rmp->mp_seg[T]);
+}
+	
+/*===========================================================================*
+ *                              text_put                                     *
+ *===========================================================================*/
+PRIVATE void text_put(ino, dev, ctime, seg)
+ino_t ino;                      /* parameters that uniquely identify a file */
+dev_t dev;
+time_t ctime;
+struct mem_map *seg;            /* its text segment */
+{
+/* Enter a text segment in the cache.  An older entry for the same file is
+ * replaced; otherwise the entry with the lowest stamp is used.  That is a
+ * free one if there is one, else the least recently cached segment, which
+ * is freed to make room.
+ */
+  register struct text_cache *tc, *victim;
+
+  victim = &text_cache[0];
+  for (tc = &text_cache[0]; tc < &text_cache[NR_TEXT_CACHE]; tc++) {
+        if (tc->tc_seg.mem_len != 0 && tc->tc_ino == ino && tc->tc_dev == dev) {
+                victim = tc;            /* same file, older copy */
+                break;
+        }
+        if (tc->tc_stamp < victim->tc_stamp) victim = tc;
+  }
+
+  if (victim->tc_seg.mem_len != 0) {
+        free_mem(victim->tc_seg.mem_phys, victim->tc_seg.mem_len);
+        text_stats.ts_evicts++;
+  }
+  victim->tc_ino = ino;
+  victim->tc_dev = dev;
+  victim->tc_ctime = ctime;
+  victim->tc_seg = *seg;
+  victim->tc_stamp = ++text_clock;
+}
+	
+/*===========================================================================*
+ *                              text_reclaim                                 *
+ *===========================================================================*/
+PUBLIC int text_reclaim()
+{
+/* Memory is short.  Free the least recently cached text segment, if any.
+ * Return TRUE if memory was freed, so that the allocation can be retried.
+ */
+  register struct text_cache *tc, *victim;
+
+  victim = NULL;
+  for (tc = &text_cache[0]; tc < &text_cache[NR_TEXT_CACHE]; tc++) {
+        if (tc->tc_seg.mem_len == 0) continue;
+        if (victim == NULL || tc->tc_stamp < victim->tc_stamp) victim = tc;
+  }
+  if (victim == NULL) return(FALSE);
+
+  free_mem(victim->tc_seg.mem_phys, victim->tc_seg.mem_len);
+  victim->tc_seg.mem_len = 0;
+  victim->tc_stamp = 0;
+  text_stats.ts_evicts++;
+  return(TRUE);
+}
 
 
 
@@ -15664,21 +17975,19 @@ PUBLIC int ksig_pending()
  * uses this mechanism to signal writing on broken pipes (SIGPIPE). 
  *
  * The kernel has notified the PM about pending signals. Request pending
- * signals until all signals are handled. If there are no more signals,
- * NONE is returned in the process number field.
+ * signals in batches of up to KSIG_BATCH processes, and tell the kernel
+ * when each batch is done.  A short batch means that there are no more
+ * signals; any that arrive meanwhile cause a new notification.
  */ 
- int proc_nr;
- sigset_t sig_map;
-
- while (TRUE) {
-   sys_getksig(&proc_nr, &sig_map);     /* get an arbitrary pending signal */
-   if (NONE == proc_nr) {               /* stop if no more pending signals */
-        break;
-   } else {
-        handle_sig(proc_nr, sig_map);   /* handle the received signal */
-        sys_endksig(proc_nr);           /* tell kernel it's done */
-   }
- } 
+ static struct ksig ksigs[KSIG_BATCH];
+ int i, n;
+
+ do {
+   if (sys_getksigs(ksigs, KSIG_BATCH, &n) != OK || n == 0) break;
+   for (i = 0; i < n; i++)
+        handle_sig(ksigs[i].ks_proc, ksigs[i].ks_map);
+   sys_endksigs(ksigs, n);              /* tell kernel they are done */
+ } while (n == KSIG_BATCH);
  return(SUSPEND);                       /* prevents sending reply */
 }
 	
@@ -15691,11 +18000,10 @@ sigset_t sig_map;
 {
   register struct mproc *rmp;
   int i;
-  pid_t proc_id, id;
+  pid_t id;
 
   rmp = &mproc[proc_nr];
   if ((rmp->mp_flags & (IN_USE | ZOMBIE)) != IN_USE) return;
-  proc_id = rmp->mp_pid;
   mp = &mproc[0];                       /* pretend signals are from PM */
   mp->mp_procgrp = rmp->mp_procgrp;     /* get process group right */
 
@@ -15704,7 +18012,8 @@ sigset_t sig_map;
    * process and pass them to PM in one blow.  Thus loop on the bit
    * map. For SIGINT and SIGQUIT, use proc_id 0 to indicate a broadcast
    * to the recipient's process group.  For SIGKILL, use proc_id -1 to
-   * indicate a systemwide broadcast.
+   * indicate a systemwide broadcast.  Other signals are for the process
+   * itself, which need not be looked up.
    */
   for (i = 1; i <= _NSIG; i++) {
         if (!sigismember(&sig_map, i)) continue;
@@ -15715,8 +18024,10 @@ sigset_t sig_map;
             case SIGKILL: 
                 id = -1; break; /* broadcast to all except INIT */
             default: 
-                id = proc_id;
-                break;
+                /* An earlier signal in the map may have killed it. */
+                if ((rmp->mp_flags & (IN_USE | ZOMBIE)) == IN_USE)
+                        sig_proc(rmp, i);
+                continue;
         }
         check_sig(id, i);
   }
@@ -15850,6 +18161,16 @@ int signo;                      /* signal to send to process (1 to _NSIG) */
                 signo, (rmp->mp_flags & ZOMBIE) ? "zombie" :  "dead", slot);
         panic(__FILE__,"", NO_NUM);
   }
+  if (rmp->mp_flags & LOADING) {
+        /* FS is still to read in the new image.  A SIGKILL kills the process
+         * at once, unless FS is busy with the image.  Other signals are held
+         * until the EXEC is done; load_done() calls check_pending().
+         */
+        if (signo != SIGKILL || !load_cancel(rmp)) {
+                sigaddset(&rmp->mp_sigpending, signo);
+                return;
+        }
+  }
   if ((rmp->mp_flags & TRACED) && signo != SIGKILL) {
         /* A traced process has special handling. */
         unpause(slot);
@@ -15938,21 +18259,37 @@ int signo;                      /* signal to send to process (0 to _NSIG) */
  * call, and also when the kernel catches a DEL or other signal.
  */
 
-  register struct mproc *rmp;
+  register struct mproc *rmp, *next;
   int count;                    /* count # of signals sent */
   int error_code;
+  int by_grp;                   /* TRUE if following a group's chain */
+  pid_t pgrp;
 
   if (signo < 0 || signo > _NSIG) return(EINVAL);
 
   /* Return EINVAL for attempts to send SIGKILL to INIT alone. */
   if (proc_id == INIT_PID && signo == SIGKILL) return(EINVAL);
 
-  /* Search the proc table for processes to signal.  (See forkexit.c about
-   * pid magic.)
+  /* Search for processes to signal.  (See forkexit.c about pid magic.)  A
+   * single process is looked up by pid, and the members of a process group
+   * are found on its hash chain.  Only for -1 and for group 0 is the whole
+   * proc table searched.
    */
+  pgrp = (proc_id == 0 ? mp->mp_procgrp : -proc_id);
+  by_grp = (proc_id == 0 || proc_id < -1) && pgrp != 0;
+  if (proc_id > 0) rmp = find_pid(proc_id);
+  else if (by_grp) rmp = grp_chain(pgrp);
+  else rmp = &mproc[0];
+
   count = 0;
   error_code = ESRCH;
-  for (rmp = &mproc[0]; rmp < &mproc[NR_PROCS]; rmp++) {
+  for ( ; rmp != NIL_MPROC; rmp = next) {
+        /* Find the next candidate before this one is signaled. */
+        if (proc_id > 0) next = NIL_MPROC;
+        else if (by_grp) next = rmp->mp_grpnext;
+        else if (rmp < &mproc[nr_procs-1]) next = rmp + 1;
+        else next = NIL_MPROC;
+
         if (!(rmp->mp_flags & IN_USE)) continue;
         if ((rmp->mp_flags & ZOMBIE) && signo != 0) continue;
 
@@ -15996,7 +18333,8 @@ PUBLIC void check_pending(rmp)
 register struct mproc *rmp;
 {
   /* Check to see if any pending signals have been unblocked.  The
-   * first such signal found is delivered.
+   * first such signal found is delivered, but a pending SIGKILL always
+   * goes first.
    *
    * If multiple pending unmasked signals are found, they will be
    * delivered sequentially.
@@ -16008,6 +18346,11 @@ register struct mproc *rmp;
 
   int i;
 
+  if (sigismember(&rmp->mp_sigpending, SIGKILL)) {
+        sigdelset(&rmp->mp_sigpending, SIGKILL);
+        sig_proc(rmp, SIGKILL);
+        return;
+  }
   for (i = 1; i <= _NSIG; i++) {
         if (sigismember(&rmp->mp_sigpending, i) &&
                 !sigismember(&rmp->mp_sigmask, i)) {
@@ -16347,7 +18690,9 @@ PUBLIC int do_getset()
 
         case SETSID: 
                 if (rmp->mp_procgrp == rmp->mp_pid) return(EPERM);
+                pid_unlink(rmp);
                 rmp->mp_procgrp = rmp->mp_pid;
+                pid_link(rmp);
                 tell_fs(SETSID, who, 0, 0);
                 /* fall through */
 
@@ -16427,6 +18772,7 @@ PUBLIC int do_getsysinfo()
   struct mproc *proc_addr;
   vir_bytes src_addr, dst_addr;
   struct kinfo kinfo;
+  struct mem_stats mem_stats;
   size_t len;
   int s;
 
@@ -16445,6 +18791,15 @@ PUBLIC int do_getsysinfo()
         src_addr = (vir_bytes) mproc;
         len = sizeof(struct mproc) * NR_PROCS;
         break;
+  case SI_TEXT_STATS:                    /* text cache and EXEC statistics */
+        src_addr = (vir_bytes) &text_stats;
+        len = sizeof(struct text_stats);
+        break;
+  case SI_MEM_STATS:                     /* free memory and fragmentation */
+        get_mem_stats(&mem_stats);
+        src_addr = (vir_bytes) &mem_stats;
+        len = sizeof(struct mem_stats);
+        break;
   default: 
         return(EINVAL);
   }
@@ -16465,21 +18820,17 @@ PUBLIC int do_getprocnr()
   int key_len;
   int s;
 
-  if (m_in.pid >= 0) {                          /* lookup process by pid */
-        for (rmp = &mproc[0]; rmp < &mproc[NR_PROCS]; rmp++) {
-                if ((rmp->mp_flags & IN_USE) && (rmp->mp_pid==m_in.pid)) {
-                        mp->mp_reply.procnr = (int) (rmp - mproc);
-                        return(OK);
-                } 
-        }
-        return(ESRCH);                  
+  if (m_in.pid >= 0) {                          /* lookup process by pid */
+        if ((rmp = find_pid(m_in.pid)) == NIL_MPROC) return(ESRCH);
+        mp->mp_reply.procnr = (int) (rmp - mproc);
+        return(OK);
   } else if (m_in.namelen > 0) {                /* lookup process by name */
         key_len = MIN(m_in.namelen, PROC_NAME_LEN);
         if (OK != (s=sys_datacopy(who, (vir_bytes) m_in.addr, 
                         SELF, (vir_bytes) search_key, key_len))) 
                 return(s);
         search_key[key_len] = '\0';     /* terminate for safety */
-        for (rmp = &mproc[0]; rmp < &mproc[NR_PROCS]; rmp++) {
+        for (rmp = &mproc[0]; rmp < &mproc[nr_procs]; rmp++) {
                 if ((rmp->mp_flags & IN_USE) && 
                         strncmp(rmp->mp_name, search_key, key_len)==0) {
                         mp->mp_reply.procnr = (int) (rmp - mproc);
@@ -16559,12 +18910,11 @@ PUBLIC int do_getsetpriority()
                 return(EINVAL);
 
         if (arg_who == 0)
-                rmp_nr = who;
+                rmp = mp;
         else
-                if ((rmp_nr = proc_from_pid(arg_who)) < 0)
+                if ((rmp = find_pid(arg_who)) == NIL_MPROC)
                         return(ESRCH);
-
-        rmp = &mproc[rmp_nr];
+        rmp_nr = (int) (rmp - mproc);
 
         if (mp->mp_effuid != SUPER_USER &&
            mp->mp_effuid != rmp->mp_effuid && mp->mp_effuid != rmp->mp_realuid)
@@ -16689,6 +19039,386 @@ PUBLIC int do_svrctl()
   }
 }
 
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      servers/pm/alloc.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* This file is concerned with allocating and freeing arbitrary-size blocks of
+ * physical memory on behalf of the FORK and EXEC system calls.  The key data
+ * structure used is the hole table, which maintains the holes in memory.  The
+ * addresses it contains refer to physical memory, starting at absolute
+ * address 0 (i.e., they are not relative to the start of PM).  During system
+ * initialization, that part of memory containing the interrupt vectors,
+ * kernel, and PM are "allocated" to mark them as not available and to
+ * remove them from the hole table.
+ *
+ * The holes form a binary search tree ordered by address.  The tree is kept
+ * balanced as a treap:  each hole has a random priority, and no hole has a
+ * lower priority than its parent.  Each hole also records the size of the
+ * largest hole in its subtree, so the lowest hole that is big enough, which
+ * is what a first-fit search through an address-ordered list would find,
+ * is found in O(log n) steps.  When memory is freed, the holes immediately
+ * below and above it are found in the same way, and merged with it at once.
+ *
+ * The entry points into this file are:
+ *   alloc_mem:      allocate a given sized chunk of memory
+ *   free_mem:       release a previously allocated chunk of memory
+ *   mem_init:       initialize the tables when PM start up
+ *   get_mem_stats:  report the amount and fragmentation of free memory
+ */
+
+#include "pm.h"
+#include <minix/com.h>
+#include <minix/callnr.h>
+#include <signal.h>
+#include <stdlib.h>
+#include "mproc.h"
+#include "../../kernel/const.h"
+#include "../../kernel/config.h"
+#include "../../kernel/type.h"
+
+#define NR_HOLES  (2*NR_PROCS)  /* max # entries in hole table */
+#define NIL_HOLE (struct hole *) 0
+
+PRIVATE struct hole {
+  struct hole *h_left;          /* holes at lower addresses */
+  struct hole *h_right;         /* holes at higher addresses; free list link */
+  phys_clicks h_base;           /* where does the hole begin? */
+  phys_clicks h_len;            /* how big is the hole? */
+  phys_clicks h_max;            /* largest hole in this subtree */
+  unsigned h_prio;              /* treap priority, lowest at the root */
+} hole[NR_HOLES];
+
+PRIVATE struct hole *hole_root; /* root of the tree of holes */
+PRIVATE struct hole *free_slots;/* ptr to list of unused table slots */
+PRIVATE unsigned long prio_seed;        /* for pseudo-random priorities */
+PRIVATE struct mem_stats mem_stats;     /* statistics, see get_mem_stats() */
+
+FORWARD _PROTOTYPE( struct hole *new_slot, (phys_clicks base,
+                                                phys_clicks clicks)     );
+FORWARD _PROTOTYPE( void put_slot, (struct hole *hp)                    );
+FORWARD _PROTOTYPE( void fix, (struct hole *hp)                         );
+FORWARD _PROTOTYPE( struct hole *rot_left, (struct hole *hp)            );
+FORWARD _PROTOTYPE( struct hole *rot_right, (struct hole *hp)           );
+FORWARD _PROTOTYPE( struct hole *insert, (struct hole *tp, struct hole *hp) );
+FORWARD _PROTOTYPE( struct hole *join, (struct hole *lp, struct hole *rp) );
+FORWARD _PROTOTYPE( struct hole *delete, (struct hole *tp, phys_clicks base) );
+FORWARD _PROTOTYPE( struct hole *take, (struct hole *tp, phys_clicks clicks,
+                                                phys_clicks *base)      );
+FORWARD _PROTOTYPE( void touch, (struct hole *tp, phys_clicks base)     );
+
+/*===========================================================================*
+ *                              alloc_mem                                    *
+ *===========================================================================*/
+PUBLIC phys_clicks alloc_mem(clicks)
+phys_clicks clicks;             /* amount of memory requested */
+{
+/* Allocate a block of memory from the hole table using first fit.  The block
+ * consists of a sequence of contiguous bytes, whose length in clicks is
+ * given by 'clicks'.  A pointer to the block is returned.  The block is
+ * always on a click boundary.  This procedure is called when memory is
+ * needed for FORK or EXEC.  If no hole is big enough, cached text segments
+ * are freed until one is, or until there are no more.
+ */
+  phys_clicks base;
+
+  do {
+        if (hole_root != NIL_HOLE && hole_root->h_max >= clicks) {
+                hole_root = take(hole_root, clicks, &base);
+                mem_stats.ms_free -= clicks;
+                mem_stats.ms_allocs++;
+                return(base);
+        }
+  } while (text_reclaim());
+
+  mem_stats.ms_fails++;
+  return(NO_MEM);
+}
+	
+/*===========================================================================*
+ *                              free_mem                                     *
+ *===========================================================================*/
+PUBLIC void free_mem(base, clicks)
+phys_clicks base;               /* base address of block to free */
+phys_clicks clicks;             /* number of clicks to free */
+{
+/* Return a block of free memory to the hole table.  The parameters tell
+ * where the block starts in physical memory and how big it is.  The block
+ * is merged with the holes directly below and above it, if any.
+ */
+  register struct hole *hp, *below, *above;
+
+  if (clicks == 0) return;
+  mem_stats.ms_free += clicks;
+  mem_stats.ms_frees++;
+
+  /* Find the holes below and above the block. */
+  below = above = NIL_HOLE;
+  for (hp = hole_root; hp != NIL_HOLE; ) {
+        if (hp->h_base < base) {
+                below = hp;
+                hp = hp->h_right;
+        } else {
+                above = hp;
+                hp = hp->h_left;
+        }
+  }
+
+  if (below != NIL_HOLE && below->h_base + below->h_len == base) {
+        /* Grow the hole below, and absorb the one above if it touches. */
+        below->h_len += clicks;
+        if (above != NIL_HOLE && base + clicks == above->h_base) {
+                below->h_len += above->h_len;
+                hole_root = delete(hole_root, above->h_base);
+        }
+        touch(hole_root, below->h_base);
+  } else if (above != NIL_HOLE && base + clicks == above->h_base) {
+        /* Grow the hole above downwards.  It keeps its place in the tree. */
+        above->h_base = base;
+        above->h_len += clicks;
+        touch(hole_root, base);
+  } else {
+        hole_root = insert(hole_root, new_slot(base, clicks));
+  }
+}
+	
+/*===========================================================================*
+ *                              mem_init                                     *
+ *===========================================================================*/
+PUBLIC void mem_init(chunks, free)
+struct memory *chunks;          /* list of free memory chunks */
+phys_clicks *free;              /* memory size summaries */
+{
+/* Initialize hole lists.  There are two lists:  'hole_root' points to a tree
+ * of all the holes (unused memory) in the system; 'free_slots' points to a
+ * list of table entries that are not in use.  Initially, the former is
+ * empty and the latter holds all entries.  Then each chunk of physical
+ * memory is freed, which builds the tree of holes.
+ */
+  register struct hole *hp;
+  int i;
+
+  hole_root = NIL_HOLE;
+  free_slots = NIL_HOLE;
+  for (hp = &hole[NR_HOLES-1]; hp >= &hole[0]; hp--) put_slot(hp);
+  mem_stats.ms_holes = 0;
+
+  /* Use the chunks of physical memory to allocate holes. */
+  *free = 0;
+  for (i=0; i<NR_MEMS; i++) {
+        if (chunks[i].size > 0) {
+                free_mem(chunks[i].base, chunks[i].size);
+                *free += chunks[i].size;
+        }
+  }
+  mem_stats.ms_frees = 0;
+}
+	
+/*===========================================================================*
+ *                              get_mem_stats                                *
+ *===========================================================================*/
+PUBLIC void get_mem_stats(msp)
+struct mem_stats *msp;          /* place to return the statistics */
+{
+/* Report the state of free memory.  The difference between the total free
+ * memory and the largest hole is a measure of its fragmentation.
+ */
+  *msp = mem_stats;
+  msp->ms_largest = (hole_root == NIL_HOLE ? 0 : hole_root->h_max);
+}
+	
+/*===========================================================================*
+ *                              new_slot                                     *
+ *===========================================================================*/
+PRIVATE struct hole *new_slot(base, clicks)
+phys_clicks base;               /* where the new hole begins */
+phys_clicks clicks;             /* and how big it is */
+{
+/* Take a slot from the free list for a new hole, and give it a random
+ * priority.
+ */
+  register struct hole *hp;
+
+  if ( (hp = free_slots) == NIL_HOLE) panic(__FILE__,"hole table full", NO_NUM);
+  free_slots = hp->h_right;
+  hp->h_left = hp->h_right = NIL_HOLE;
+  hp->h_base = base;
+  hp->h_len = hp->h_max = clicks;
+  prio_seed = prio_seed * 1103515245L + 12345;
+  hp->h_prio = (unsigned) (prio_seed >> 16);
+  mem_stats.ms_holes++;
+  return(hp);
+}
+	
+/*===========================================================================*
+ *                              put_slot                                     *
+ *===========================================================================*/
+PRIVATE void put_slot(hp)
+register struct hole *hp;       /* slot that is no longer used */
+{
+  hp->h_right = free_slots;
+  free_slots = hp;
+  mem_stats.ms_holes--;
+}
+	
+/*===========================================================================*
+ *                              fix                                          *
+ *===========================================================================*/
+PRIVATE void fix(hp)
+register struct hole *hp;       /* hole whose subtree has changed */
+{
+/* Recompute the size of the largest hole in the subtree of 'hp'. */
+  phys_clicks max;
+
+  max = hp->h_len;
+  if (hp->h_left != NIL_HOLE && hp->h_left->h_max > max)
+        max = hp->h_left->h_max;
+  if (hp->h_right != NIL_HOLE && hp->h_right->h_max > max)
+        max = hp->h_right->h_max;
+  hp->h_max = max;
+}
+	
+/*===========================================================================*
+ *                              rot_left                                     *
+ *===========================================================================*/
+PRIVATE struct hole *rot_left(hp)
+register struct hole *hp;       /* subtree root, its right child moves up */
+{
+  register struct hole *rp = hp->h_right;
+
+  hp->h_right = rp->h_left;
+  rp->h_left = hp;
+  fix(hp);
+  return(rp);                   /* caller fixes the new root */
+}
+	
+/*===========================================================================*
+ *                              rot_right                                    *
+ *===========================================================================*/
+PRIVATE struct hole *rot_right(hp)
+register struct hole *hp;       /* subtree root, its left child moves up */
+{
+  register struct hole *lp = hp->h_left;
+
+  hp->h_left = lp->h_right;
+  lp->h_right = hp;
+  fix(hp);
+  return(lp);                   /* caller fixes the new root */
+}
+	
+/*===========================================================================*
+ *                              insert                                       *
+ *===========================================================================*/
+PRIVATE struct hole *insert(tp, hp)
+register struct hole *tp;       /* subtree to insert into */
+struct hole *hp;                /* new hole */
+{
+/* Insert a hole in a subtree and return the new root of the subtree. */
+
+  if (tp == NIL_HOLE) return(hp);
+  if (hp->h_base < tp->h_base) {
+        tp->h_left = insert(tp->h_left, hp);
+        if (tp->h_left->h_prio < tp->h_prio) tp = rot_right(tp);
+  } else {
+        tp->h_right = insert(tp->h_right, hp);
+        if (tp->h_right->h_prio < tp->h_prio) tp = rot_left(tp);
+  }
+  fix(tp);
+  return(tp);
+}
+	
+/*===========================================================================*
+ *                              join                                         *
+ *===========================================================================*/
+PRIVATE struct hole *join(lp, rp)
+register struct hole *lp;       /* subtree of lower holes */
+register struct hole *rp;       /* subtree of higher holes */
+{
+/* Join two subtrees whose parent has gone.  Return the new root. */
+
+  if (lp == NIL_HOLE) return(rp);
+  if (rp == NIL_HOLE) return(lp);
+  if (lp->h_prio < rp->h_prio) {
+        lp->h_right = join(lp->h_right, rp);
+        fix(lp);
+        return(lp);
+  }
+  rp->h_left = join(lp, rp->h_left);
+  fix(rp);
+  return(rp);
+}
+	
+/*===========================================================================*
+ *                              delete                                       *
+ *===========================================================================*/
+PRIVATE struct hole *delete(tp, base)
+register struct hole *tp;       /* subtree that holds the hole */
+phys_clicks base;               /* base of the hole to remove */
+{
+/* Remove a hole from a subtree and return the new root of the subtree. */
+  struct hole *hp;
+
+  if (base < tp->h_base) {
+        tp->h_left = delete(tp->h_left, base);
+  } else if (base > tp->h_base) {
+        tp->h_right = delete(tp->h_right, base);
+  } else {
+        hp = tp;
+        tp = join(tp->h_left, tp->h_right);
+        put_slot(hp);
+        return(tp);
+  }
+  fix(tp);
+  return(tp);
+}
+	
+/*===========================================================================*
+ *                              take                                         *
+ *===========================================================================*/
+PRIVATE struct hole *take(tp, clicks, base)
+register struct hole *tp;       /* subtree with a big enough hole */
+phys_clicks clicks;             /* amount of memory requested */
+phys_clicks *base;              /* place to return its base */
+{
+/* Carve 'clicks' from the lowest hole in the subtree that is big enough.
+ * A hole that is used up is removed.  Return the new root of the subtree.
+ */
+  struct hole *hp;
+
+  if (tp->h_left != NIL_HOLE && tp->h_left->h_max >= clicks) {
+        tp->h_left = take(tp->h_left, clicks, base);
+  } else if (tp->h_len >= clicks) {
+        /* This hole will do.  Its base grows, but its place does not change. */
+        *base = tp->h_base;
+        tp->h_base += clicks;
+        tp->h_len -= clicks;
+        if (tp->h_len == 0) {
+                hp = tp;
+                tp = join(tp->h_left, tp->h_right);
+                put_slot(hp);
+                return(tp);
+        }
+  } else {
+        tp->h_right = take(tp->h_right, clicks, base);
+  }
+  fix(tp);
+  return(tp);
+}
+	
+/*===========================================================================*
+ *                              touch                                        *
+ *===========================================================================*/
+PRIVATE void touch(tp, base)
+register struct hole *tp;       /* subtree that holds the hole */
+phys_clicks base;               /* base of the hole that has changed size */
+{
+/* Update the largest hole sizes on the path down to a hole that has grown. */
+
+  if (base < tp->h_base) touch(tp->h_left, base);
+  else if (base > tp->h_base) touch(tp->h_right, base);
+  fix(tp);
+}
+
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                                       servers/fs/fs.h
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -16738,6 +19468,8 @@ PUBLIC int do_svrctl()
 #define NR_INODES         64    /* # slots in "in core" inode table */
 #define NR_SUPERS          8    /* # slots in super block table */
 #define NR_LOCKS           8    /* # slots in the file locking table */
+#define NR_TMP_INODES    256    /* # inodes on each tmpfs */
+#define TMP_MINOR_BLOCKS  16    /* tmpfs blocks per unit of minor device */
 
 /* The type of sizeof may be (unsigned) long.  Use the following macro for
  * taking the sizes of small objects so that there are no surprises like
@@ -16788,6 +19520,9 @@ PUBLIC int do_svrctl()
 
 #define END_OF_FILE   (-104)    /* eof detected */
 
+/* A tmpfs has no driver; its blocks are kept by FS (see tmpfs.c). */
+#define IS_TMPFS(dev) ((((dev) >> MAJOR) & BYTE) == TMPFS_MAJOR)
+
 #define ROOT_INODE         1            /* inode number for root directory */
 #define BOOT_BLOCK  ((block_t) 0)       /* block number of boot block */
 #define SUPER_BLOCK_BYTES (1024)        /* bytes offset */
@@ -16953,6 +19688,7 @@ _PROTOTYPE( int do_lseek, (void)                                        );
 _PROTOTYPE( int do_mknod, (void)                                        );
 _PROTOTYPE( int do_mkdir, (void)                                        );
 _PROTOTYPE( int do_open, (void)                                         );
+_PROTOTYPE( int do_spawnfd, (void)                                      );
 
 /* path.c */
 _PROTOTYPE( struct inode *advance,(struct inode *dirp, char string[NAME_MAX]));
@@ -16983,6 +19719,7 @@ _PROTOTYPE( int read_only, (struct inode *ip)                           );
 
 /* read.c */
 _PROTOTYPE( int do_read, (void)                                         );
+_PROTOTYPE( int do_execload, (void)                                     );
 _PROTOTYPE( struct buf *rahead, (struct inode *rip, block_t baseblock,
                         off_t position, unsigned bytes_ahead)           );
 _PROTOTYPE( void read_ahead, (void)                                     );
@@ -17011,6 +19748,14 @@ _PROTOTYPE( int get_block_size, (dev_t dev)                             );
 _PROTOTYPE( int do_stime, (void)                                        );
 _PROTOTYPE( int do_utime, (void)                                        );
 
+/* tmpfs.c */
+_PROTOTYPE( void tmp_init, (void)                                       );
+_PROTOTYPE( int tmp_mkfs, (struct super_block *sp)                      );
+_PROTOTYPE( struct buf *tmp_get, (Dev_t dev, block_t block)             );
+_PROTOTYPE( int tmp_alloc, (Dev_t dev, block_t block)                   );
+_PROTOTYPE( void tmp_free, (Dev_t dev, block_t block)                   );
+_PROTOTYPE( void tmp_release, (Dev_t dev)                               );
+
 /* utility.c */
 _PROTOTYPE( time_t clock_time, (void)                                   );
 _PROTOTYPE( unsigned conv2, (int norm, int w)                           );
@@ -17058,10 +19803,14 @@ EXTERN int super_user;          /* 1 if caller is super_user, else 0 */
 EXTERN int susp_count;          /* number of procs suspended on pipe */
 EXTERN int nr_locks;            /* number of locks currently in place */
 EXTERN int reviving;            /* number of pipe processes to be revived */
+EXTERN struct fproc *revive_head;       /* queue of processes to be revived */
+EXTERN struct fproc *revive_tail;
+EXTERN struct fproc *lock_waiters;      /* processes suspended on a lock */
 EXTERN off_t rdahedpos;         /* position to read ahead */
 EXTERN struct inode *rdahed_inode;      /* pointer to inode to read ahead */
 EXTERN Dev_t root_dev;          /* device number of the root device */
 EXTERN time_t boottime;         /* time in seconds at system boot */
+EXTERN int nr_procs;            /* # of 'fproc' slots in use, from kernel */
 
 /* The parameters of the call are kept here. */
 EXTERN message m_in;            /* the input message itself */
@@ -17107,6 +19856,7 @@ EXTERN struct fproc {
   char fp_suspended;            /* set to indicate process hanging */
   char fp_revived;              /* set to indicate process being revived */
   char fp_task;                 /* which task is proc suspended on */
+  struct fproc *fp_nextsusp;    /* next on the same pipe, lock or revive list */
   char fp_sesldr;               /* true if proc is a session leader */
   pid_t fp_pid;                 /* process id */
   long fp_cloexec;              /* bit map for POSIX Table 6-2 FD_CLOEXEC */
@@ -17119,8 +19869,10 @@ EXTERN struct fproc {
 #define REVIVING           1    /* process is being revived from suspension */
 #define PID_FREE           0    /* process slot free */
 
+#define NIL_FPROC ((struct fproc *) 0)  /* end of a list of processes */
+
 /* Check is process number is acceptable - includes system processes. */
-#define isokprocnr(n)   ((unsigned)((n)+NR_TASKS) < NR_PROCS + NR_TASKS)
+#define isokprocnr(n)   ((unsigned)((n)+NR_TASKS) < nr_procs + NR_TASKS)
 
 
 
@@ -17289,6 +20041,7 @@ EXTERN struct inode {
   char i_mount;                 /* this bit is set if file mounted on */
   char i_seek;                  /* set on LSEEK, cleared on READ/WRITE */
   char i_update;                /* the ATIME, CTIME, and MTIME bits are here */
+  struct fproc *i_waiters;      /* processes suspended on this pipe */
 } inode[NR_INODES];
 
 #define NIL_INODE (struct inode *) 0    /* indicates absence of inode slot */
@@ -17320,6 +20073,14 @@ EXTERN struct inode {
 #define ioflags       m1_i3
 #define group         m1_i3
 #define real_grp_id   m1_i2
+#define load_data     m5_l2
+#define load_fd       m5_i1
+#define load_flags    m5_l3
+#define load_gid      m5_c2
+#define load_proc     m5_i2
+#define load_status   m5_i1
+#define load_text     m5_l1
+#define load_uid      m5_c1
 #define ls_fd         m2_i1
 #define mk_mode       m1_i2
 #define mk_z0         m1_i3
@@ -17347,6 +20108,8 @@ EXTERN struct inode {
 #define request       m1_i2
 #define sig           m1_i2
 #define slot1         m1_i1
+#define spawn_fd      m1_i2
+#define spawn_oldfd   m1_i3
 #define tp            m2_l1
 #define utime_actime  m2_l1
 #define utime_modtime m2_l2
@@ -17525,7 +20288,7 @@ PUBLIC _PROTOTYPE (int (*call_vec[]), (void) ) = {
 
         no_sys,         /* 64 = KSIG:  signals originating in the kernel */
         do_unpause,     /* 65 = UNPAUSE */
-        no_sys,         /* 66 = unused  */
+        do_execload,    /* 66 = EXEC_LOAD */
         do_revive,      /* 67 = REVIVE  */
         no_sys,         /* 68 = TASK_REPLY      */
         no_sys,         /* 69 = unused */
@@ -17551,6 +20314,7 @@ PUBLIC _PROTOTYPE (int (*call_vec[]), (void) ) = {
         no_sys,         /* 88 = getpriority */
         no_sys,         /* 89 = setpriority */
         no_sys,         /* 90 = gettimeofday */
+        do_spawnfd,     /* 91 = spawn */
 };
 /* This should not fail with "array size is negative":  */
 extern int dummy[sizeof(call_vec) == NCALLS * sizeof(call_vec[0]) ? 1 :  -1];
@@ -17573,6 +20337,9 @@ extern int dummy[sizeof(call_vec) == NCALLS * sizeof(call_vec[0]) ? 1 :  -1];
  *   free_zone:    release a zone (when a file is removed)
  *   rw_block:     read or write a block from the disk itself
  *   invalidate:   remove all the cache blocks on some device
+ *
+ * The blocks of a tmpfs are not cached here; get_block() and put_block()
+ * pass them on to tmpfs.c.
  */
 
 #include "fs.h"
@@ -17610,6 +20377,9 @@ int only_search;                /* if NO_READ, don't read, else act normal */
   int b;
   register struct buf *bp, *prev_ptr;
 
+  /* A tmpfs keeps all its blocks in memory, outside the cache. */
+  if (IS_TMPFS(dev)) return(tmp_get(dev, block));
+
   /* Search the hash chain for (dev, block). Do_read() can use 
    * get_block(NO_DEV ...) to get an unnamed block to fill with zeros when
    * someone wants to read from a hole in a file, in which case this search
@@ -17697,6 +20467,7 @@ int block_type;                 /* INODE_BLOCK, DIRECTORY_BLOCK, or whatever */
 
   bp->b_count--;                /* there is one use fewer now */
   if (bp->b_count != 0) return; /* block is still in use */
+  if (IS_TMPFS(bp->b_dev)) return;      /* tmpfs blocks stay in memory */
 
   bufs_in_use--;                /* one fewer block buffers in use */
 
@@ -17767,6 +20538,13 @@ zone_t z;                       /* try to allocate new zone near this one */
         bit = (bit_t) z - (sp->s_firstdatazone - 1);
   }
   b = alloc_bit(sp, ZMAP, bit);
+
+  /* On a tmpfs the zone needs a block from the pool too. */
+  if (b != NO_BIT && IS_TMPFS(dev) &&
+                tmp_alloc(dev, sp->s_firstdatazone - 1 + (zone_t) b) != OK) {
+        free_bit(sp, ZMAP, b);
+        b = NO_BIT;
+  }
   if (b == NO_BIT) {
         err_code = ENOSPC;
         major = (int) (sp->s_dev >> MAJOR) & BYTE;
@@ -17797,6 +20575,7 @@ zone_t numb;                            /* zone to be returned */
   bit = (bit_t) (numb - (sp->s_firstdatazone - 1));
   free_bit(sp, ZMAP, bit);
   if (bit < sp->s_zsearch) sp->s_zsearch = bit;
+  if (IS_TMPFS(dev)) tmp_free(dev, (block_t) numb);
 }
 	
 /*===========================================================================*
@@ -17992,6 +20771,265 @@ struct buf *bp;
 
 
 
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      servers/fs/tmpfs.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* This file manages tmpfs, a file system that lives in the memory of FS
+ * itself.  A tmpfs is mounted from a block special file with major device
+ * TMPFS_MAJOR; there is no driver behind it.  Its blocks are buffers taken
+ * from a pool of their own, which are never on the LRU chain of the block
+ * cache and are never read from or written to a device.  Get_block() and
+ * put_block() hand the blocks of a tmpfs to this file, so the rest of FS
+ * treats a tmpfs like any other MINIX file system.
+ *
+ * The pool is a static array of NR_TMP_BUFS blocks, so its memory is taken
+ * when FS is loaded, not when a tmpfs is mounted.  Each tmpfs reserves part
+ * of the pool at mount time: minor device n asks for n * TMP_MINOR_BLOCKS
+ * blocks, minor device 0 for all blocks not yet reserved.  The super block
+ * counts only the zones that fit in the reservation, so the free space a
+ * tmpfs reports is really there, and one tmpfs cannot fill up another.
+ *
+ * The super block, bit maps, inode table and root directory are made at
+ * mount time.  A data or indirect zone gets a block from the pool when
+ * alloc_zone() hands it out, and gives it back in free_zone().
+ *
+ * The entry points into this file are
+ *   tmp_init:     chain all pool blocks together (at FS startup)
+ *   tmp_mkfs:     make an empty file system on a tmpfs device
+ *   tmp_get:      find a block of a tmpfs device in the pool
+ *   tmp_alloc:    give a newly allocated zone a block from the pool
+ *   tmp_free:     return the block of a freed zone to the pool
+ *   tmp_release:  return all blocks of a tmpfs device to the pool
+ */
+
+#include "fs.h"
+#include <string.h>
+#include "buf.h"
+#include "inode.h"
+#include "super.h"
+
+PRIVATE struct buf tmp_pool[NR_TMP_BUFS];       /* blocks of every tmpfs */
+PRIVATE struct buf *tmp_hash[NR_BUF_HASH];      /* hash chains of used blocks */
+PRIVATE struct buf *tmp_free_list;              /* chain of unused blocks */
+PRIVATE int tmp_reserved;                       /* blocks promised to mounts */
+
+FORWARD _PROTOTYPE( void tmp_drop, (struct buf *bp)                     );
+
+/*===========================================================================*
+ *                              tmp_init                                     *
+ *===========================================================================*/
+PUBLIC void tmp_init()
+{
+/* Put all blocks of the pool on the free list. */
+
+  register struct buf *bp;
+
+  tmp_free_list = NIL_BUF;
+  for (bp = &tmp_pool[NR_TMP_BUFS - 1]; bp >= &tmp_pool[0]; bp--) {
+        bp->b_blocknr = NO_BLOCK;
+        bp->b_dev = NO_DEV;
+        bp->b_next = tmp_free_list;
+        tmp_free_list = bp;
+  }
+}
+	
+/*===========================================================================*
+ *                              tmp_mkfs                                     *
+ *===========================================================================*/
+PUBLIC int tmp_mkfs(sp)
+register struct super_block *sp;        /* slot to make the super block in */
+{
+/* Make an empty file system on the tmpfs device 'sp->s_dev'.  The super
+ * block only exists in the super block table.  The layout is that of a V3
+ * file system with one block for each bit map; the inode map covers
+ * NR_TMP_INODES inodes, the zone map the zones left in the reservation
+ * after the bit maps and the inode table.
+ */
+
+  dev_t dev;
+  block_t b;
+  struct buf *bp;
+  struct inode *rip;
+  ino_t root;
+  int r, minor, blocks, meta;
+
+  dev = sp->s_dev;
+  memset(sp, 0, sizeof(*sp));
+  sp->s_dev = dev;
+  sp->s_ninodes = NR_TMP_INODES;
+  sp->s_imap_blocks = 1;
+  sp->s_zmap_blocks = 1;
+  sp->s_inodes_per_block = V2_INODES_PER_BLOCK(MAX_BLOCK_SIZE);
+  sp->s_firstdatazone = START_BLOCK + 2 +
+        (NR_TMP_INODES + sp->s_inodes_per_block - 1) / sp->s_inodes_per_block;
+  sp->s_log_zone_size = 0;
+
+  /* Reserve the blocks of this tmpfs, with room for at least the root. */
+  minor = (int) (dev >> MINOR) & BYTE;
+  blocks = minor == 0 ? NR_TMP_BUFS - tmp_reserved :  minor * TMP_MINOR_BLOCKS;
+  meta = sp->s_firstdatazone - START_BLOCK;
+  if (blocks > NR_TMP_BUFS - tmp_reserved || blocks <= meta) return(ENOSPC);
+  tmp_reserved += blocks;
+  sp->s_zones = sp->s_firstdatazone + (blocks - meta);
+  sp->s_max_size = (off_t) (blocks - meta) * MAX_BLOCK_SIZE;
+  sp->s_magic = SUPER_V3;
+  sp->s_block_size = MAX_BLOCK_SIZE;
+  sp->s_version = V3;
+  sp->s_native = 1;
+  sp->s_ndzones = V2_NR_DZONES;
+  sp->s_nindirs = V2_INDIRECTS(MAX_BLOCK_SIZE);
+
+  /* The bit maps and the inode table exist from the start.  Bit 0 of each
+   * map is never used; bit 1 of the inode map is the root directory.
+   */
+  for (b = START_BLOCK; b < sp->s_firstdatazone; b++)
+        if (tmp_alloc(dev, b) != OK) return(ENOSPC);
+  bp = get_block(dev, START_BLOCK, NORMAL);
+  bp->b_bitmap[0] = (bitchunk_t) 3;
+  put_block(bp, MAP_BLOCK);
+  bp = get_block(dev, START_BLOCK + 1, NORMAL);
+  bp->b_bitmap[0] = (bitchunk_t) 1;
+  put_block(bp, MAP_BLOCK);
+
+  /* Make the root directory with its . and .. entries. */
+  if ( (rip = get_inode(dev, ROOT_INODE)) == NIL_INODE) return(err_code);
+  rip->i_mode = I_DIRECTORY | RWX_MODES;
+  rip->i_uid = SU_UID;
+  rip->i_gid = SYS_GID;
+  rip->i_nlinks = 2;
+  rip->i_update = ATIME | CTIME | MTIME;
+  rip->i_dirt = DIRTY;
+  root = ROOT_INODE;
+  r = search_dir(rip, dot1, &root, ENTER);
+  if (r == OK) r = search_dir(rip, dot2, &root, ENTER);
+  put_inode(rip);
+  return(r);
+}
+	
+/*===========================================================================*
+ *                              tmp_get                                      *
+ *===========================================================================*/
+PUBLIC struct buf *tmp_get(dev, block)
+dev_t dev;                              /* tmpfs device */
+block_t block;                          /* which block is wanted? */
+{
+/* Find a block of a tmpfs.  Every block that is in use on a tmpfs is in the
+ * pool, so there is nothing to read and nothing to evict.  A block that is
+ * not in the pool gives an I/O error.
+ */
+
+  register struct buf *bp;
+
+  for (bp = tmp_hash[(int) block & HASH_MASK]; bp != NIL_BUF; bp = bp->b_hash)
+        if (bp->b_blocknr == block && bp->b_dev == dev) break;
+
+  if (bp == NIL_BUF) {
+        /* The block was never allocated, e.g. when the device itself is
+         * read.  Fail like a disk read does: hand out an unnamed cache block
+         * and report the error in 'rdwt_err'.
+         */
+        rdwt_err = EIO;
+        return(get_block(NO_DEV, block, NORMAL));
+  }
+  bp->b_count++;
+  return(bp);
+}
+	
+/*===========================================================================*
+ *                              tmp_alloc                                    *
+ *===========================================================================*/
+PUBLIC int tmp_alloc(dev, block)
+dev_t dev;                              /* tmpfs device */
+block_t block;                          /* block that has just been allocated */
+{
+/* Take a block from the pool for a newly allocated zone and clear it.  The
+ * block may still be there if its zone was freed while it was in use.
+ */
+
+  register struct buf *bp;
+  int b;
+
+  b = (int) block & HASH_MASK;
+  for (bp = tmp_hash[b]; bp != NIL_BUF; bp = bp->b_hash)
+        if (bp->b_blocknr == block && bp->b_dev == dev) break;
+
+  if (bp == NIL_BUF) {
+        if ( (bp = tmp_free_list) == NIL_BUF) return(ENOSPC);
+        tmp_free_list = bp->b_next;
+        bp->b_dev = dev;
+        bp->b_blocknr = block;
+        bp->b_count = 0;
+        bp->b_hash = tmp_hash[b];
+        tmp_hash[b] = bp;
+  }
+  memset(bp->b_data, 0, MAX_BLOCK_SIZE);
+  bp->b_dirt = CLEAN;
+  return(OK);
+}
+	
+/*===========================================================================*
+ *                              tmp_free                                     *
+ *===========================================================================*/
+PUBLIC void tmp_free(dev, block)
+dev_t dev;                              /* tmpfs device */
+block_t block;                          /* block whose zone has been freed */
+{
+/* Return the block of a freed zone to the pool.  A block that is still in
+ * use stays where it is until its zone is allocated again, or until the
+ * file system is unmounted.
+ */
+
+  register struct buf *bp;
+
+  for (bp = tmp_hash[(int) block & HASH_MASK]; bp != NIL_BUF; bp = bp->b_hash)
+        if (bp->b_blocknr == block && bp->b_dev == dev) break;
+  if (bp != NIL_BUF && bp->b_count == 0) tmp_drop(bp);
+}
+	
+/*===========================================================================*
+ *                              tmp_release                                  *
+ *===========================================================================*/
+PUBLIC void tmp_release(dev)
+dev_t dev;                              /* tmpfs device */
+{
+/* Return all blocks of a tmpfs to the pool, and give up its reservation,
+ * when it is unmounted or fails to mount.  The zone count is only set once
+ * the reservation has been made.
+ */
+
+  register struct buf *bp;
+  struct super_block *sp;
+
+  for (bp = &tmp_pool[0]; bp < &tmp_pool[NR_TMP_BUFS]; bp++)
+        if (bp->b_dev == dev) tmp_drop(bp);
+
+  sp = get_super(dev);
+  if (sp->s_zones != 0) tmp_reserved -= (int) (sp->s_zones - START_BLOCK);
+}
+	
+/*===========================================================================*
+ *                              tmp_drop                                     *
+ *===========================================================================*/
+PRIVATE void tmp_drop(bp)
+register struct buf *bp;                /* block to be returned */
+{
+/* Remove a block from its hash chain and put it on the free list. */
+
+  register struct buf **hpp;
+
+  hpp = &tmp_hash[(int) bp->b_blocknr & HASH_MASK];
+  while (*hpp != bp) hpp = &(*hpp)->b_hash;
+  *hpp = bp->b_hash;
+
+  bp->b_dev = NO_DEV;
+  bp->b_blocknr = NO_BLOCK;
+  bp->b_next = tmp_free_list;
+  tmp_free_list = bp;
+}
+
+
+
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
                                       servers/fs/inode.c
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
@@ -18968,17 +22006,15 @@ PUBLIC void lock_revive()
  * tradeoff.  Figuring out exactly which ones to unblock now would take 
  * extra code, and the only thing it would win would be some performance in 
  * extremely rare circumstances (namely, that somebody actually used 
- * locking).
+ * locking).  The waiters are kept on a list by suspend(), so the process
+ * table need not be searched.
  */
 
-  int task;
   struct fproc *fptr;
 
-  for (fptr = &fproc[INIT_PROC_NR + 1]; fptr < &fproc[NR_PROCS]; fptr++){
-        task = -fptr->fp_task;
-        if (fptr->fp_suspended == SUSPENDED && task == XLOCK) {
-                revive( (int) (fptr - fproc), 0);
-        }
+  while ((fptr = lock_waiters) != NIL_FPROC) {
+        lock_waiters = fptr->fp_nextsusp;
+        revive( (int) (fptr - fproc), 0);
   }
 }
 
@@ -19094,20 +22130,20 @@ PRIVATE void get_work()
   register struct fproc *rp;
 
   if (reviving != 0) {
-        /* Revive a suspended process. */
-        for (rp = &fproc[0]; rp < &fproc[NR_PROCS]; rp++) 
-                if (rp->fp_revived == REVIVING) {
-                        who = (int)(rp - fproc);
-                        call_nr = rp->fp_fd & BYTE;
-                        m_in.fd = (rp->fp_fd >>8) & BYTE;
-                        m_in.buffer = rp->fp_buffer;
-                        m_in.nbytes = rp->fp_nbytes;
-                        rp->fp_suspended = NOT_SUSPENDED; /*no longer hanging*/
-                        rp->fp_revived = NOT_REVIVING;
-                        reviving--;
-                        return;
-                }
-        panic(__FILE__,"get_work couldn't revive anyone", NO_NUM);
+        /* Revive the first process on the revive queue. */
+        if ((rp = revive_head) == NIL_FPROC)
+                panic(__FILE__,"get_work couldn't revive anyone", NO_NUM);
+        if ((revive_head = rp->fp_nextsusp) == NIL_FPROC)
+                revive_tail = NIL_FPROC;
+        who = (int)(rp - fproc);
+        call_nr = rp->fp_fd & BYTE;
+        m_in.fd = (rp->fp_fd >>8) & BYTE;
+        m_in.buffer = rp->fp_buffer;
+        m_in.nbytes = rp->fp_nbytes;
+        rp->fp_suspended = NOT_SUSPENDED; /*no longer hanging*/
+        rp->fp_revived = NOT_REVIVING;
+        reviving--;
+        return;
   }
 
   /* Normal case.  No one to revive. */
@@ -19169,8 +22205,14 @@ PRIVATE void fs_init()
   register struct inode *rip;
   register struct fproc *rfp;
   message mess;
+  struct kinfo kinfo;
   int s;
 
+  /* Use as many process slots as the kernel does. */
+  if ((s=sys_getkinfo(&kinfo)) != OK)
+        panic(__FILE__,"FS couldn't get kernel info", s);
+  nr_procs = kinfo.nr_procs;
+
   /* Initialize the process table with help of the process manager messages. 
    * Expect one message for each system process with its slot number and pid. 
    * When no more processes follow, the magic process number NONE is sent. 
@@ -19209,13 +22251,14 @@ PRIVATE void fs_init()
   who = FS_PROC_NR;
 
   buf_pool();                   /* initialize buffer pool */
+  tmp_init();                   /* initialize tmpfs block pool */
   build_dmap();                 /* build device table and map boot driver */
   load_ram();                   /* init RAM disk, load if it is root */
   load_super(root_dev);         /* load super block for root device */
   init_select();                /* init select() structures */
 
   /* The root device can now be accessed; set process directories. */
-  for (rfp=&fproc[0]; rfp < &fproc[NR_PROCS]; rfp++) {
+  for (rfp=&fproc[0]; rfp < &fproc[nr_procs]; rfp++) {
         if (rfp->fp_pid != PID_FREE) {
                 rip = get_inode(root_dev, ROOT_INODE);
                 dup_inode(rip);
@@ -19456,6 +22499,7 @@ dev_t super_dev;                        /* place to get superblock from */
  *   do_mknod:   perform the MKNOD system call
  *   do_mkdir:   perform the MKDIR system call
  *   do_close:   perform the CLOSE system call
+ *   do_spawnfd: apply a SPAWN file action to a child (called by PM)
  *   do_lseek:   perform the LSEEK system call
  */
 
@@ -19848,7 +22892,7 @@ PUBLIC int do_close()
   /* If the inode being closed is a pipe, release everyone hanging on it. */
   if (rip->i_pipe == I_PIPE) {
         rw = (rfilp->filp_mode & R_BIT ? WRITE :  READ);
-        release(rip, rw, NR_PROCS);
+        release(rip, rw, nr_procs);
   }
 
   /* If a write has been done, the inode is already marked as DIRTY. */
@@ -19879,7 +22923,44 @@ PUBLIC int do_close()
                 nr_locks--;
         }
   }
-  if (nr_locks < lock_count) lock_revive();     /* lock released */
+  if (nr_locks < lock_count) lock_revive();     /* lock released */
+  return(OK);
+}
+	
+/*===========================================================================*
+ *                              do_spawnfd                                   *
+ *===========================================================================*/
+PUBLIC int do_spawnfd()
+{
+/* PM is building a child for SPAWN and wants one of the caller's file actions
+ * carried out on the child's descriptors: close spawn_fd, or make it refer to
+ * the same filp as spawn_oldfd.  This happens after FORK, so the child starts
+ * out with the parent's descriptors, and before the new image is loaded.
+ */
+  register struct filp *f;
+  int fd, oldfd, r;
+
+  if (who != PM_PROC_NR) return(EPERM);
+  fd = m_in.spawn_fd;
+  oldfd = m_in.spawn_oldfd;
+  fp = &fproc[m_in.slot1];      /* act on behalf of the child */
+
+  if (oldfd < 0) {
+        m_in.fd = fd;
+        return(do_close());
+  }
+
+  /* Like dup2(oldfd, fd): close fd first if it is open. */
+  if ( (f = get_filp(oldfd)) == NIL_FILP) return(err_code);
+  if (fd < 0 || fd >= OPEN_MAX) return(EBADF);
+  if (fd == oldfd) return(OK);
+  if (fp->fp_filp[fd] != NIL_FILP) {
+        m_in.fd = fd;
+        if ((r = do_close()) != OK) return(r);
+  }
+  fp->fp_filp[fd] = f;
+  fp->fp_cloexec &= ~(1L << fd);
+  f->filp_count++;
   return(OK);
 }
 	
@@ -19964,6 +23045,75 @@ PUBLIC int do_read()
   return(read_write(READING));
 }
 	
+/*===========================================================================*
+ *                              do_execload                                  *
+ *===========================================================================*/
+PUBLIC int do_execload()
+{
+/* PM wants the text and data segments of an EXEC read into the new image,
+ * but does not wait for them.  Each is read as one transfer straight into
+ * the process, using PM's trick of putting the process and segment into the
+ * upper bits of the file descriptor (see rw_seg() in PM); rahead() sees the
+ * whole segment coming.  Then the new image gets its effective ids and loses
+ * its FD_CLOEXEC files, and PM's exec file is closed.  The reply goes out
+ * with senda(), as PM may be busy with a call to FS.
+ */
+  static asynmsg_t load_rep;    /* reply to PM, passed to senda() */
+  int fd, proc, flags, r, s;
+  long text_bytes, data_bytes;
+  uid_t uid;
+  gid_t gid;
+  struct filp *f;
+
+  if (who != PM_PROC_NR) return(EPERM);
+
+  fd = m_in.load_fd;
+  proc = m_in.load_proc;
+  flags = (int) m_in.load_flags;
+  uid = (uid_t) m_in.load_uid;
+  gid = (gid_t) m_in.load_gid;
+  text_bytes = m_in.load_text;
+  data_bytes = m_in.load_data;
+
+  /* Stop at a failed or short read.  PM kills the process then. */
+  r = OK;
+  if (proc == NONE) {
+        /* PM has killed the process meanwhile; only close the file. */
+  } else if (flags & LD_SHARED) {
+        /* The text is in memory already; skip it. */
+        if ((f = get_filp(fd)) != NIL_FILP) f->filp_pos += text_bytes;
+  } else if (text_bytes > 0) {
+        m_in.fd = (proc << 7) | (T << 5) | fd;
+        m_in.buffer = (char *) 0;       /* segments of a new image start at 0 */
+        m_in.nbytes = (int) text_bytes;
+        if (read_write(READING) != text_bytes) r = EIO;
+  }
+  if (proc != NONE && r == OK && data_bytes > 0) {
+        m_in.fd = (proc << 7) | (D << 5) | fd;
+        m_in.buffer = (char *) 0;
+        m_in.nbytes = (int) data_bytes;
+        if (read_write(READING) != data_bytes) r = EIO;
+  }
+  m_in.fd = fd;
+  (void) do_close();                    /* PM's exec file */
+
+  if (proc != NONE) {
+        /* Do what PM's SETUID, SETGID and EXEC requests would. */
+        if (flags & LD_SETUID) fproc[proc].fp_effuid = uid;
+        if (flags & LD_SETGID) fproc[proc].fp_effgid = gid;
+        m_in.slot1 = proc;
+        (void) do_exec();               /* close the FD_CLOEXEC files */
+  }
+
+  load_rep.dst = PM_PROC_NR;
+  load_rep.msg.m_type = EXEC_LOAD;
+  load_rep.msg.load_status = r;
+  load_rep.flags = AMF_VALID;
+  if ((s = senda(&load_rep, 1)) != OK)
+        panic(__FILE__, "FS can't reply to EXEC_LOAD", s);
+  return(SUSPEND);                      /* reply has been sent */
+}
+	
 /*===========================================================================*
  *                              read_write                                   *
  *===========================================================================*/
@@ -20780,6 +23930,9 @@ register struct buf *bp;        /* pointer to buffer to zero */
 #include "super.h"
 #include "select.h"
 
+FORWARD _PROTOTYPE( struct fproc **susp_list, (struct fproc *rfp)       );
+FORWARD _PROTOTYPE( void susp_unlink, (struct fproc *rfp)               );
+
 /*===========================================================================*
  *                              do_pipe                                      *
  *===========================================================================*/
@@ -20931,7 +24084,11 @@ int task;                       /* who is proc waiting for? (PIPE = pipe) */
  * (Actually they are not used when a process is waiting for an I/O device,
  * but they are needed for pipes, and it is not worth making the distinction.)
  * The SUSPEND pseudo error should be returned after calling suspend().
+ * A process waiting for a pipe is put on the list of the pipe's inode, one
+ * waiting for a lock on the list of lock waiters, so that neither has to be
+ * found by searching the process table.
  */
+  struct fproc **fpp;
 
   if (task == XPIPE || task == XPOPEN) susp_count++;/* #procs susp'ed on pipe*/
   fp->fp_suspended = SUSPENDED;
@@ -20944,6 +24101,61 @@ int task;                       /* who is proc waiting for? (PIPE = pipe) */
         fp->fp_buffer = m_in.buffer;            /* for reads and writes */
         fp->fp_nbytes = m_in.nbytes;
   }
+
+  /* Append the caller to its wait list, to be released in order. */
+  if ((fpp = susp_list(fp)) != (struct fproc **) NULL) {
+        while (*fpp != NIL_FPROC) fpp = &(*fpp)->fp_nextsusp;
+        *fpp = fp;
+        fp->fp_nextsusp = NIL_FPROC;
+  }
+}
+	
+/*===========================================================================*
+ *                              susp_list                                    *
+ *===========================================================================*/
+PRIVATE struct fproc **susp_list(rfp)
+struct fproc *rfp;              /* suspended process */
+{
+/* Return the list a suspended process waits on, NULL if it has none. */
+  int task;
+
+  task = -rfp->fp_task;
+  if (task == XLOCK) return(&lock_waiters);
+  if (task == XPIPE || task == XPOPEN)
+        return(&rfp->fp_filp[(rfp->fp_fd >> 8) & BYTE]->filp_ino->i_waiters);
+  return((struct fproc **) NULL);
+}
+	
+/*===========================================================================*
+ *                              susp_unlink                                  *
+ *===========================================================================*/
+PRIVATE void susp_unlink(rfp)
+struct fproc *rfp;              /* process that stops waiting */
+{
+/* Take a process that is no longer suspended off the list it waits on, or
+ * off the revive queue if it was about to be revived.
+ */
+  struct fproc **fpp, *prev;
+
+  if (rfp->fp_revived == REVIVING) {
+        prev = NIL_FPROC;
+        for (fpp = &revive_head; *fpp != rfp; fpp = &(*fpp)->fp_nextsusp) {
+                if (*fpp == NIL_FPROC) return;
+                prev = *fpp;
+        }
+        *fpp = rfp->fp_nextsusp;
+        if (revive_tail == rfp) revive_tail = prev;
+        rfp->fp_revived = NOT_REVIVING;
+        reviving--;
+        return;
+  }
+  if ((fpp = susp_list(rfp)) == (struct fproc **) NULL) return;
+  for (; *fpp != NIL_FPROC; fpp = &(*fpp)->fp_nextsusp) {
+        if (*fpp == rfp) {
+                *fpp = rfp->fp_nextsusp;
+                return;
+        }
+  }
 }
 	
 /*===========================================================================*
@@ -20959,7 +24171,7 @@ int count;                      /* max number of processes to release */
  * release it.
  */
 
-  register struct fproc *rp;
+  register struct fproc *rp, **rpp;
   struct filp *f;
 
   /* Trying to perform the call also includes SELECTing on it with that
@@ -20980,16 +24192,17 @@ int count;                      /* max number of processes to release */
         }
   }
 
-  /* Search the proc table. */
-  for (rp = &fproc[0]; rp < &fproc[NR_PROCS]; rp++) {
-        if (rp->fp_suspended == SUSPENDED &&
-                        rp->fp_revived == NOT_REVIVING &&
-                        (rp->fp_fd & BYTE) == call_nr &&
-                        rp->fp_filp[rp->fp_fd>>8]->filp_ino == ip) {
-                revive((int)(rp - fproc), 0);
-                susp_count--;   /* keep track of who is suspended */
-                if (--count == 0) return;
+  /* Search the processes waiting on this pipe. */
+  rpp = &ip->i_waiters;
+  while ((rp = *rpp) != NIL_FPROC) {
+        if ((rp->fp_fd & BYTE) != call_nr) {
+                rpp = &rp->fp_nextsusp;
+                continue;
         }
+        *rpp = rp->fp_nextsusp;         /* no longer waiting on the pipe */
+        revive((int)(rp - fproc), 0);
+        susp_count--;   /* keep track of who is suspended */
+        if (--count == 0) return;
   }
 }
 	
@@ -21007,7 +24220,7 @@ int returned;                   /* if hanging on task, how many bytes read */
   register struct fproc *rfp;
   register int task;
 
-  if (proc_nr < 0 || proc_nr >= NR_PROCS)
+  if (proc_nr < 0 || proc_nr >= nr_procs)
         panic(__FILE__,"revive err", proc_nr);
   rfp = &fproc[proc_nr];
   if (rfp->fp_suspended == NOT_SUSPENDED || rfp->fp_revived == REVIVING)return;
@@ -21019,9 +24232,15 @@ int returned;                   /* if hanging on task, how many bytes read */
    */
   task = -rfp->fp_task;
   if (task == XPIPE || task == XLOCK) {
-        /* Revive a process suspended on a pipe or lock. */
+        /* Revive a process suspended on a pipe or lock.  The caller has
+         * taken it off the list it waited on; queue it for get_work().
+         */
         rfp->fp_revived = REVIVING;
         reviving++;             /* process was waiting on pipe or lock */
+        rfp->fp_nextsusp = NIL_FPROC;
+        if (revive_tail == NIL_FPROC) revive_head = rfp;
+        else revive_tail->fp_nextsusp = rfp;
+        revive_tail = rfp;
   } else {
         rfp->fp_suspended = NOT_SUSPENDED;
         if (task == XPOPEN) /* process blocked in open or create */
@@ -21053,11 +24272,12 @@ PUBLIC int do_unpause()
 
   if (who > PM_PROC_NR) return(EPERM);
   proc_nr = m_in.pro;
-  if (proc_nr < 0 || proc_nr >= NR_PROCS)
+  if (proc_nr < 0 || proc_nr >= nr_procs)
         panic(__FILE__,"unpause err 1", proc_nr);
   rfp = &fproc[proc_nr];
   if (rfp->fp_suspended == NOT_SUSPENDED) return(OK);
   task = -rfp->fp_task;
+  susp_unlink(rfp);             /* off its wait list or the revive queue */
 
   switch (task) {
         case XPIPE:              /* process trying to read or write a pipe */
@@ -21528,7 +24748,9 @@ int flag;                        /* LOOK_UP, ENTER, DELETE or IS_EMPTY */
                                       servers/fs/mount.c
 ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
-/* This file performs the MOUNT and UMOUNT system calls.
+/* This file performs the MOUNT and UMOUNT system calls.  Mounting a block
+ * special file with major device TMPFS_MAJOR makes a new, empty tmpfs, whose
+ * size is set by the minor device number.
  *
  * The entry points into this file are
  *   do_mount:   perform the MOUNT system call
@@ -21547,6 +24769,7 @@ int flag;                        /* LOOK_UP, ENTER, DELETE or IS_EMPTY */
 #include "super.h"
 
 FORWARD _PROTOTYPE( dev_t name_to_dev, (char *path)                     );
+FORWARD _PROTOTYPE( void close_fs_dev, (Dev_t dev)                      );
 
 /*===========================================================================*
  *                              do_mount                                     *
@@ -21579,33 +24802,39 @@ PUBLIC int do_mount()
   if (found) return(EBUSY);     /* already mounted */
   if (sp == NIL_SUPER) return(ENFILE);  /* no super block available */
 
-  /* Open the device the file system lives on. */
-  if (dev_open(dev, who, m_in.rd_only ? R_BIT :  (R_BIT|W_BIT)) != OK) 
-        return(EINVAL);
+  if (IS_TMPFS(dev)) {
+        /* A tmpfs has no device; make an empty file system in memory. */
+        sp->s_dev = dev;
+        r = tmp_mkfs(sp);
+  } else {
+        /* Open the device the file system lives on. */
+        if (dev_open(dev, who, m_in.rd_only ? R_BIT :  (R_BIT|W_BIT)) != OK) 
+                return(EINVAL);
 
-  /* Make the cache forget about blocks it has open on the filesystem */
-  (void) do_sync();
-  invalidate(dev);
+        /* Make the cache forget about blocks it has open on the filesystem */
+        (void) do_sync();
+        invalidate(dev);
 
-  /* Fill in the super block. */
-  sp->s_dev = dev;              /* read_super() needs to know which dev */
-  r = read_super(sp);
+        /* Fill in the super block. */
+        sp->s_dev = dev;        /* read_super() needs to know which dev */
+        r = read_super(sp);
+  }
 
   /* Is it recognized as a Minix filesystem? */
   if (r != OK) {
-        dev_close(dev);
+        close_fs_dev(dev);
         sp->s_dev = NO_DEV;
         return(r);
   }
 
   /* Now get the inode of the file to be mounted on. */
   if (fetch_name(m_in.name2, m_in.name2_length, M1) != OK) {
-        dev_close(dev);
+        close_fs_dev(dev);
         sp->s_dev = NO_DEV;
         return(err_code);
   }
   if ( (rip = eat_path(user_path)) == NIL_INODE) {
-        dev_close(dev);
+        close_fs_dev(dev);
         sp->s_dev = NO_DEV;
         return(err_code);
   }
@@ -21640,7 +24869,7 @@ PUBLIC int do_mount()
         put_inode(root_ip);
         (void) do_sync();
         invalidate(dev);
-        dev_close(dev);
+        close_fs_dev(dev);
         sp->s_dev = NO_DEV;
         return(r);
   }
@@ -21706,14 +24935,16 @@ Dev_t dev;
         return(EINVAL);
   }
 
-  /* Close the device the file system lives on. */
-  dev_close(dev);
-
   /* Finish off the unmount. */
   sp->s_imount->i_mount = NO_MOUNT;     /* inode returns to normal */
   put_inode(sp->s_imount);      /* release the inode mounted on */
   put_inode(sp->s_isup);        /* release the root inode of the mounted fs */
   sp->s_imount = NIL_INODE;
+
+  /* Close the device the file system lives on.  This comes after the root
+   * inode is released, since a tmpfs cannot write it back once it is gone.
+   */
+  close_fs_dev(dev);
   sp->s_dev = NO_DEV;
   return(OK);
 }
@@ -21746,6 +24977,20 @@ char *path;                     /* pointer to path name */
   put_inode(rip);
   return(dev);
 }
+	
+/*===========================================================================*
+ *                              close_fs_dev                                 *
+ *===========================================================================*/
+PRIVATE void close_fs_dev(dev)
+dev_t dev;                      /* device a file system was mounted from */
+{
+/* Close the device of a file system that is unmounted or failed to mount.
+ * A tmpfs has no device, but its blocks go back to the tmpfs pool.
+ */
+
+  if (IS_TMPFS(dev)) tmp_release(dev);
+  else dev_close(dev);
+}
 
 
 
@@ -22150,7 +25395,7 @@ char dir_name[NAME_MAX];                /* name of directory to be removed */
   if (strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0)return(EINVAL);
   if (rip->i_num == ROOT_INODE) return(EBUSY); /* can't remove 'root' */
   
-  for (rfp = &fproc[INIT_PROC_NR + 1]; rfp < &fproc[NR_PROCS]; rfp++)
+  for (rfp = &fproc[INIT_PROC_NR + 1]; rfp < &fproc[nr_procs]; rfp++)
         if (rfp->fp_workdir == rip || rfp->fp_rootdir == rip) return(EBUSY);
                                 /* can't remove anybody's working dir */
 
@@ -22722,6 +25967,7 @@ PRIVATE struct dmap init_dmap[] = {
   DT(1, gen_opcl, gen_io,  LOG_PROC_NR, 0)              /*15 = /dev/klog  */
   DT(0, no_dev,   0,       NONE,        DMAP_MUTABLE)   /*16 = /dev/random*/
   DT(0, no_dev,   0,       NONE,        DMAP_MUTABLE)   /*17 = /dev/cmos  */
+  DT(0, no_dev,   0,       NONE,        0)              /*18 = /dev/tmpfs */
 };
 
 /*===========================================================================*
@@ -22763,6 +26009,7 @@ int style;                      /* style of the device */
 
   /* Get pointer to device entry in the dmap table. */
   if (major >= NR_DEVICES) return(ENODEV);
+  if (major == TMPFS_MAJOR) return(EPERM);      /* served by FS itself */
   dp = &dmap[major];            
         
   /* See if updating the entry is allowed. */
@@ -23050,7 +26297,7 @@ int flags;                      /* mode bits and flags */
   if (!fp->fp_sesldr || fp->fp_tty != 0) {
         flags |= O_NOCTTY;
   } else {
-        for (rfp = &fproc[0]; rfp < &fproc[NR_PROCS]; rfp++) {
+        for (rfp = &fproc[0]; rfp < &fproc[nr_procs]; rfp++) {
                 if (rfp->fp_tty == dev) flags |= O_NOCTTY;
         }
   }
@@ -23369,3 +26616,438 @@ PUBLIC int do_stime()
   return(OK);
 }
 	
+
+
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      lib/timers/timers.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* This file contains the timer queue functions declared in <timers.h>.  A
+ * queue is kept as a pairing heap, ordered by expiration time, so that the
+ * queue pointer always refers to the timer that is due first, as the users
+ * of the library expect.  Setting a timer takes constant time.  Clearing one
+ * and running the expired ones take amortized logarithmic time, instead of
+ * time linear in the number of timers as with a sorted list.
+ *
+ * The heap is linked through the timers themselves.  'tmr_child' points to
+ * the first child of a timer, 'tmr_next' to its next sibling, and 'tmr_prev'
+ * to its previous sibling, or to its parent if it is a first child.  The
+ * timer at the top has neither siblings nor a parent.  A timer is only taken
+ * to be in the heap if the timer its 'tmr_prev' names links back to it, so
+ * stale links in a copied or uninitialized timer do no harm.
+ *
+ * The entry points into this file are:
+ *   tmrs_settimer:  (re)set a watchdog timer in a timers queue
+ *   tmrs_clrtimer:  remove a timer from a timers queue
+ *   tmrs_exptimers: remove expired timers and run their watchdog functions
+ */
+
+#include <stddef.h>
+#include <timers.h>
+
+static _PROTOTYPE( timer_t *meld, (timer_t *a, timer_t *b)              );
+static _PROTOTYPE( timer_t *merge_pairs, (timer_t *first)               );
+static _PROTOTYPE( void unlink_tmr, (timer_t **tmrs, timer_t *tp)       );
+static _PROTOTYPE( int in_heap, (timer_t **tmrs, timer_t *tp)           );
+
+/*===========================================================================*
+ *                              tmrs_settimer                                *
+ *===========================================================================*/
+clock_t tmrs_settimer(tmrs, tp, exp_time, watchdog, new_head)
+timer_t **tmrs;                         /* pointer to timers queue */
+timer_t *tp;                            /* the timer to be added */
+clock_t exp_time;                       /* its expiration time */
+tmr_func_t watchdog;                    /* watchdog function to be run */
+clock_t *new_head;                      /* new earliest timer, if not NULL */
+{
+/* Activate a timer to run function 'watchdog' at absolute time 'exp_time'.
+ * If the timer is already in use it is first removed from the timers queue.
+ * Return the expiration time of the earliest timer before the call, or 0.
+ */
+  clock_t old_head = 0;
+
+  if (*tmrs != NULL) old_head = (*tmrs)->tmr_exp_time;
+
+  (void) tmrs_clrtimer(tmrs, tp, NULL);
+  tp->tmr_exp_time = exp_time;
+  tp->tmr_func = watchdog;
+  *tmrs = (*tmrs == NULL) ? tp : meld(*tmrs, tp);
+
+  if (new_head != NULL) *new_head = (*tmrs)->tmr_exp_time;
+  return(old_head);
+}
+	
+/*===========================================================================*
+ *                              tmrs_clrtimer                                *
+ *===========================================================================*/
+clock_t tmrs_clrtimer(tmrs, tp, new_head)
+timer_t **tmrs;                         /* pointer to timers queue */
+timer_t *tp;                            /* the timer to be removed */
+clock_t *new_head;                      /* new earliest timer, if not NULL */
+{
+/* Deactivate a timer and remove it from the timers queue, if it is in it.
+ * Return the expiration time of the earliest timer before the call, or 0.
+ */
+  clock_t prev_time = 0;
+
+  if (*tmrs != NULL) prev_time = (*tmrs)->tmr_exp_time;
+
+  if (in_heap(tmrs, tp)) unlink_tmr(tmrs, tp);
+  else tp->tmr_next = tp->tmr_prev = tp->tmr_child = NULL;
+  tp->tmr_exp_time = TMR_NEVER;
+
+  if (new_head != NULL) *new_head = (*tmrs != NULL) ? (*tmrs)->tmr_exp_time : 0;
+  return(prev_time);
+}
+	
+/*===========================================================================*
+ *                              tmrs_exptimers                               *
+ *===========================================================================*/
+void tmrs_exptimers(tmrs, now, new_head)
+timer_t **tmrs;                         /* pointer to timers queue */
+clock_t now;                            /* current time */
+clock_t *new_head;                      /* new earliest timer, if not NULL */
+{
+/* Use the current time to check the timers queue for expired timers.  Run
+ * the watchdog function of each, after taking it out of the queue, so that
+ * the watchdog may set it again.
+ */
+  timer_t *tp;
+
+  while (*tmrs != NULL && (*tmrs)->tmr_exp_time <= now) {
+        tp = *tmrs;
+        unlink_tmr(tmrs, tp);
+        tp->tmr_exp_time = TMR_NEVER;
+        (*tp->tmr_func)(tp);
+  }
+
+  if (new_head != NULL) *new_head = (*tmrs != NULL) ? (*tmrs)->tmr_exp_time : 0;
+}
+	
+/*===========================================================================*
+ *                              meld                                         *
+ *===========================================================================*/
+static timer_t *meld(a, b)
+timer_t *a;                             /* top of one heap */
+timer_t *b;                             /* top of another heap */
+{
+/* Combine two heaps into one: the timer that expires later becomes the first
+ * child of the other.  Return the top of the new heap.
+ */
+  timer_t *t;
+
+  if (b->tmr_exp_time < a->tmr_exp_time) {
+        t = a;
+        a = b;
+        b = t;
+  }
+  b->tmr_prev = a;
+  b->tmr_next = a->tmr_child;
+  if (b->tmr_next != NULL) b->tmr_next->tmr_prev = b;
+  a->tmr_child = b;
+  return(a);
+}
+	
+/*===========================================================================*
+ *                              merge_pairs                                  *
+ *===========================================================================*/
+static timer_t *merge_pairs(first)
+timer_t *first;                         /* first of a list of siblings */
+{
+/* Combine a list of sibling heaps into one.  First meld them in pairs from
+ * left to right, then meld the pairs from right to left.  The two passes are
+ * what make the operations on the heap cheap in the long run.
+ */
+  timer_t *a, *b, *rest, *pairs, *top;
+
+  pairs = NULL;
+  while (first != NULL) {
+        a = first;
+        b = a->tmr_next;
+        rest = (b != NULL) ? b->tmr_next : NULL;
+        a->tmr_next = a->tmr_prev = NULL;
+        if (b != NULL) {
+                b->tmr_next = b->tmr_prev = NULL;
+                a = meld(a, b);
+        }
+        a->tmr_next = pairs;            /* stack up the pairs */
+        pairs = a;
+        first = rest;
+  }
+
+  top = NULL;
+  while (pairs != NULL) {
+        a = pairs;
+        pairs = a->tmr_next;
+        a->tmr_next = NULL;
+        top = (top == NULL) ? a : meld(top, a);
+  }
+  return(top);
+}
+	
+/*===========================================================================*
+ *                              unlink_tmr                                   *
+ *===========================================================================*/
+static void unlink_tmr(tmrs, tp)
+timer_t **tmrs;                         /* pointer to timers queue */
+timer_t *tp;                            /* timer in the queue */
+{
+/* Take a timer out of the heap.  Its children are combined into one heap,
+ * which takes its place.
+ */
+  timer_t *sub;
+
+  if (tp == *tmrs) {
+        *tmrs = merge_pairs(tp->tmr_child);
+  } else {
+        /* Cut the timer, with the heap below it, out of its parent's list. */
+        if (tp->tmr_prev->tmr_child == tp)
+                tp->tmr_prev->tmr_child = tp->tmr_next;
+        else
+                tp->tmr_prev->tmr_next = tp->tmr_next;
+        if (tp->tmr_next != NULL) tp->tmr_next->tmr_prev = tp->tmr_prev;
+
+        sub = merge_pairs(tp->tmr_child);
+        if (sub != NULL) *tmrs = meld(*tmrs, sub);
+  }
+  tp->tmr_next = tp->tmr_prev = tp->tmr_child = NULL;
+}
+	
+/*===========================================================================*
+ *                              in_heap                                      *
+ *===========================================================================*/
+static int in_heap(tmrs, tp)
+timer_t **tmrs;                         /* pointer to timers queue */
+timer_t *tp;                            /* timer to check */
+{
+/* Tell whether a timer is in the heap.  It is if it is at the top, or if its
+ * parent or previous sibling links to it.  Those links are only made by
+ * meld() and only undone by unlink_tmr(), so a copy of a timer that is in
+ * the heap is not taken for the timer itself.
+ */
+  if (tp == *tmrs) return(1);
+  if (tp->tmr_prev == NULL) return(0);
+  return(tp->tmr_prev->tmr_child == tp || tp->tmr_prev->tmr_next == tp);
+}
+	
+
+
+
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      lib/syslib/sys_vcopy.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* The vectored copy calls.  The kernel does not translate SELF inside a copy
+ * vector, so callers must fill in their own process number.
+ */
+
+#include "syslib.h"
+
+/*===========================================================================*
+ *                              sys_virvcopy                                 *
+ *===========================================================================*/
+PUBLIC int sys_virvcopy(vec_ptr, vec_size, nr_ok)
+struct vir_cp_req *vec_ptr;     /* pointer to copy vector */
+int vec_size;                   /* number of elements in copy vector */
+int *nr_ok;                     /* number of successful copies */
+{
+/* Transfer data with virtual addressing, a whole vector at a time. */
+  message m;
+  int r;
+
+  m.VCP_VEC_SIZE = vec_size;
+  m.VCP_VEC_ADDR = (char *) vec_ptr;
+  r = _taskcall(SYSTASK, SYS_VIRVCOPY, &m);
+  *nr_ok = m.VCP_NR_OK;
+  return(r);
+}
+	
+/*===========================================================================*
+ *                              sys_physvcopy                                *
+ *===========================================================================*/
+PUBLIC int sys_physvcopy(vec_ptr, vec_size, nr_ok)
+struct vir_cp_req *vec_ptr;     /* pointer to copy vector */
+int vec_size;                   /* number of elements in copy vector */
+int *nr_ok;                     /* number of successful copies */
+{
+/* Transfer data with physical addressing, a whole vector at a time. */
+  message m;
+  int r;
+
+  m.VCP_VEC_SIZE = vec_size;
+  m.VCP_VEC_ADDR = (char *) vec_ptr;
+  r = _taskcall(SYSTASK, SYS_PHYSVCOPY, &m);
+  *nr_ok = m.VCP_NR_OK;
+  return(r);
+}
+	
+
+
+
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      lib/syslib/sys_ksigs.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* The batched kernel signal calls.  PM fetches the pending kernel signals
+ * of up to a vector full of processes with one call, and finishes them all
+ * with another.
+ */
+
+#include "syslib.h"
+
+/*===========================================================================*
+ *                              sys_getksigs                                 *
+ *===========================================================================*/
+PUBLIC int sys_getksigs(ks, max, count)
+struct ksig *ks;                /* vector to store the pending signals in */
+int max;                        /* number of entries in the vector */
+int *count;                     /* number of entries filled in */
+{
+/* Get the pending kernel signals of as many processes as fit in 'ks'. */
+  message m;
+  int r;
+
+  m.SIG_REQUEST = S_GETSIG;
+  m.SIG_VEC = (char *) ks;
+  m.SIG_COUNT = max;
+  r = _taskcall(SYSTASK, SYS_KSIGS, &m);
+  *count = (r == OK) ? m.SIG_COUNT :  0;
+  return(r);
+}
+	
+/*===========================================================================*
+ *                              sys_endksigs                                 *
+ *===========================================================================*/
+PUBLIC int sys_endksigs(ks, count)
+struct ksig *ks;                /* entries handed out by sys_getksigs() */
+int count;                      /* number of them */
+{
+/* Tell the kernel that the signals handed out in 'ks' have been handled. */
+  message m;
+
+  m.SIG_REQUEST = S_ENDSIG;
+  m.SIG_VEC = (char *) ks;
+  m.SIG_COUNT = count;
+  return(_taskcall(SYSTASK, SYS_KSIGS, &m));
+}
+	
+
+
+
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      lib/syslib/sys_setgrant.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+#include "syslib.h"
+
+/*===========================================================================*
+ *                              sys_setgrant                                 *
+ *===========================================================================*/
+PUBLIC int sys_setgrant(gid, who, owner, addr, bytes, access)
+cp_grant_id_t *gid;             /* grant slot, GRANT_INVALID for a new one */
+int who;                        /* process that may use the grant, or ANY */
+int owner;                      /* process whose memory is granted, or SELF */
+vir_bytes addr;                 /* start of granted range (D space) */
+vir_bytes bytes;                /* length of granted range */
+int access;                     /* CPF_READ and/or CPF_WRITE, 0 to revoke */
+{
+/* Publish a memory grant, or revoke it.  Return the slot used in 'gid'. */
+  message m;
+  int r;
+
+  m.SG_GRANT_ID = *gid;
+  m.SG_WHO = who;
+  m.SG_OWNER = owner;
+  m.SG_ADDR = (char *) addr;
+  m.SG_LEN = (long) bytes;
+  m.SG_FLAGS = (long) access;
+  if ((r = _taskcall(SYSTASK, SYS_SETGRANT, &m)) == OK)
+        *gid = access != 0 ? m.SG_GRANT_ID :  GRANT_INVALID;
+  return(r);
+}
+	
+
+
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      lib/syslib/sys_safecopy.c
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+#include "syslib.h"
+
+/*===========================================================================*
+ *                              sys_safecopy                                 *
+ *===========================================================================*/
+PUBLIC int sys_safecopy(req, granter, gid, offset, addr, bytes)
+int req;                        /* CPF_READ (copy from) or CPF_WRITE (to) */
+int granter;                    /* process that made the grant */
+cp_grant_id_t gid;              /* grant id at that process */
+vir_bytes offset;               /* offset within the granted range */
+vir_bytes addr;                 /* address in the caller's D space */
+vir_bytes bytes;                /* number of bytes to copy */
+{
+/* Copy from or to a memory range another process granted to the caller.
+ * Use the sys_safecopyfrom() and sys_safecopyto() shorthands.
+ */
+  message m;
+
+  m.SCP_REQUEST = req;
+  m.SCP_FROM_TO = granter;
+  m.SCP_GID = gid;
+  m.SCP_OFFSET = (long) offset;
+  m.SCP_ADDRESS = (long) addr;
+  m.SCP_BYTES = (long) bytes;
+  return(_taskcall(SYSTASK, SYS_SAFECOPY, &m));
+}
+	
+
+
+
+
+
+
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+                                      lib/i386/rts/_senda.s
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+! senda() for the system call interface of MINIX.  The other IPC primitives
+! are in _ipc.s.  SENDA passes the number of entries where the others pass
+! the source or destination, and the table where they pass the message.
+!
+!   senda(table, count): deliver or queue a table of messages, never blocks
+
+.sect .text; .sect .rom; .sect .data; .sect .bss
+.define __senda
+
+SENDA = 0               ! function code, see kernel/ipc.h
+SYSVEC = 32             ! trap to kernel
+
+TABLE = 8               ! arguments on the stack, past ebp and return address
+COUNT = 12
+
+.sect .text
+__senda:
+        push    ebp
+        mov     ebp, esp
+        push    ebx
+        mov     eax, COUNT(ebp) ! eax = number of entries
+        mov     ebx, TABLE(ebp) ! ebx = table address
+        mov     ecx, SENDA      ! _senda(table, count)
+        int     SYSVEC          ! trap to the kernel
+        pop     ebx
+        pop     ebp
+        ret